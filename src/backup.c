@@ -0,0 +1,373 @@
+/*
+ * winpatch - Windows system file patcher
+ * File backups
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef _DEBUG
+#define _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <winioctl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "msapi_utf8.h"
+#include "winpatch.h"
+
+#define safe_sprintf(dst, count, ...) do {_snprintf_s(dst, count, _TRUNCATE, __VA_ARGS__); (dst)[(count)-1] = 0; } while(0)
+#define static_sprintf(dst, ...) safe_sprintf(dst, sizeof(dst), __VA_ARGS__)
+#define safe_closehandle(h) do {if ((h != INVALID_HANDLE_VALUE) && (h != NULL)) {CloseHandle(h); h = INVALID_HANDLE_VALUE;}} while(0)
+
+/*
+ * A delta backup is a small text file, saved as <name>.delta, that records the size
+ * and SHA-256 of the original file, followed by the original content of every range
+ * that patching and signing alter (the patched data, the CheckSum field, the Security
+ * data directory and the certificate table), as OFFSET HEXBYTES lines.
+ * When a file is patched again, the new ranges are appended, and since ranges are
+ * restored in reverse order, the data from the oldest ones always prevails.
+ */
+#define DELTA_SIGNATURE "# winpatch delta backup"
+// Number of bytes recorded on each line of a delta backup
+#define DELTA_LINE_BYTES 64
+// Block cloning can't process more than 4 GB at once
+#define CLONE_CHUNK_SIZE (1024 * 1024 * 1024)
+
+typedef struct {
+	uint64_t offset;
+	uint32_t len;
+	uint8_t data[DELTA_LINE_BYTES];
+} DELTA_ENTRY;
+
+static BOOL GetBackupPath(const char* path, const char* ext, char* backup_path, size_t size)
+{
+	if (strlen(path) + strlen(ext) + 1 > size)
+		return FALSE;
+	safe_sprintf(backup_path, size, "%s%s", path, ext);
+	return TRUE;
+}
+
+/*
+ * Use block cloning to create a backup that shares its clusters with the original file,
+ * which is instantaneous and doesn't use any extra space. This is only supported on ReFS.
+ * Returns FALSE if the file system can't do it, so that the caller can make a copy instead.
+ */
+static BOOL CloneBackup(const char* path, const char* backup_path)
+{
+	BOOL r = FALSE, created = FALSE;
+	HANDLE hSrc = INVALID_HANDLE_VALUE, hDst = INVALID_HANDLE_VALUE;
+	DWORD dwFlags, dwSize;
+	BY_HANDLE_FILE_INFORMATION info;
+	FSCTL_GET_INTEGRITY_INFORMATION_BUFFER get_integrity;
+	FSCTL_SET_INTEGRITY_INFORMATION_BUFFER set_integrity;
+	DUPLICATE_EXTENTS_DATA dup = { 0 };
+	LARGE_INTEGER liSize;
+	uint64_t pos, len;
+
+	hSrc = CreateFileU(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+	if (hSrc == INVALID_HANDLE_VALUE)
+		return FALSE;
+	if (!GetVolumeInformationByHandleW(hSrc, NULL, 0, NULL, NULL, &dwFlags, NULL, 0) ||
+		!(dwFlags & FILE_SUPPORTS_BLOCK_REFCOUNTING))
+		goto out;
+	// The cloned ranges must be aligned to the cluster size, which ReFS reports along with integrity
+	if (!GetFileInformationByHandle(hSrc, &info) || !GetFileSizeEx(hSrc, &liSize) ||
+		!DeviceIoControl(hSrc, FSCTL_GET_INTEGRITY_INFORMATION, NULL, 0, &get_integrity,
+			sizeof(get_integrity), &dwSize, NULL) || get_integrity.ClusterSizeInBytes == 0)
+		goto out;
+
+	hDst = CreateFileU(backup_path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, 0);
+	if (hDst == INVALID_HANDLE_VALUE)
+		goto out;
+	created = TRUE;
+	// The destination must have the same sparse and integrity attributes as the source
+	if ((info.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE) &&
+		!DeviceIoControl(hDst, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &dwSize, NULL))
+		goto out;
+	set_integrity.ChecksumAlgorithm = get_integrity.ChecksumAlgorithm;
+	set_integrity.Reserved = 0;
+	set_integrity.Flags = get_integrity.Flags;
+	if (!DeviceIoControl(hDst, FSCTL_SET_INTEGRITY_INFORMATION, &set_integrity, sizeof(set_integrity),
+		NULL, 0, &dwSize, NULL))
+		goto out;
+	if (!SetFilePointerEx(hDst, liSize, NULL, FILE_BEGIN) || !SetEndOfFile(hDst))
+		goto out;
+
+	// The last range can go past the end of the file, up to the next cluster boundary
+	dup.FileHandle = hSrc;
+	for (pos = 0; pos < (uint64_t)liSize.QuadPart; pos += len) {
+		len = min((uint64_t)liSize.QuadPart - pos, CLONE_CHUNK_SIZE);
+		dup.SourceFileOffset.QuadPart = pos;
+		dup.TargetFileOffset.QuadPart = pos;
+		dup.ByteCount.QuadPart = (len + get_integrity.ClusterSizeInBytes - 1) &
+			~((uint64_t)get_integrity.ClusterSizeInBytes - 1);
+		if (!DeviceIoControl(hDst, FSCTL_DUPLICATE_EXTENTS_TO_FILE, &dup, sizeof(dup), NULL, 0, &dwSize, NULL))
+			goto out;
+	}
+	r = TRUE;
+
+out:
+	safe_closehandle(hSrc);
+	safe_closehandle(hDst);
+	if (!r && created)
+		DeleteFileU(backup_path);
+	return r;
+}
+
+/*
+ * Create a backup of a file before it gets patched, as <name>.bak. With BACKUP_CLONE,
+ * block cloning is used when the volume supports it. With BACKUP_DELTA, nothing is done
+ * here, since the ranges to save are only known after the scan (see WriteDeltaBackup()).
+ */
+BOOL CreateBackup(const char* path, BACKUP_MODE mode)
+{
+	BOOL bRet = FALSE;
+	struct _stat64 st;
+	char backup_path[MAX_PATH];
+
+	if (mode == BACKUP_DELTA)
+		return TRUE;
+	if (_stat64U(path, &st) != 0)
+		return FALSE;
+	if (!GetBackupPath(path, ".bak", backup_path, sizeof(backup_path)))
+		return FALSE;
+	if (_stat64U(backup_path, &st) == 0) {
+		lprintf(stdout, "Backup '%s' already exists - keeping it\n", backup_path);
+		return TRUE;
+	}
+	if (mode == BACKUP_CLONE) {
+		if (CloneBackup(path, backup_path)) {
+			lprintf(stdout, "Saved backup as '%s' (block clone)\n", backup_path);
+			return TRUE;
+		}
+		lprintf(stdout, "Block cloning is not available - making a full copy\n");
+	}
+	bRet = CopyFileU(path, backup_path, TRUE);
+	if (bRet)
+		lprintf(stdout, "Saved backup as '%s'\n", backup_path);
+	return bRet;
+}
+
+/*
+ * Save the original content of ranges from a mapped file, before they get altered,
+ * into a delta backup. If the file already has one, the ranges are added to it.
+ */
+BOOL WriteDeltaBackup(const char* path, FILE_WINDOW* w, const SCAN_RANGE* ranges, int nb_ranges)
+{
+	FILE* fd = NULL;
+	const uint8_t* data;
+	char delta_path[MAX_PATH], tmp_path[MAX_PATH];
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	struct _stat64 st;
+	BOOL exists, success = FALSE;
+	uint64_t pos, end;
+	size_t len;
+	int i, j;
+
+	if (!GetBackupPath(path, ".delta", delta_path, sizeof(delta_path)) ||
+		!GetBackupPath(path, ".delta.tmp", tmp_path, sizeof(tmp_path)))
+		return FALSE;
+	// The original size and hash are only recorded by the first backup
+	exists = (_stat64U(delta_path, &st) == 0);
+	if (exists) {
+		if (CopyFileU(delta_path, tmp_path, FALSE))
+			fd = fopenU(tmp_path, "a");
+	} else if (Sha256(w, digest)) {
+		fd = fopenU(tmp_path, "w");
+		if (fd != NULL) {
+			fprintf(fd, "%s\nsize %llX\nsha256 ", DELTA_SIGNATURE, w->size);
+			for (j = 0; j < SHA256_DIGEST_SIZE; j++)
+				fprintf(fd, "%02X", digest[j]);
+			fprintf(fd, "\n");
+		}
+	}
+	if (fd == NULL)
+		goto out;
+
+	success = TRUE;
+	for (i = 0; i < nb_ranges && success; i++) {
+		end = min(ranges[i].end, w->size);
+		for (pos = ranges[i].start; pos < end && success; pos += len) {
+			len = (size_t)min(end - pos, DELTA_LINE_BYTES);
+			data = MapFileWindow(w, pos, len);
+			if (data == NULL) {
+				success = FALSE;
+				break;
+			}
+			fprintf(fd, "%08llX ", pos);
+			for (j = 0; j < (int)len; j++)
+				fprintf(fd, "%02X", data[j]);
+			success = (fprintf(fd, "\n") > 0);
+		}
+	}
+	if (fclose(fd) != 0)
+		success = FALSE;
+	if (success)
+		success = MoveFileExU(tmp_path, delta_path, MOVEFILE_REPLACE_EXISTING);
+
+out:
+	if (success)
+		lprintf(stdout, "%s delta backup '%s'\n", exists ? "Updated" : "Saved", delta_path);
+	else
+		_unlinkU(tmp_path);
+	return success;
+}
+
+static size_t ParseHexBytes(const char* str, uint8_t* data, size_t max_len)
+{
+	size_t i;
+	unsigned int val;
+
+	for (i = 0; i < max_len && isxdigitU(str[2 * i]) && isxdigitU(str[2 * i + 1]); i++) {
+		if (sscanf_s(&str[2 * i], "%2x", &val) != 1)
+			return 0;
+		data[i] = (uint8_t)val;
+	}
+	// Trailing garbage is an error
+	return (str[2 * i] == 0 || isspaceU(str[2 * i])) ? i : 0;
+}
+
+/*
+ * Replay a delta backup onto the patched file: write back all the original ranges,
+ * truncate the file to its original size, and check that we get the original hash.
+ */
+static BOOL ReplayDeltaBackup(const char* path, const char* delta_path)
+{
+	BOOL r = FALSE;
+	FILE* fd;
+	char line[2 * DELTA_LINE_BYTES + 64], hex[2 * DELTA_LINE_BYTES + 1];
+	unsigned long long size = 0, offset;
+	uint8_t digest[SHA256_DIGEST_SIZE], new_digest[SHA256_DIGEST_SIZE];
+	BOOL has_size = FALSE, has_digest = FALSE;
+	DELTA_ENTRY *entries = NULL, *new_entries;
+	int i, nb_entries = 0, max_entries = 0, line_nr = 1;
+	HANDLE hFile = INVALID_HANDLE_VALUE;
+	LARGE_INTEGER liPos;
+	DWORD dwWritten;
+	FILE_WINDOW w = { 0 };
+
+	fd = fopenU(delta_path, "r");
+	if (fd == NULL) {
+		lprintf(stderr, "Could not open delta backup '%s'\n", delta_path);
+		return FALSE;
+	}
+	if (fgets(line, sizeof(line), fd) == NULL || strncmp(line, DELTA_SIGNATURE, sizeof(DELTA_SIGNATURE) - 1) != 0) {
+		lprintf(stderr, "'%s' is not a delta backup\n", delta_path);
+		goto out;
+	}
+	while (fgets(line, sizeof(line), fd) != NULL) {
+		line_nr++;
+		if (strncmp(line, "size ", 5) == 0) {
+			has_size = (sscanf_s(&line[5], "%llx", &size) == 1);
+		} else if (strncmp(line, "sha256 ", 7) == 0) {
+			has_digest = (ParseHexBytes(&line[7], digest, sizeof(digest)) == sizeof(digest));
+		} else {
+			if (nb_entries >= max_entries) {
+				max_entries = (max_entries == 0) ? 64 : 2 * max_entries;
+				new_entries = realloc(entries, max_entries * sizeof(DELTA_ENTRY));
+				if (new_entries == NULL) {
+					lprintf(stderr, "realloc error\n");
+					goto out;
+				}
+				entries = new_entries;
+			}
+			if (sscanf_s(line, "%llx %128s", &offset, hex, (unsigned)sizeof(hex)) != 2 ||
+				(entries[nb_entries].len = (uint32_t)ParseHexBytes(hex, entries[nb_entries].data, DELTA_LINE_BYTES)) == 0) {
+				lprintf(stderr, "%s:%d: Invalid entry\n", delta_path, line_nr);
+				goto out;
+			}
+			entries[nb_entries++].offset = offset;
+		}
+	}
+	if (!has_size || !has_digest) {
+		lprintf(stderr, "'%s' does not record the original size and hash\n", delta_path);
+		goto out;
+	}
+
+	hFile = CreateFileU(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		lprintf(stderr, "Could not open '%s': Error %u\n", path, GetLastError());
+		goto out;
+	}
+	for (i = nb_entries - 1; i >= 0; i--) {
+		liPos.QuadPart = entries[i].offset;
+		if (!SetFilePointerEx(hFile, liPos, NULL, FILE_BEGIN) ||
+			!WriteFile(hFile, entries[i].data, entries[i].len, &dwWritten, NULL) || dwWritten != entries[i].len) {
+			lprintf(stderr, "Could not restore data at offset %08llX: Error %u\n", entries[i].offset, GetLastError());
+			goto out;
+		}
+	}
+	liPos.QuadPart = size;
+	if (!SetFilePointerEx(hFile, liPos, NULL, FILE_BEGIN) || !SetEndOfFile(hFile)) {
+		lprintf(stderr, "Could not restore the original file size: Error %u\n", GetLastError());
+		goto out;
+	}
+
+	// Empty files can't be mapped
+	if (size == 0)
+		InitMemoryWindow(&w, NULL, 0);
+	else if (!OpenFileWindow(&w, hFile, size, FALSE))
+		goto out;
+	if (!Sha256(&w, new_digest))
+		goto out;
+	if (memcmp(digest, new_digest, sizeof(digest)) != 0) {
+		lprintf(stderr, "The restored data of '%s' does not match the original\n", path);
+		goto out;
+	}
+	r = TRUE;
+
+out:
+	CloseFileWindow(&w);
+	safe_closehandle(hFile);
+	free(entries);
+	fclose(fd);
+	return r;
+}
+
+/*
+ * Restore a patched file from its delta backup or, if it doesn't have one, from its
+ * full backup. The backup is removed once the original file has been restored.
+ */
+BOOL RestoreFile(const char* path)
+{
+	char backup_path[MAX_PATH];
+	struct _stat64 st;
+
+	if (GetBackupPath(path, ".delta", backup_path, sizeof(backup_path)) && _stat64U(backup_path, &st) == 0) {
+		if (!ReplayDeltaBackup(path, backup_path))
+			return FALSE;
+		_unlinkU(backup_path);
+		lprintf(stdout, "Restored '%s' from delta backup\n", path);
+		return TRUE;
+	}
+	if (GetBackupPath(path, ".bak", backup_path, sizeof(backup_path)) && _stat64U(backup_path, &st) == 0) {
+		if (!MoveFileExU(backup_path, path, MOVEFILE_REPLACE_EXISTING)) {
+			lprintf(stderr, "Could not restore '%s' from '%s': Error %u\n", path, backup_path, GetLastError());
+			return FALSE;
+		}
+		lprintf(stdout, "Restored '%s' from backup\n", path);
+		return TRUE;
+	}
+	lprintf(stderr, "No backup found for '%s'\n", path);
+	return FALSE;
+}
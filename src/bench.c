@@ -0,0 +1,689 @@
+/*
+ * winpatch - Windows system file patcher
+ * Benchmark harness, using synthetic PE images
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef _DEBUG
+#define _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <imagehlp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "msapi_utf8.h"
+#include "winpatch.h"
+
+#define safe_sprintf(dst, count, ...) do {_snprintf_s(dst, count, _TRUNCATE, __VA_ARGS__); (dst)[(count)-1] = 0; } while(0)
+#define static_sprintf(dst, ...) safe_sprintf(dst, sizeof(dst), __VA_ARGS__)
+
+#define MAX_BENCH_VALUES 16
+#define MB (1024ULL * 1024ULL)
+// Offset of the NT headers, and size of all the headers, in the synthetic images
+#define BENCH_NT_OFFSET 0x80
+#define BENCH_HEADERS_SIZE 0x400
+// Length of the synthetic byte patterns, which also get a wildcard
+#define BENCH_PATTERN_LENGTH 16
+// Room for the @N and =N suffixes of ORIGINAL
+#define BENCH_SUFFIX_LENGTH 16
+// The .text section starts after the headers, and covers three quarters of the image
+#define TEXT_START 0x1000
+#define TEXT_SIZE(size) ((((size) - TEXT_START) / 4 * 3) & ~0xFFFULL)
+
+typedef struct {
+	int nb_sizes;
+	int sizes[MAX_BENCH_VALUES];		// In MB
+	int nb_pattern_counts;
+	int pattern_counts[MAX_BENCH_VALUES];
+	int density;						// Planted matches per MB
+	int iterations;
+	int nb_files;						// Files that go through the end-to-end pipeline
+	BOOL byte_patterns;
+	BOOL sign;
+	SIGNING_KEY_TYPE key_type;
+	const char* timings_path;
+	uint32_t align;						// Alignment suffix for ORIGINAL, or 0 for none
+	BOOL counts;						// Whether ORIGINAL gets the number of planted matches
+	BOOL stop_early;
+	char* section;						// Only scan this section, if not NULL
+} BENCH_OPTIONS;
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static __inline uint64_t Random(void)
+{
+	// xorshift64*
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static void SetSection(PIMAGE_SECTION_HEADER pSection, const char* name, DWORD start, DWORD size, DWORD characteristics)
+{
+	memcpy(pSection->Name, name, strlen(name));
+	pSection->Misc.VirtualSize = size;
+	pSection->VirtualAddress = start;
+	pSection->SizeOfRawData = size;
+	pSection->PointerToRawData = start;
+	pSection->Characteristics = characteristics;
+}
+
+/*
+ * Create a synthetic PE image, filled with random data, that has a .text section
+ * covering the first three quarters of the data, and a .data section for the rest.
+ * The headers are only as complete as what winpatch and the signing API look at.
+ * The checksum is left to SetSyntheticChecksum(), once the content is final.
+ */
+static uint8_t* CreateSyntheticImage(uint64_t size, BOOL pe64)
+{
+	uint8_t* base;
+	uint64_t i;
+	PIMAGE_DOS_HEADER pImageDOSHeader;
+	PIMAGE_NT_HEADERS32 pImageNTHeader32;
+	PIMAGE_NT_HEADERS64 pImageNTHeader64;
+	PIMAGE_SECTION_HEADER pSection;
+	DWORD text_size;
+
+	base = malloc((size_t)size);
+	if (base == NULL)
+		return NULL;
+	for (i = 0; i < size / sizeof(uint64_t); i++)
+		((uint64_t*)base)[i] = Random();
+	memset(base, 0, BENCH_HEADERS_SIZE);
+
+	pImageDOSHeader = (PIMAGE_DOS_HEADER)base;
+	pImageDOSHeader->e_magic = IMAGE_DOS_SIGNATURE;
+	pImageDOSHeader->e_lfanew = BENCH_NT_OFFSET;
+	pImageNTHeader32 = (PIMAGE_NT_HEADERS32)&base[BENCH_NT_OFFSET];
+	pImageNTHeader64 = (PIMAGE_NT_HEADERS64)pImageNTHeader32;
+	pImageNTHeader32->Signature = IMAGE_NT_SIGNATURE;
+	pImageNTHeader32->FileHeader.Machine = pe64 ? IMAGE_FILE_MACHINE_AMD64 : IMAGE_FILE_MACHINE_I386;
+	pImageNTHeader32->FileHeader.NumberOfSections = 2;
+	pImageNTHeader32->FileHeader.TimeDateStamp = (DWORD)Random();
+	pImageNTHeader32->FileHeader.SizeOfOptionalHeader = pe64 ?
+		sizeof(IMAGE_OPTIONAL_HEADER64) : sizeof(IMAGE_OPTIONAL_HEADER32);
+	pImageNTHeader32->FileHeader.Characteristics = IMAGE_FILE_EXECUTABLE_IMAGE |
+		(pe64 ? IMAGE_FILE_LARGE_ADDRESS_AWARE : IMAGE_FILE_32BIT_MACHINE);
+
+	// Section and file alignment are the same, so that file offsets and RVAs match
+#define SET_OPTIONAL_HEADER(oh) do { \
+		(oh).SectionAlignment = 0x1000; \
+		(oh).FileAlignment = 0x1000; \
+		(oh).MajorOperatingSystemVersion = 10; \
+		(oh).MajorSubsystemVersion = 10; \
+		(oh).SizeOfImage = (DWORD)size; \
+		(oh).SizeOfHeaders = BENCH_HEADERS_SIZE; \
+		(oh).Subsystem = IMAGE_SUBSYSTEM_NATIVE; \
+		(oh).NumberOfRvaAndSizes = IMAGE_NUMBEROF_DIRECTORY_ENTRIES; \
+	} while (0)
+	if (pe64) {
+		pImageNTHeader64->OptionalHeader.Magic = IMAGE_NT_OPTIONAL_HDR64_MAGIC;
+		pImageNTHeader64->OptionalHeader.ImageBase = 0x140000000ULL;
+		SET_OPTIONAL_HEADER(pImageNTHeader64->OptionalHeader);
+		pSection = (PIMAGE_SECTION_HEADER)&pImageNTHeader64[1];
+	} else {
+		pImageNTHeader32->OptionalHeader.Magic = IMAGE_NT_OPTIONAL_HDR32_MAGIC;
+		pImageNTHeader32->OptionalHeader.ImageBase = 0x10000;
+		SET_OPTIONAL_HEADER(pImageNTHeader32->OptionalHeader);
+		pSection = (PIMAGE_SECTION_HEADER)&pImageNTHeader32[1];
+	}
+#undef SET_OPTIONAL_HEADER
+
+	text_size = (DWORD)TEXT_SIZE(size);
+	SetSection(&pSection[0], ".text", TEXT_START, text_size,
+		IMAGE_SCN_CNT_CODE | IMAGE_SCN_MEM_EXECUTE | IMAGE_SCN_MEM_READ);
+	SetSection(&pSection[1], ".data", TEXT_START + text_size, (DWORD)size - TEXT_START - text_size,
+		IMAGE_SCN_CNT_INITIALIZED_DATA | IMAGE_SCN_MEM_READ | IMAGE_SCN_MEM_WRITE);
+	return base;
+}
+
+/*
+ * Give an image a valid checksum, so that it can be updated incrementally. This must
+ * only be done once the matches have been planted, or the checksum would be stale.
+ */
+static BOOL SetSyntheticChecksum(uint8_t* base, uint64_t size)
+{
+	DWORD dwHeaderSum, dwCheckSum;
+
+	if (CheckSumMappedFile(base, (DWORD)size, &dwHeaderSum, &dwCheckSum) == NULL)
+		return FALSE;
+	*GetCheckSumField(GetNtHeaders(base, size)) = dwCheckSum;
+	return TRUE;
+}
+
+/*
+ * Create a pattern set of random values, and plant occurrences of its ORIGINAL values
+ * in the .text section of an image, one in each of nb_matches equal slots. With
+ * --align, the ORIGINAL values get that alignment, and with --counts, they get the
+ * number of times they were planted. Returns the number of planted matches in
+ * nb_planted.
+ */
+static PATTERN_SET* CreateSyntheticPatternSet(const BENCH_OPTIONS* opt, uint8_t* base, uint64_t size,
+	int nb_patterns, int* nb_planted)
+{
+	PATTERN_SET* set = NULL;
+	char **values = NULL, *strings = NULL, *p;
+	uint8_t original[BENCH_PATTERN_LENGTH];
+	uint64_t slot, offset;
+	uint32_t align;
+	size_t len = (opt->byte_patterns ? 3 * BENCH_PATTERN_LENGTH : 2 * sizeof(uint64_t) + 1) + BENCH_SUFFIX_LENGTH;
+	int i, j, k, *picks = NULL, *counts = NULL, wildcard = 0, nb_matches = (int)(size / MB) * opt->density;
+
+	// Keep the planted matches well apart
+	if (nb_matches > (int)(TEXT_SIZE(size) / 64))
+		nb_matches = (int)(TEXT_SIZE(size) / 64);
+	if (nb_matches == 0)
+		nb_matches = 1;
+	*nb_planted = nb_matches;
+
+	// The patterns of the matches are picked first, so that their counts can be set
+	picks = calloc(nb_matches, sizeof(int));
+	counts = calloc(nb_patterns, sizeof(int));
+	values = calloc(2 * (size_t)nb_patterns, sizeof(char*));
+	strings = calloc(2 * (size_t)nb_patterns, len);
+	if (picks == NULL || counts == NULL || values == NULL || strings == NULL)
+		goto out;
+	for (i = 0; i < nb_matches; i++) {
+		picks[i] = (int)(Random() % nb_patterns);
+		counts[picks[i]]++;
+	}
+	for (i = 0; i < 2 * nb_patterns; i++) {
+		values[i] = &strings[i * len];
+		if (!opt->byte_patterns) {
+			safe_sprintf(values[i], len, "%016llX", Random());
+		} else {
+			// Use a wildcard at the same position for ORIGINAL and PATCHED
+			if (i % 2 == 0)
+				wildcard = (int)(Random() % BENCH_PATTERN_LENGTH);
+			for (j = 0, p = values[i]; j < BENCH_PATTERN_LENGTH; j++, p += 3) {
+				if (j == wildcard)
+					memcpy(p, "??", 2);
+				else
+					safe_sprintf(p, 3, "%02X", (unsigned int)(Random() & 0xff));
+				p[2] = (j + 1 < BENCH_PATTERN_LENGTH) ? ':' : 0;
+			}
+		}
+		if (i % 2 != 0)
+			continue;
+		p = &values[i][strlen(values[i])];
+		if (opt->align != 0)
+			p += sprintf_s(p, &values[i][len] - p, "@%u", opt->align);
+		if (opt->counts)
+			sprintf_s(p, &values[i][len] - p, "=%d", counts[i / 2]);
+	}
+	set = CreatePatternSet(values, 2 * nb_patterns);
+	if (set == NULL)
+		goto out;
+
+	align = (opt->align != 0) ? opt->align : (opt->byte_patterns ? 1 : sizeof(uint64_t));
+	slot = TEXT_SIZE(size) / nb_matches;
+	for (i = 0; i < nb_matches; i++) {
+		offset = (TEXT_START + i * slot + Random() % (slot - BENCH_PATTERN_LENGTH)) & ~((uint64_t)align - 1);
+		k = picks[i];
+		if (set->matcher == NULL) {
+			memcpy(&base[offset], &set->original[k], sizeof(uint64_t));
+		} else {
+			for (j = 0; j < (int)set->byte_patterns[k].len; j++)
+				original[j] = set->byte_patterns[k].original[j] | (base[offset + j] & ~set->byte_patterns[k].original_mask[j]);
+			memcpy(&base[offset], original, set->byte_patterns[k].len);
+		}
+	}
+
+out:
+	free(picks);
+	free(counts);
+	free(values);
+	free(strings);
+	return set;
+}
+
+/*
+ * Create a synthetic image, along with the pattern set whose matches were planted in it.
+ */
+static uint8_t* CreateBenchImage(const BENCH_OPTIONS* opt, uint64_t size, BOOL pe64, int nb_patterns,
+	PATTERN_SET** set, int* nb_planted)
+{
+	uint8_t* image = CreateSyntheticImage(size, pe64);
+
+	if (image == NULL) {
+		lprintf(stderr, "Could not allocate %llu MB image\n", size / MB);
+		return NULL;
+	}
+	*set = CreateSyntheticPatternSet(opt, image, size, nb_patterns, nb_planted);
+	if (*set == NULL || !SetSyntheticChecksum(image, size)) {
+		lprintf(stderr, "Could not create pattern set\n");
+		FreePatternSet(*set);
+		*set = NULL;
+		free(image);
+		return NULL;
+	}
+	return image;
+}
+
+/*
+ * Scan an image with the same engine as winpatch, over the whole image or over the
+ * section set with --section, and check that exactly the planted matches are found.
+ * Returns the number of matches, or -1 on error.
+ */
+static int ScanImage(const BENCH_OPTIONS* opt, FILE_WINDOW* w, const PATTERN_SET* set, int nb_planted,
+	EDIT_LIST* list, uint64_t* bytes_scanned)
+{
+	SCAN_RANGE file_range = { 0, w->size }, *ranges = NULL;
+	const SCAN_RANGE* scan_ranges;
+	int i, nb_ranges = 1, found, expected = nb_planted;
+
+	free(list->edits);
+	memset(list, 0, sizeof(EDIT_LIST));
+	if (opt->section != NULL) {
+		nb_ranges = GetSectionRanges(w, &opt->section, 1, &ranges);
+		if (nb_ranges < 0) {
+			lprintf(stderr, "Could not read the section headers\n");
+			return -1;
+		}
+		// All the matches are planted in .text
+		if (strncmp(opt->section, ".text", IMAGE_SIZEOF_SHORT_NAME) != 0)
+			expected = 0;
+	}
+	scan_ranges = (ranges == NULL) ? &file_range : ranges;
+	found = ScanFile(w, scan_ranges, nb_ranges, set, opt->stop_early, list);
+	*bytes_scanned = 0;
+	for (i = 0; i < nb_ranges; i++)
+		*bytes_scanned += scan_ranges[i].end - scan_ranges[i].start;
+	free(ranges);
+	if (found >= 0 && found != expected) {
+		lprintf(stderr, "Found %d match(es) instead of %d\n", found, expected);
+		found = -1;
+	}
+	return found;
+}
+
+/*
+ * Apply the edits with the engine, which prints each of them. That output is
+ * only displayed if something goes wrong.
+ */
+static BOOL ApplyEditsQuietly(FILE_WINDOW* w, const EDIT_LIST* list, uint32_t* delta)
+{
+	LOG_BUFFER log = { 0 };
+	uint64_t checksum_offset = (uint8_t*)GetCheckSumField(GetNtHeaders(w->head, w->head_len)) - w->head;
+	BOOL r;
+
+	SetThreadLog(&log);
+	r = ApplyEdits(w, list, checksum_offset, delta);
+	SetThreadLog(NULL);
+	if (r)
+		free(log.data);
+	else
+		FlushLog(&log);
+	return r;
+}
+
+/*
+ * Measure the scan throughput and the in-memory cost of the checksum update, and check
+ * that the incremental checksum is the same as the one imagehlp computes in full.
+ */
+static BOOL BenchScan(const BENCH_OPTIONS* opt, uint64_t size, BOOL pe64, int nb_patterns)
+{
+	BOOL r = FALSE;
+	PATTERN_SET* set = NULL;
+	EDIT_LIST list = { 0 };
+	PE_UPDATE update;
+	FILE_WINDOW w;
+	DWORD dwHeaderSum, dwCheckSum;
+	uint8_t* image;
+	uint32_t delta;
+	uint64_t start, ticks, bytes_scanned, best = UINT64_MAX;
+	int i, found = -1, nb_planted;
+
+	image = CreateBenchImage(opt, size, pe64, nb_patterns, &set, &nb_planted);
+	if (image == NULL)
+		return FALSE;
+	InitMemoryWindow(&w, image, size);
+	for (i = 0; i < opt->iterations; i++) {
+		start = GetTicks();
+		found = ScanImage(opt, &w, set, nb_planted, &list, &bytes_scanned);
+		ticks = GetTicks() - start;
+		if (found < 0)
+			goto out;
+		if (ticks < best)
+			best = ticks;
+	}
+	lprintf(stdout, "%-5s %4llu MB %5d %-6s %7.2f GB/s %7d matches",
+		pe64 ? "PE32+" : "PE32", size / MB, nb_patterns, (set->matcher != NULL) ? "bytes" : "qwords",
+		(double)bytes_scanned / (TicksToMs(best) / 1000.0) / 1e9, found);
+
+	if (!ApplyEditsQuietly(&w, &list, &delta))
+		goto out;
+	start = GetTicks();
+	if (!UpdatePEImage(&w, delta, FALSE, &update))
+		goto out;
+	ticks = GetTicks() - start;
+	// Full checksum of the patched image, as computed by imagehlp
+	start = GetTicks();
+	if (CheckSumMappedFile(image, (DWORD)size, &dwHeaderSum, &dwCheckSum) == NULL)
+		goto out;
+	lprintf(stdout, "  checksum %8.3f ms full, %.3f ms incremental\n", TicksToMs(GetTicks() - start), TicksToMs(ticks));
+	if (!update.incremental || update.new_checksum != dwCheckSum) {
+		lprintf(stderr, "Incremental checksum %08X does not match full checksum %08X\n", update.new_checksum, dwCheckSum);
+		goto out;
+	}
+	r = TRUE;
+
+out:
+	free(list.edits);
+	FreePatternSet(set);
+	free(image);
+	return r;
+}
+
+/*
+ * Run an image, from a temporary file, through the per file stages of winpatch, using the
+ * same engine: full backup, open, windowed mapping, scan, patch, checksum update, flush and,
+ * with --sign, signing. Taking ownership, as well as the pinned manifest, the match cache
+ * and --output, are not part of this. The output of the engine is only displayed if
+ * something goes wrong.
+ */
+static BOOL BenchFile(const BENCH_OPTIONS* opt, uint64_t size, BOOL pe64, int nb_patterns,
+	SIGNING_SESSION* session, char* path, FILE_STATS* stats)
+{
+	BOOL r = FALSE, success;
+	FILE* fd;
+	LOG_BUFFER log = { 0 };
+	char temp_dir[MAX_PATH], backup_path[MAX_PATH + 4];
+	HANDLE hFile = INVALID_HANDLE_VALUE;
+	uint8_t* image;
+	PATTERN_SET* set = NULL;
+	EDIT_LIST list = { 0 };
+	PE_UPDATE update = { 0 };
+	FILE_WINDOW w = { 0 };
+	uint64_t start, total_start = GetTicks();
+	uint32_t delta;
+	int found, nb_planted;
+
+	if (GetTempPathU(sizeof(temp_dir), temp_dir) == 0 || GetTempFileNameU(temp_dir, "wpb", 0, path) == 0) {
+		lprintf(stderr, "Could not create temporary file: Error %u\n", GetLastError());
+		return FALSE;
+	}
+	stats->path = path;
+	static_sprintf(backup_path, "%s.bak", path);
+
+	image = CreateBenchImage(opt, size, pe64, nb_patterns, &set, &nb_planted);
+	if (image == NULL)
+		goto out;
+	fd = fopenU(path, "wb");
+	success = (fd != NULL && fwrite(image, 1, (size_t)size, fd) == size);
+	if (fd != NULL && fclose(fd) != 0)
+		success = FALSE;
+	free(image);
+	if (!success) {
+		lprintf(stderr, "Could not write '%s'\n", path);
+		goto out;
+	}
+
+	SetThreadLog(&log);
+	start = GetTicks();
+	success = CreateBackup(path, BACKUP_FULL);
+	stats->ticks[STAGE_BACKUP] += GetTicks() - start;
+	if (!success)
+		goto out;
+
+	start = GetTicks();
+	hFile = CreateFileU(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+	stats->ticks[STAGE_OPEN] += GetTicks() - start;
+	if (hFile == INVALID_HANDLE_VALUE)
+		goto out;
+	stats->nb_opens++;
+
+	start = GetTicks();
+	success = OpenFileWindow(&w, hFile, size, TRUE);
+	stats->ticks[STAGE_MAP] += GetTicks() - start;
+	if (!success)
+		goto out;
+
+	success = FALSE;
+	__try {
+		start = GetTicks();
+		found = ScanImage(opt, &w, set, nb_planted, &list, &stats->bytes_scanned);
+		stats->ticks[STAGE_SCAN] += GetTicks() - start;
+		if (found < 0)
+			__leave;
+		stats->nb_matches = found;
+
+		start = GetTicks();
+		success = ApplyEdits(&w, &list, (uint8_t*)GetCheckSumField(GetNtHeaders(w.head, w.head_len)) - w.head, &delta);
+		stats->ticks[STAGE_PATCH] += GetTicks() - start;
+		if (!success)
+			__leave;
+
+		start = GetTicks();
+		success = UpdatePEImage(&w, delta, FALSE, &update) && update.incremental;
+		stats->ticks[STAGE_CHECKSUM] += GetTicks() - start;
+	} __except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH) {
+		lprintf(stderr, "I/O error while accessing '%s'\n", path);
+		success = FALSE;
+	}
+	if (!success)
+		goto out;
+
+	start = GetTicks();
+	success = FlushFileWindow(&w);
+	stats->nb_maps += w.nb_maps;
+	CloseFileWindow(&w);
+	stats->ticks[STAGE_FLUSH] += GetTicks() - start;
+	if (!success)
+		goto out;
+
+	if (session != NULL) {
+		start = GetTicks();
+		success = SignFile(session, path, hFile);
+		stats->ticks[STAGE_SIGN] += GetTicks() - start;
+		if (!success)
+			goto out;
+	}
+	r = TRUE;
+
+out:
+	SetThreadLog(NULL);
+	if (r)
+		free(log.data);
+	else
+		FlushLog(&log);
+	stats->nb_maps += w.nb_maps;
+	CloseFileWindow(&w);
+	safe_closehandle(hFile);
+	DeleteFileU(backup_path);
+	DeleteFileU(path);
+	free(list.edits);
+	FreePatternSet(set);
+	stats->result = r ? stats->nb_matches : -1;
+	stats->total_ticks = GetTicks() - total_start;
+	return r;
+}
+
+static int ParseList(char* str, int* values, int max_values)
+{
+	char *token, *next = NULL;
+	int nb_values = 0;
+
+	for (token = strtok_s(str, ",", &next); token != NULL && nb_values < max_values; token = strtok_s(NULL, ",", &next)) {
+		values[nb_values] = atoi(token);
+		if (values[nb_values] <= 0)
+			return 0;
+		nb_values++;
+	}
+	return nb_values;
+}
+
+static void PrintUsage(const char* app)
+{
+	lprintf(stderr, "Usage: %s [--sizes MB[,MB...]] [--patterns N[,N...]] [--density N] [--iterations N]\n", app);
+	lprintf(stderr, "       [--bytes] [--align N] [--counts] [--stop-early] [--section NAME] [--cutoff N]\n");
+	lprintf(stderr, "       [--files N] [--sign] [--key rsa4096|rsa2048|ecdsa] [--timings FILE]\n");
+	lprintf(stderr, "Sizes are in the 1 to 512 MB range, and density is the number of matches per MB.\n");
+	lprintf(stderr, "--bytes uses byte patterns, with wildcards, instead of QWORDs.\n");
+	lprintf(stderr, "--align N adds @N to the patterns, and --counts adds =N, with the number of planted\n");
+	lprintf(stderr, "matches. --stop-early and --section are the same as for winpatch.\n");
+	lprintf(stderr, "--cutoff N uses the hashed lookup, rather than the scan engine, above N patterns\n");
+	lprintf(stderr, "(0 always uses the hashed lookup), so that both can be compared.\n");
+	lprintf(stderr, "--files N runs N temporary files of each size through the on-disk pipeline.\n");
+	lprintf(stderr, "--sign also signs these files (requires an elevated prompt, as this uses a\n");
+	lprintf(stderr, "temporary machine certificate, in the same way as winpatch).\n");
+}
+
+static int main_utf8(int argc, char** argv)
+{
+	BENCH_OPTIONS opt = { 3, { 1, 16, 128 }, 3, { 1, 16, 256 }, 1, 5, 2, FALSE, FALSE, KEY_RSA4096, NULL, 0, FALSE, FALSE, NULL };
+	SIGNING_SESSION* session = NULL;
+	FILE_STATS* stats = NULL;
+	char (*paths)[MAX_PATH] = NULL;
+	uint64_t size, start, wall_ticks, total_ticks = 0;
+	const char* engine;
+	int i, j, k, arch, n = 0, nb_failed = 0, nb_files, cutoff = -1;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+			opt.nb_sizes = ParseList(argv[++i], opt.sizes, MAX_BENCH_VALUES);
+		} else if (strcmp(argv[i], "--patterns") == 0 && i + 1 < argc) {
+			opt.nb_pattern_counts = ParseList(argv[++i], opt.pattern_counts, MAX_BENCH_VALUES);
+		} else if (strcmp(argv[i], "--density") == 0 && i + 1 < argc) {
+			opt.density = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+			opt.iterations = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--files") == 0 && i + 1 < argc) {
+			opt.nb_files = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--bytes") == 0) {
+			opt.byte_patterns = TRUE;
+		} else if (strcmp(argv[i], "--align") == 0 && i + 1 < argc) {
+			opt.align = (uint32_t)atoi(argv[++i]);
+			if (opt.align == 0 || opt.align > 8 || (opt.align & (opt.align - 1)) != 0) {
+				PrintUsage(argv[0]);
+				return -1;
+			}
+		} else if (strcmp(argv[i], "--counts") == 0) {
+			opt.counts = TRUE;
+		} else if (strcmp(argv[i], "--stop-early") == 0) {
+			opt.stop_early = TRUE;
+		} else if (strcmp(argv[i], "--section") == 0 && i + 1 < argc) {
+			opt.section = argv[++i];
+		} else if (strcmp(argv[i], "--cutoff") == 0 && i + 1 < argc) {
+			cutoff = atoi(argv[++i]);
+			if (cutoff < 0) {
+				PrintUsage(argv[0]);
+				return -1;
+			}
+		} else if (strcmp(argv[i], "--sign") == 0) {
+			opt.sign = TRUE;
+		} else if (strcmp(argv[i], "--key") == 0 && i + 1 < argc) {
+			i++;
+			if (_stricmp(argv[i], "rsa4096") == 0) {
+				opt.key_type = KEY_RSA4096;
+			} else if (_stricmp(argv[i], "rsa2048") == 0) {
+				opt.key_type = KEY_RSA2048;
+			} else if (_stricmp(argv[i], "ecdsa") == 0) {
+				opt.key_type = KEY_ECDSA_P256;
+			} else {
+				PrintUsage(argv[0]);
+				return -1;
+			}
+		} else if (strcmp(argv[i], "--timings") == 0 && i + 1 < argc) {
+			opt.timings_path = argv[++i];
+		} else {
+			PrintUsage(argv[0]);
+			return -1;
+		}
+	}
+	for (i = 0; i < opt.nb_sizes; i++) {
+		if (opt.sizes[i] > 512)
+			opt.nb_sizes = 0;
+	}
+	if (opt.nb_sizes == 0 || opt.nb_pattern_counts == 0 || opt.density < 0 || opt.iterations <= 0 || opt.nb_files < 0) {
+		PrintUsage(argv[0]);
+		return -1;
+	}
+
+	engine = InitMatcher();
+	if (cutoff >= 0)
+		SetMatcherCutoff((size_t)cutoff);
+	lprintf(stdout, "Scan engine: %s, with the hashed lookup above %d pattern(s)\n", engine, (int)GetMatcherCutoff());
+	nb_files = 2 * opt.nb_sizes * opt.nb_files;
+	stats = calloc(nb_files + 1, sizeof(FILE_STATS));
+	paths = calloc((size_t)nb_files + 1, MAX_PATH);
+	if (stats == NULL || paths == NULL)
+		goto out;
+	if (opt.sign && nb_files > 0) {
+		session = OpenSigningSession("CN = Test Signing Certificate", opt.key_type);
+		if (session == NULL) {
+			lprintf(stderr, "Could not open signing session\n");
+			goto out;
+		}
+	}
+
+	start = GetTicks();
+	for (i = 0; i < opt.nb_sizes; i++) {
+		size = (uint64_t)opt.sizes[i] * MB;
+		for (arch = 0; arch < 2; arch++) {
+			// Patching alters the image, so each run starts from a fresh one
+			for (j = 0; j < opt.nb_pattern_counts; j++) {
+				if (!BenchScan(&opt, size, arch == 1, opt.pattern_counts[j]))
+					nb_failed++;
+			}
+			for (k = 0; k < opt.nb_files; k++, n++) {
+				if (!BenchFile(&opt, size, arch == 1, opt.pattern_counts[0], session, paths[n], &stats[n]))
+					nb_failed++;
+				total_ticks += stats[n].total_ticks;
+			}
+		}
+	}
+	wall_ticks = GetTicks() - start;
+
+	if (n > 0) {
+		lprintf(stdout, "End-to-end: %d file(s), %.3f ms per file on average\n", n, TicksToMs(total_ticks) / n);
+		if (opt.timings_path != NULL && !WriteTimings(opt.timings_path, stats, n, wall_ticks, GetKeyGenerationTicks(session)))
+			nb_failed++;
+	}
+
+out:
+	CloseSigningSession(session);
+	free(paths);
+	free(stats);
+	return (nb_failed != 0) ? -1 : 0;
+}
+
+int wmain(int argc, wchar_t** argv16)
+{
+	SetConsoleOutputCP(CP_UTF8);
+	char** argv = calloc(argc, sizeof(char*));
+	if (argv == NULL)
+		return -1;
+	for (int i = 0; i < argc; i++)
+		argv[i] = wchar_to_utf8(argv16[i]);
+	int r = main_utf8(argc, argv);
+	for (int i = 0; i < argc; i++)
+		free(argv[i]);
+	free(argv);
+#ifdef _DEBUG
+	_CrtDumpMemoryLeaks();
+#endif
+	return r;
+}
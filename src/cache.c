@@ -0,0 +1,248 @@
+/*
+ * winpatch - Windows system file patcher
+ * Match offset cache
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef _DEBUG
+#define _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "msapi_utf8.h"
+#include "winpatch.h"
+
+#define safe_sprintf(dst, count, ...) do {_snprintf_s(dst, count, _TRUNCATE, __VA_ARGS__); (dst)[(count)-1] = 0; } while(0)
+#define static_sprintf(dst, ...) safe_sprintf(dst, sizeof(dst), __VA_ARGS__)
+
+/*
+ * After a scan, the offsets of the matches are recorded in a small text file, named
+ * after a hash of the file fingerprint (size, PE TimeDateStamp, SizeOfImage, CheckSum
+ * and the whole of the PE headers, including the section table) and of everything that
+ * affects the scan (patterns and section filters). A subsequent run on an identical file
+ * then only needs to check the data at these offsets, which CheckCachedMatches() does
+ * before any of them gets used, so that a file which got modified without its headers
+ * being updated falls back to a full scan, as long as one of its matches was altered.
+ * Hashing the whole file would be safer still, but would read as much data as the scan
+ * we are trying to avoid.
+ */
+#define CACHE_SIGNATURE "# winpatch match cache"
+
+static char cache_dir[MAX_PATH] = { 0 };
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x00000100000001b3ULL
+
+static uint64_t Fnv1a(uint64_t hash, const void* data, size_t len)
+{
+	const uint8_t* p = (const uint8_t*)data;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+/*
+ * Set the directory where cache entries are kept. If dir is NULL, use
+ * %LOCALAPPDATA%\winpatch\cache. Returns FALSE if the directory can't be used.
+ */
+BOOL InitMatchCache(const char* dir)
+{
+	char* local_app_data = NULL;
+
+	if (dir != NULL) {
+		static_sprintf(cache_dir, "%s", dir);
+	} else {
+		local_app_data = getenvU("LOCALAPPDATA");
+		if (local_app_data == NULL || local_app_data[0] == 0) {
+			free(local_app_data);
+			return FALSE;
+		}
+		static_sprintf(cache_dir, "%s\\winpatch\\cache", local_app_data);
+		free(local_app_data);
+	}
+	if (_mkdirExU(cache_dir) != 0) {
+		lprintf(stderr, "Could not create cache directory '%s'\n", cache_dir);
+		cache_dir[0] = 0;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Compute the key of the cache entry for a mapped PE file scanned with a pattern set.
+ * Returns FALSE if the file is not a PE image, which we have no fingerprint for.
+ */
+BOOL GetCacheKey(FILE_WINDOW* w, const PATTERN_SET* set, char* const* sections, int nb_sections, uint64_t* key)
+{
+	PIMAGE_NT_HEADERS32 pImageNTHeader32 = (w->size <= MAXDWORD) ? GetNtHeaders(w->head, w->head_len) : NULL;
+	uint64_t hash = FNV_OFFSET_BASIS;
+	const BYTE_PATTERN* p;
+	size_t i, len;
+
+	if (pImageNTHeader32 == NULL)
+		return FALSE;
+	hash = Fnv1a(hash, &w->size, sizeof(w->size));
+	// SizeOfImage and SizeOfHeaders are at the same offset for PE32 and PE32+
+	hash = Fnv1a(hash, &pImageNTHeader32->FileHeader.TimeDateStamp, sizeof(DWORD));
+	hash = Fnv1a(hash, &pImageNTHeader32->OptionalHeader.SizeOfImage, sizeof(DWORD));
+	hash = Fnv1a(hash, GetCheckSumField(pImageNTHeader32), sizeof(DWORD));
+	// The headers always are in the view that remains mapped
+	len = pImageNTHeader32->OptionalHeader.SizeOfHeaders;
+	if (len == 0 || len > w->head_len)
+		len = w->head_len;
+	hash = Fnv1a(hash, w->head, len);
+	hash = Fnv1a(hash, &set->nb_patterns, sizeof(set->nb_patterns));
+	hash = Fnv1a(hash, set->original, set->nb_patterns * sizeof(uint64_t));
+	hash = Fnv1a(hash, set->patched, set->nb_patterns * sizeof(uint64_t));
+	// The expected number of matches decides whether a file gets rejected
+	hash = Fnv1a(hash, set->min_count, set->nb_patterns * sizeof(uint32_t));
+	hash = Fnv1a(hash, set->max_count, set->nb_patterns * sizeof(uint32_t));
+	hash = Fnv1a(hash, set->align, set->nb_patterns * sizeof(uint32_t));
+	hash = Fnv1a(hash, &set->nb_byte_patterns, sizeof(set->nb_byte_patterns));
+	for (i = 0; i < set->nb_byte_patterns; i++) {
+		p = &set->byte_patterns[i];
+		hash = Fnv1a(hash, &p->len, sizeof(p->len));
+		hash = Fnv1a(hash, &p->align, sizeof(p->align));
+		hash = Fnv1a(hash, &p->min_count, sizeof(p->min_count));
+		hash = Fnv1a(hash, &p->max_count, sizeof(p->max_count));
+		hash = Fnv1a(hash, p->original, p->len);
+		hash = Fnv1a(hash, p->original_mask, p->len);
+		hash = Fnv1a(hash, p->patched, p->len);
+		hash = Fnv1a(hash, p->patched_mask, p->len);
+	}
+	for (i = 0; i < (size_t)nb_sections; i++)
+		hash = Fnv1a(hash, sections[i], strlen(sections[i]) + 1);
+	*key = hash;
+	return TRUE;
+}
+
+/*
+ * Read the matches recorded for a cache key.
+ * Returns the number of matches, or -1 if there is no usable entry.
+ */
+int ReadMatchCache(uint64_t key, CACHED_MATCH** matches)
+{
+	FILE* fd;
+	char path[MAX_PATH], line[128];
+	unsigned long long offset;
+	int pattern, nb_matches = 0, max_matches = 0;
+	CACHED_MATCH* new_matches;
+
+	*matches = NULL;
+	if (cache_dir[0] == 0)
+		return -1;
+	static_sprintf(path, "%s\\%016llX.txt", cache_dir, key);
+	fd = fopenU(path, "r");
+	if (fd == NULL)
+		return -1;
+	if (fgets(line, sizeof(line), fd) == NULL || strncmp(line, CACHE_SIGNATURE, sizeof(CACHE_SIGNATURE) - 1) != 0)
+		goto error;
+	while (fgets(line, sizeof(line), fd) != NULL) {
+		if (sscanf_s(line, "%llx %d", &offset, &pattern) != 2 || pattern < 0)
+			goto error;
+		if (nb_matches >= max_matches) {
+			max_matches = (max_matches == 0) ? 16 : 2 * max_matches;
+			new_matches = realloc(*matches, max_matches * sizeof(CACHED_MATCH));
+			if (new_matches == NULL)
+				goto error;
+			*matches = new_matches;
+		}
+		(*matches)[nb_matches].offset = offset;
+		(*matches)[nb_matches].pattern = pattern;
+		nb_matches++;
+	}
+	fclose(fd);
+	return nb_matches;
+
+error:
+	fclose(fd);
+	free(*matches);
+	*matches = NULL;
+	return -1;
+}
+
+/*
+ * Record the matches for a cache key. Entries are written under a temporary
+ * name first, so that concurrent jobs never see a partial entry.
+ */
+void WriteMatchCache(uint64_t key, const CACHED_MATCH* matches, int nb_matches)
+{
+	FILE* fd;
+	char path[MAX_PATH], tmp_path[MAX_PATH];
+	BOOL success;
+	int i;
+
+	if (cache_dir[0] == 0)
+		return;
+	static_sprintf(path, "%s\\%016llX.txt", cache_dir, key);
+	static_sprintf(tmp_path, "%s\\%016llX.%u.tmp", cache_dir, key, GetCurrentThreadId());
+	fd = fopenU(tmp_path, "w");
+	if (fd == NULL)
+		return;
+	success = (fprintf(fd, "%s\n", CACHE_SIGNATURE) > 0);
+	for (i = 0; i < nb_matches && success; i++)
+		success = (fprintf(fd, "%08llX %d\n", matches[i].offset, matches[i].pattern) > 0);
+	if (fclose(fd) != 0)
+		success = FALSE;
+	if (!success || !MoveFileExU(tmp_path, path, MOVEFILE_REPLACE_EXISTING))
+		_unlinkU(tmp_path);
+}
+
+/*
+ * Check that the data at each cached offset still matches the ORIGINAL value of its pattern.
+ */
+BOOL CheckCachedMatches(const PATTERN_SET* set, FILE_WINDOW* w, const CACHED_MATCH* matches, int nb_matches)
+{
+	const BYTE_PATTERN* p;
+	const uint8_t* data;
+	uint32_t j;
+	int i;
+
+	for (i = 0; i < nb_matches; i++) {
+		if (set->matcher != NULL) {
+			if ((size_t)matches[i].pattern >= set->nb_byte_patterns)
+				return FALSE;
+			p = &set->byte_patterns[matches[i].pattern];
+			data = MapFileWindow(w, matches[i].offset, p->len);
+			if (matches[i].offset % p->align != 0 || data == NULL)
+				return FALSE;
+			for (j = 0; j < p->len; j++) {
+				if ((data[j] & p->original_mask[j]) != p->original[j])
+					return FALSE;
+			}
+		} else {
+			if ((size_t)matches[i].pattern >= set->nb_patterns || matches[i].offset % set->align[matches[i].pattern] != 0)
+				return FALSE;
+			data = MapFileWindow(w, matches[i].offset, sizeof(uint64_t));
+			if (data == NULL || memcmp(data, &set->original[matches[i].pattern], sizeof(uint64_t)) != 0)
+				return FALSE;
+		}
+	}
+	return TRUE;
+}
@@ -0,0 +1,73 @@
+/*
+ * winpatch - Windows system file patcher
+ * Library interface
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <windows.h>
+#include <stdint.h>
+
+#pragma once
+
+/*
+ * The part of the patching engine that the winpatch library (libwinpatch.lib) exposes,
+ * so that files can be patched from another process, including ones that are already
+ * in memory. InitMatcher() must be called once, before any other call. Errors are
+ * reported on stderr.
+ */
+
+// A compiled set of [ORIGINAL PATCHED] pairs
+typedef struct _PATTERN_SET PATTERN_SET;
+
+typedef struct _SIGNING_SESSION SIGNING_SESSION;
+
+typedef enum {
+	KEY_RSA4096 = 0,		// CryptoAPI, slow to generate
+	KEY_RSA2048,			// CNG
+	KEY_ECDSA_P256,			// CNG
+} SIGNING_KEY_TYPE;
+
+// Flags for PatchBuffer()
+#define PATCH_FLAG_RAW				0x00000001	// Not a PE image, so only patch the data
+#define PATCH_FLAG_VERIFY_CHECKSUM	0x00000002	// Always recompute the PE checksum in full
+
+typedef struct {
+	DWORD nb_certs;			// Number of certificate table entries removed
+	DWORD old_checksum;
+	DWORD new_checksum;
+	BOOL incremental;		// Whether the new checksum was derived from the old one
+	uint64_t new_size;		// Size the file must be truncated to, once unmapped
+} PE_UPDATE;
+
+/* match.c */
+// Returns the name of the QWORD matcher that was selected for this CPU
+extern const char* InitMatcher(void);
+// values are ORIGINAL and PATCHED strings, in the same format as on the command line,
+// where ORIGINAL may have an @1, @2, @4 or @8 suffix to set the alignment of the matches
+extern PATTERN_SET* CreatePatternSet(char** values, int nb_values);
+extern void FreePatternSet(PATTERN_SET* set);
+
+/* patch.c */
+extern int PatchBuffer(const PATTERN_SET* set, uint8_t* buf, uint64_t size, DWORD flags, PE_UPDATE* update);
+
+/* pe.c */
+extern BOOL UpdatePEChecksum(uint8_t* buf, uint64_t size, DWORD* checksum);
+
+/* winpki.c */
+extern SIGNING_SESSION* OpenSigningSession(LPCSTR szCertSubject, SIGNING_KEY_TYPE key_type);
+extern BOOL SignFile(SIGNING_SESSION* session, LPCSTR szFileName, HANDLE hFile);
+extern void CloseSigningSession(SIGNING_SESSION* session);
@@ -0,0 +1,145 @@
+/*
+ * winpatch - Windows system file patcher
+ * Buffered logging
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef _DEBUG
+#define _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "winpatch.h"
+
+/*
+ * Each record in a log buffer is a stream identifier byte, followed
+ * by the NUL terminated text that was meant for that stream.
+ */
+#define LOG_STDOUT 1
+#define LOG_STDERR 2
+
+static __declspec(thread) LOG_BUFFER* thread_log = NULL;
+// Set when stdout carries data, in which case all the messages go to stderr
+static BOOL stdout_reserved = FALSE;
+
+/*
+ * Have all the output of lprintf() go to stderr, so that stdout can be used for data.
+ */
+void ReserveStdout(void)
+{
+	stdout_reserved = TRUE;
+}
+
+/*
+ * Redirect the output of lprintf() from the calling thread to a log buffer.
+ * Use NULL to go back to printing directly.
+ */
+void SetThreadLog(LOG_BUFFER* log)
+{
+	thread_log = log;
+}
+
+void lprintf(FILE* stream, const char* format, ...)
+{
+	va_list args, args_copy;
+	int len;
+	size_t size;
+	char* data;
+
+	if (stream == stdout && stdout_reserved)
+		stream = stderr;
+	va_start(args, format);
+	if (thread_log == NULL) {
+		vfprintf(stream, format, args);
+		va_end(args);
+		return;
+	}
+
+	va_copy(args_copy, args);
+	len = _vscprintf(format, args_copy);
+	va_end(args_copy);
+	if (len < 0)
+		goto out;
+	if (thread_log->len + len + 2 > thread_log->size) {
+		for (size = (thread_log->size == 0) ? 256 : thread_log->size; size < thread_log->len + len + 2; size *= 2);
+		data = realloc(thread_log->data, size);
+		if (data == NULL)
+			goto out;
+		thread_log->data = data;
+		thread_log->size = size;
+	}
+	thread_log->data[thread_log->len++] = (stream == stderr) ? LOG_STDERR : LOG_STDOUT;
+	vsnprintf(&thread_log->data[thread_log->len], thread_log->size - thread_log->len, format, args);
+	thread_log->len += (size_t)len + 1;
+
+out:
+	va_end(args);
+}
+
+/*
+ * Buffer the output of lprintf() from the calling thread into log, unless it is already
+ * being buffered, until EndLogBuffering() is called. Returns TRUE if buffering started.
+ */
+BOOL StartLogBuffering(LOG_BUFFER* log)
+{
+	memset(log, 0, sizeof(LOG_BUFFER));
+	if (thread_log != NULL)
+		return FALSE;
+	thread_log = log;
+	return TRUE;
+}
+
+void EndLogBuffering(LOG_BUFFER* log, BOOL started)
+{
+	if (!started)
+		return;
+	thread_log = NULL;
+	FlushLog(log);
+}
+
+/*
+ * Print the content of a log buffer to the streams it was meant for, and free it.
+ */
+void FlushLog(LOG_BUFFER* log)
+{
+	size_t pos, len, start, end;
+	char stream_id;
+
+	for (pos = 0; pos < log->len; ) {
+		// Consecutive messages for the same stream are joined, and written at once,
+		// since the console may not buffer them
+		stream_id = log->data[pos];
+		for (start = end = pos + 1; pos < log->len && log->data[pos] == stream_id; pos += len + 2) {
+			len = strlen(&log->data[pos + 1]);
+			memmove(&log->data[end], &log->data[pos + 1], len);
+			end += len;
+		}
+		fwrite(&log->data[start], 1, end - start, (stream_id == LOG_STDERR) ? stderr : stdout);
+	}
+	fflush(stdout);
+	free(log->data);
+	memset(log, 0, sizeof(LOG_BUFFER));
+}
@@ -0,0 +1,296 @@
+/*
+ * winpatch - Windows system file patcher
+ * Pinned patch manifests
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef _DEBUG
+#define _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <bcrypt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "msapi_utf8.h"
+#include "winpatch.h"
+
+#pragma comment(lib, "bcrypt.lib")
+
+/*
+ * Compute the SHA-256 of a mapped file.
+ */
+BOOL Sha256(FILE_WINDOW* w, uint8_t* digest)
+{
+	BOOL r = FALSE;
+	BCRYPT_ALG_HANDLE hAlg = NULL;
+	BCRYPT_HASH_HANDLE hHash = NULL;
+	uint8_t* data;
+	uint64_t pos;
+	size_t len;
+
+	if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&hAlg, BCRYPT_SHA256_ALGORITHM, NULL, 0)) ||
+		!BCRYPT_SUCCESS(BCryptCreateHash(hAlg, &hHash, NULL, 0, NULL, 0, 0))) {
+		lprintf(stderr, "Could not initialize SHA-256 hash\n");
+		goto out;
+	}
+	for (pos = 0; pos < w->size; pos += len) {
+		len = (size_t)min(w->size - pos, WINDOW_SIZE);
+		data = MapFileWindow(w, pos, len);
+		if (data == NULL || !BCRYPT_SUCCESS(BCryptHashData(hHash, data, (ULONG)len, 0)))
+			goto out;
+	}
+	r = BCRYPT_SUCCESS(BCryptFinishHash(hHash, digest, SHA256_DIGEST_SIZE, 0));
+
+out:
+	if (hHash != NULL)
+		BCryptDestroyHash(hHash);
+	if (hAlg != NULL)
+		BCryptCloseAlgorithmProvider(hAlg, 0);
+	return r;
+}
+
+BOOL ParseHexDigest(const char* str, uint8_t* digest, size_t size)
+{
+	size_t i;
+	unsigned int val;
+
+	if (strlen(str) != 2 * size)
+		return FALSE;
+	for (i = 0; i < size; i++) {
+		if (sscanf_s(&str[2 * i], "%2x", &val) != 1)
+			return FALSE;
+		digest[i] = (uint8_t)val;
+	}
+	return TRUE;
+}
+
+void FreePinnedManifest(PINNED_MANIFEST* manifest)
+{
+	int i, j;
+
+	if (manifest == NULL)
+		return;
+	for (i = 0; i < manifest->nb_blocks; i++) {
+		for (j = 0; j < manifest->blocks[i].nb_patches; j++)
+			FreeBytePattern(&manifest->blocks[i].patches[j].pattern);
+		free(manifest->blocks[i].patches);
+	}
+	free(manifest->blocks);
+	free(manifest);
+}
+
+/*
+ * Return the number of the (1-based) block before index that has the same fingerprint
+ * as the block at index, or 0 if none.
+ */
+static int FindDuplicateBlock(const PINNED_MANIFEST* manifest, int index)
+{
+	const PINNED_BLOCK *a, *b = &manifest->blocks[index];
+	int i;
+
+	for (i = 0; i < index; i++) {
+		a = &manifest->blocks[i];
+		if (a->type != b->type)
+			continue;
+		if (a->type == FINGERPRINT_PE && a->timestamp == b->timestamp && a->size_of_image == b->size_of_image)
+			return i + 1;
+		if (a->type == FINGERPRINT_SHA256 && memcmp(a->sha256, b->sha256, SHA256_DIGEST_SIZE) == 0)
+			return i + 1;
+	}
+	return 0;
+}
+
+/*
+ * Read a pinned manifest. This is a text file made of blocks, that each start with
+ * the fingerprint of the file they apply to, followed by one line per patch:
+ *   pe:TTTTTTTT:SSSSSSSS  (PE TimeDateStamp and SizeOfImage, in hex) or
+ *   sha256:<hash of the unpatched file>
+ *   OFFSET ORIGINAL PATCHED
+ *   ...
+ * where ORIGINAL and PATCHED are either QWORDs or byte patterns. Since only the first
+ * block that matches a file is used, fingerprints that appear more than once are rejected.
+ */
+PINNED_MANIFEST* ReadPinnedManifest(const char* path)
+{
+	FILE* fd;
+	char line[1024], *p, *token[4], *next;
+	int nb_tokens, line_nr = 0, dup;
+	PINNED_MANIFEST* manifest;
+	PINNED_BLOCK *block = NULL, *new_blocks;
+	PINNED_PATCH* new_patches;
+	unsigned long long offset;
+
+	manifest = calloc(1, sizeof(PINNED_MANIFEST));
+	if (manifest == NULL)
+		return NULL;
+	fd = fopenU(path, "r");
+	if (fd == NULL) {
+		lprintf(stderr, "Could not open pinned manifest '%s'\n", path);
+		free(manifest);
+		return NULL;
+	}
+
+	while (fgets(line, sizeof(line), fd) != NULL) {
+		line_nr++;
+		p = line;
+		// Skip the UTF-8 BOM, if any
+		if (line_nr == 1 && memcmp(p, "\xef\xbb\xbf", 3) == 0)
+			p += 3;
+		next = NULL;
+		for (nb_tokens = 0; nb_tokens < ARRAYSIZE(token); nb_tokens++) {
+			token[nb_tokens] = strtok_s((nb_tokens == 0) ? p : NULL, " \t\r\n", &next);
+			if (token[nb_tokens] == NULL || token[nb_tokens][0] == '#')
+				break;
+		}
+		if (nb_tokens == 0)
+			continue;
+
+		if (nb_tokens == 1) {
+			new_blocks = realloc(manifest->blocks, (manifest->nb_blocks + 1) * sizeof(PINNED_BLOCK));
+			if (new_blocks == NULL) {
+				lprintf(stderr, "realloc error\n");
+				goto error;
+			}
+			manifest->blocks = new_blocks;
+			block = &manifest->blocks[manifest->nb_blocks++];
+			memset(block, 0, sizeof(PINNED_BLOCK));
+			if (_strnicmp(token[0], "pe:", 3) == 0) {
+				block->type = FINGERPRINT_PE;
+				if (sscanf_s(&token[0][3], "%8lx:%8lx", &block->timestamp, &block->size_of_image) != 2) {
+					lprintf(stderr, "%s:%d: Invalid PE fingerprint\n", path, line_nr);
+					goto error;
+				}
+			} else if (_strnicmp(token[0], "sha256:", 7) == 0) {
+				block->type = FINGERPRINT_SHA256;
+				if (!ParseHexDigest(&token[0][7], block->sha256, SHA256_DIGEST_SIZE)) {
+					lprintf(stderr, "%s:%d: Invalid SHA-256 fingerprint\n", path, line_nr);
+					goto error;
+				}
+				manifest->need_sha256 = TRUE;
+			} else {
+				lprintf(stderr, "%s:%d: Unknown fingerprint '%s'\n", path, line_nr, token[0]);
+				goto error;
+			}
+			dup = FindDuplicateBlock(manifest, manifest->nb_blocks - 1);
+			if (dup != 0) {
+				lprintf(stderr, "%s:%d: Fingerprint '%s' is the same as the one of block #%d\n",
+					path, line_nr, token[0], dup);
+				goto error;
+			}
+			continue;
+		}
+
+		if (nb_tokens != 3 || block == NULL) {
+			lprintf(stderr, "%s:%d: Expected a fingerprint or an OFFSET ORIGINAL PATCHED triple\n", path, line_nr);
+			goto error;
+		}
+		if (sscanf_s(token[0], "%llx", &offset) != 1) {
+			lprintf(stderr, "%s:%d: Invalid offset '%s'\n", path, line_nr, token[0]);
+			goto error;
+		}
+		new_patches = realloc(block->patches, (block->nb_patches + 1) * sizeof(PINNED_PATCH));
+		if (new_patches == NULL) {
+			lprintf(stderr, "realloc error\n");
+			goto error;
+		}
+		block->patches = new_patches;
+		block->patches[block->nb_patches].offset = offset;
+		if (!ParsePatternPair(token[1], token[2], &block->patches[block->nb_patches].pattern)) {
+			lprintf(stderr, "%s:%d: Invalid pair '%s %s'\n", path, line_nr, token[1], token[2]);
+			goto error;
+		}
+		block->nb_patches++;
+	}
+	fclose(fd);
+	if (manifest->nb_blocks == 0)
+		lprintf(stderr, "No fingerprints in pinned manifest '%s'\n", path);
+	return manifest;
+
+error:
+	fclose(fd);
+	FreePinnedManifest(manifest);
+	return NULL;
+}
+
+/*
+ * Return the manifest block whose fingerprint matches the mapped file, or NULL if none.
+ * The SHA-256 of the file is only computed if the manifest uses that kind of fingerprint.
+ */
+const PINNED_BLOCK* FindPinnedBlock(const PINNED_MANIFEST* manifest, FILE_WINDOW* w)
+{
+	PIMAGE_NT_HEADERS32 pImageNTHeader32;
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	BOOL has_digest = FALSE;
+	int i;
+
+	if (manifest == NULL)
+		return NULL;
+	pImageNTHeader32 = (w->size <= MAXDWORD) ? GetNtHeaders(w->head, w->head_len) : NULL;
+	if (manifest->need_sha256)
+		has_digest = Sha256(w, digest);
+
+	for (i = 0; i < manifest->nb_blocks; i++) {
+		switch (manifest->blocks[i].type) {
+		case FINGERPRINT_PE:
+			// SizeOfImage is at the same offset for PE32 and PE32+
+			if (pImageNTHeader32 != NULL &&
+				pImageNTHeader32->FileHeader.TimeDateStamp == manifest->blocks[i].timestamp &&
+				pImageNTHeader32->OptionalHeader.SizeOfImage == manifest->blocks[i].size_of_image)
+				return &manifest->blocks[i];
+			break;
+		case FINGERPRINT_SHA256:
+			if (has_digest && memcmp(digest, manifest->blocks[i].sha256, SHA256_DIGEST_SIZE) == 0)
+				return &manifest->blocks[i];
+			break;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Check that all the patches from a block match the mapped file.
+ */
+BOOL CheckPinnedBlock(const PINNED_BLOCK* block, FILE_WINDOW* w)
+{
+	const PINNED_PATCH* patch;
+	const uint8_t* data;
+	uint32_t j;
+	int i;
+
+	for (i = 0; i < block->nb_patches; i++) {
+		patch = &block->patches[i];
+		data = MapFileWindow(w, patch->offset, patch->pattern.len);
+		if (data == NULL) {
+			lprintf(stdout, "Pinned offset %08llX is past the end of the file\n", patch->offset);
+			return FALSE;
+		}
+		for (j = 0; j < patch->pattern.len; j++) {
+			if ((data[j] & patch->pattern.original_mask[j]) != patch->pattern.original[j]) {
+				lprintf(stdout, "Data at pinned offset %08llX does not match\n", patch->offset);
+				return FALSE;
+			}
+		}
+	}
+	return TRUE;
+}
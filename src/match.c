@@ -0,0 +1,635 @@
+/*
+ * winpatch - Windows system file patcher
+ * Pattern sets and QWORD pattern matching
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef _DEBUG
+#define _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#if defined(_M_IX86) || defined(_M_X64)
+#include <intrin.h>
+#include <immintrin.h>
+#define HAVE_AVX2_MATCHER
+#elif defined(_M_ARM64)
+#include <arm_neon.h>
+#define HAVE_NEON_MATCHER
+#endif
+
+#include "winpatch.h"
+
+// Number of QWORDs (i.e. a full cache line) that get compared against the whole pattern set per iteration
+#define MATCH_BLOCK 8
+
+typedef size_t (*FindMatch_t)(const PATTERN_SET* set, const uint64_t* data, size_t start, size_t count);
+
+/*
+ * Above these numbers of patterns, the hashed lookup (about a dozen instructions per QWORD)
+ * beats comparing against the whole set. With AVX2, each pattern costs 5 instructions
+ * for 8 QWORDs, with NEON 9, and with scalar code about 3 per QWORD. Use the --cutoff
+ * option of the bench to measure the actual crossover on a given CPU.
+ */
+#define AVX2_MAX_PATTERNS   16
+#define NEON_MAX_PATTERNS   8
+#define SCALAR_MAX_PATTERNS 4
+#define FILTER_BITS 16
+#define HASH_MULTIPLIER 0x9E3779B97F4A7C15ULL
+
+static __inline uint64_t HashValue(uint64_t val)
+{
+	return val * HASH_MULTIPLIER;
+}
+
+static __inline BOOL InFilter(const PATTERN_SET* set, uint64_t hash)
+{
+	uint32_t bit = (uint32_t)(hash >> 32) & ((1 << FILTER_BITS) - 1);
+	return (set->filter[bit >> 6] & (1ULL << (bit & 0x3f))) ? TRUE : FALSE;
+}
+
+static __inline int ProbeTable(const PATTERN_SET* set, uint64_t val, uint64_t hash)
+{
+	uint32_t mask = (1 << set->table_bits) - 1, slot;
+
+	for (slot = (uint32_t)(hash >> (64 - set->table_bits)); set->table[slot] != 0; slot = (slot + 1) & mask) {
+		if (set->original[set->table[slot] - 1] == val)
+			return (int)set->table[slot] - 1;
+	}
+	return -1;
+}
+
+/*
+ * Return the index of the pattern whose ORIGINAL is val, or -1 if none.
+ */
+int LookupPattern(const PATTERN_SET* set, uint64_t val)
+{
+	uint64_t hash = HashValue(val);
+
+	if (!InFilter(set, hash))
+		return -1;
+	return ProbeTable(set, val, hash);
+}
+
+static BOOL ParseQword(const char* str, uint64_t* val)
+{
+	char* end;
+
+	if (str == NULL || str[0] == 0)
+		return FALSE;
+	*val = strtoull(str, &end, 16);
+	return (*end == 0);
+}
+
+static __inline uint8_t HexValue(char c)
+{
+	return (c <= '9') ? c - '0' : (c | 0x20) - 'a' + 10;
+}
+
+/*
+ * Split the optional suffixes from an ORIGINAL value, and copy the rest of the value
+ * into str. "@N", where N is 1, 2, 4 or 8, sets the alignment of the matches (align is
+ * left untouched if not specified), and a following "=N", "<=N" or ">=N" sets the
+ * number of matches the file must contain, which is unconstrained by default.
+ */
+static BOOL ParseSuffixes(const char* value, char* str, size_t size, uint32_t* align,
+	uint32_t* min_count, uint32_t* max_count)
+{
+	const char* suffix = strpbrk(value, "@=<>");
+	size_t len = (suffix == NULL) ? strlen(value) : (size_t)(suffix - value);
+	unsigned long n;
+	char op, *end;
+
+	*min_count = 0;
+	*max_count = UINT32_MAX;
+	if (len >= size)
+		return FALSE;
+	memcpy(str, value, len);
+	str[len] = 0;
+	if (suffix == NULL)
+		return TRUE;
+	if (suffix[0] == '@') {
+		n = (unsigned long)(suffix[1] - '0');
+		if (suffix[1] < '1' || suffix[1] > '8' || (n & (n - 1)) != 0)
+			return FALSE;
+		*align = (uint32_t)n;
+		suffix += 2;
+	}
+	if (suffix[0] == 0)
+		return TRUE;
+	op = suffix[0];
+	if (op == '=')
+		suffix++;
+	else if ((op == '<' || op == '>') && suffix[1] == '=')
+		suffix += 2;
+	else
+		return FALSE;
+	if (!isdigit((unsigned char)suffix[0]))
+		return FALSE;
+	n = strtoul(suffix, &end, 10);
+	if (*end != 0 || n >= UINT32_MAX)
+		return FALSE;
+	if (op != '<')
+		*min_count = (uint32_t)n;
+	if (op != '>')
+		*max_count = (uint32_t)n;
+	return TRUE;
+}
+
+/*
+ * Parse a colon separated byte pattern, such as "48:8B:??:05", into data and mask.
+ * Returns the length of the pattern, or 0 on error.
+ */
+static uint32_t ParseBytes(const char* str, uint8_t* data, uint8_t* mask)
+{
+	uint32_t len;
+
+	for (len = 0; len < MAX_PATTERN_LENGTH; len++, str += 3) {
+		if (str[0] == '?' && str[1] == '?') {
+			data[len] = 0;
+			mask[len] = 0;
+		} else if (isxdigit((unsigned char)str[0]) && isxdigit((unsigned char)str[1])) {
+			data[len] = (HexValue(str[0]) << 4) | HexValue(str[1]);
+			mask[len] = 0xff;
+		} else {
+			return 0;
+		}
+		if (str[2] == 0)
+			return len + 1;
+		if (str[2] != ':')
+			return 0;
+	}
+	return 0;
+}
+
+/*
+ * Initialize a byte pattern from its data and masks.
+ */
+static BOOL InitBytePattern(BYTE_PATTERN* p, const uint8_t* original, const uint8_t* original_mask,
+	const uint8_t* patched, const uint8_t* patched_mask, uint32_t len, uint32_t align, BOOL qword)
+{
+	uint32_t i, run;
+
+	memset(p, 0, sizeof(BYTE_PATTERN));
+	p->original = malloc(4 * (size_t)len);
+	if (p->original == NULL) {
+		lprintf(stderr, "Could not allocate pattern\n");
+		return FALSE;
+	}
+	p->original_mask = &p->original[len];
+	p->patched = &p->original[2 * len];
+	p->patched_mask = &p->original[3 * len];
+	for (i = 0; i < len; i++)
+		p->original[i] = original[i] & original_mask[i];
+	memcpy(p->original_mask, original_mask, len);
+	memcpy(p->patched, patched, len);
+	memcpy(p->patched_mask, patched_mask, len);
+	p->len = len;
+	p->align = align;
+	p->qword = qword;
+	p->max_count = UINT32_MAX;
+
+	// The anchor is the longest run of non wildcard bytes
+	for (i = 0, run = 0; i < len; i++) {
+		run = (original_mask[i] != 0) ? run + 1 : 0;
+		if (run > p->anchor_len) {
+			p->anchor_len = run;
+			p->anchor = i + 1 - run;
+		}
+	}
+	if (p->anchor_len == 0) {
+		lprintf(stderr, "Byte patterns must contain at least one non wildcard byte\n");
+		FreeBytePattern(p);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+void FreeBytePattern(BYTE_PATTERN* pattern)
+{
+	free(pattern->original);
+	memset(pattern, 0, sizeof(BYTE_PATTERN));
+}
+
+/*
+ * Parse a single [ORIGINAL PATCHED] pair, of either QWORDs or byte patterns, into
+ * a byte pattern. QWORDs are converted to their little endian representation, but
+ * are not subject to any alignment constraint.
+ */
+BOOL ParsePatternPair(const char* original, const char* patched, BYTE_PATTERN* pattern)
+{
+	uint8_t data[4][MAX_PATTERN_LENGTH];
+	uint64_t val[2];
+	uint32_t len;
+
+	if (strchr(original, ':') != NULL || strchr(patched, ':') != NULL) {
+		len = ParseBytes(original, data[0], data[1]);
+		if (len == 0 || ParseBytes(patched, data[2], data[3]) != len)
+			return FALSE;
+		return InitBytePattern(pattern, data[0], data[1], data[2], data[3], len, 1, FALSE);
+	}
+	if (!ParseQword(original, &val[0]) || !ParseQword(patched, &val[1]))
+		return FALSE;
+	memcpy(data[0], &val[0], sizeof(uint64_t));
+	memcpy(data[2], &val[1], sizeof(uint64_t));
+	memset(data[1], 0xff, sizeof(uint64_t));
+	memset(data[3], 0xff, sizeof(uint64_t));
+	return InitBytePattern(pattern, data[0], data[1], data[2], data[3], sizeof(uint64_t), 1, TRUE);
+}
+
+/*
+ * Return the number of patterns that scans report, which are the byte patterns if the
+ * set uses the byte matcher, or the QWORDs otherwise.
+ */
+size_t GetNumberOfPatterns(const PATTERN_SET* set)
+{
+	return (set->matcher != NULL) ? set->nb_byte_patterns : set->nb_patterns;
+}
+
+/*
+ * Get the minimum and maximum number of matches of a pattern, from the ones that scans
+ * report, where UINT32_MAX means that there is no maximum.
+ */
+void GetPatternCounts(const PATTERN_SET* set, int pattern, uint32_t* min_count, uint32_t* max_count)
+{
+	if (set->matcher != NULL) {
+		*min_count = set->byte_patterns[pattern].min_count;
+		*max_count = set->byte_patterns[pattern].max_count;
+	} else {
+		*min_count = set->min_count[pattern];
+		*max_count = set->max_count[pattern];
+	}
+}
+
+/*
+ * Add a byte pattern to the set. Identical patterns are only kept once, whereas
+ * patterns that would patch the same ORIGINAL to different values are rejected.
+ */
+static BOOL AddBytePattern(PATTERN_SET* set, const uint8_t* original, const uint8_t* original_mask,
+	const uint8_t* patched, const uint8_t* patched_mask, uint32_t len, uint32_t align, BOOL qword)
+{
+	BYTE_PATTERN* p;
+	uint32_t i;
+	size_t j;
+
+	for (j = 0; j < set->nb_byte_patterns; j++) {
+		p = &set->byte_patterns[j];
+		if (p->len != len || p->align != align || memcmp(p->original_mask, original_mask, len) != 0)
+			continue;
+		for (i = 0; i < len && p->original[i] == (original[i] & original_mask[i]); i++);
+		if (i < len)
+			continue;
+		if (memcmp(p->patched, patched, len) != 0 || memcmp(p->patched_mask, patched_mask, len) != 0) {
+			lprintf(stderr, "Conflicting patches for byte pattern #%u\n", (uint32_t)j + 1);
+			return FALSE;
+		}
+		lprintf(stderr, "Ignoring duplicate byte pattern #%u\n", (uint32_t)j + 1);
+		return TRUE;
+	}
+
+	if (!InitBytePattern(&set->byte_patterns[set->nb_byte_patterns], original, original_mask,
+		patched, patched_mask, len, align, qword))
+		return FALSE;
+	set->nb_byte_patterns++;
+	return TRUE;
+}
+
+/*
+ * Compile an array of [ORIGINAL PATCHED] hex strings into a pattern set.
+ * Values that contain a colon are byte patterns, and any other value is a QWORD.
+ * ORIGINAL can be suffixed with @1, @2, @4 or @8 to set the alignment that matches
+ * must have, which defaults to 1 for byte patterns and 8 for QWORDs. QWORDs that use
+ * a different alignment stay in the QWORD table, so that, unless the set also has
+ * byte patterns, they are still searched with the vector matchers.
+ * ORIGINAL can then be suffixed with =N, <=N or >=N, to set the number of matches
+ * that a file must contain for that pair.
+ * Identical pairs are only kept once, whereas pairs that would patch the
+ * same ORIGINAL to different values are rejected.
+ */
+PATTERN_SET* CreatePatternSet(char** values, int nb_values)
+{
+	PATTERN_SET* set;
+	uint64_t original, patched, hash;
+	uint8_t data[4][MAX_PATTERN_LENGTH];
+	uint8_t qword_mask[sizeof(uint64_t)];
+	char str[3 * MAX_PATTERN_LENGTH];
+	uint32_t slot, mask, bit, len, align, min_count, max_count;
+	size_t nb_byte_patterns;
+	int i;
+
+	if (nb_values <= 0 || nb_values % 2)
+		return NULL;
+
+	set = calloc(1, sizeof(PATTERN_SET));
+	if (set == NULL)
+		return NULL;
+	// Keep the hash table at most half full
+	for (set->table_bits = 4; (1U << set->table_bits) < (uint32_t)nb_values; set->table_bits++);
+	mask = (1 << set->table_bits) - 1;
+	set->original = calloc(nb_values / 2, sizeof(uint64_t));
+	set->patched = calloc(nb_values / 2, sizeof(uint64_t));
+	set->table = calloc((size_t)mask + 1, sizeof(uint32_t));
+	set->filter = calloc((1 << FILTER_BITS) / 64, sizeof(uint64_t));
+	set->byte_patterns = calloc(nb_values / 2, sizeof(BYTE_PATTERN));
+	set->min_count = calloc(nb_values / 2, sizeof(uint32_t));
+	set->max_count = calloc(nb_values / 2, sizeof(uint32_t));
+	set->align = calloc(nb_values / 2, sizeof(uint32_t));
+	if (set->original == NULL || set->patched == NULL || set->table == NULL || set->filter == NULL ||
+		set->byte_patterns == NULL || set->min_count == NULL || set->max_count == NULL || set->align == NULL) {
+		lprintf(stderr, "Could not allocate pattern set\n");
+		goto error;
+	}
+	set->min_align = sizeof(uint64_t);
+
+	for (i = 0; i < nb_values; i += 2) {
+		align = 0;
+		if (!ParseSuffixes(values[i], str, sizeof(str), &align, &min_count, &max_count)) {
+			lprintf(stderr, "Invalid suffix for '%s' (must be @1, @2, @4 or @8, then =N, <=N or >=N)\n", values[i]);
+			goto error;
+		}
+		// Duplicates keep the expected number of matches of the first occurrence
+		nb_byte_patterns = set->nb_byte_patterns;
+		if (strchr(str, ':') != NULL || strchr(values[i + 1], ':') != NULL) {
+			len = ParseBytes(str, data[0], data[1]);
+			if (len == 0 || ParseBytes(values[i + 1], data[2], data[3]) != len) {
+				lprintf(stderr, "Invalid byte pattern pair '%s %s'\n", values[i], values[i + 1]);
+				goto error;
+			}
+			if (!AddBytePattern(set, data[0], data[1], data[2], data[3], len, (align == 0) ? 1 : align, FALSE))
+				goto error;
+			if (set->nb_byte_patterns > nb_byte_patterns) {
+				set->byte_patterns[nb_byte_patterns].min_count = min_count;
+				set->byte_patterns[nb_byte_patterns].max_count = max_count;
+			}
+			continue;
+		}
+		if (!ParseQword(str, &original) || !ParseQword(values[i + 1], &patched)) {
+			lprintf(stderr, "Invalid QWORD pair '%s %s'\n", values[i], values[i + 1]);
+			goto error;
+		}
+		if (align == 0)
+			align = sizeof(uint64_t);
+		hash = HashValue(original);
+		for (slot = (uint32_t)(hash >> (64 - set->table_bits)); set->table[slot] != 0; slot = (slot + 1) & mask) {
+			if (set->original[set->table[slot] - 1] == original)
+				break;
+		}
+		if (set->table[slot] != 0) {
+			if (set->patched[set->table[slot] - 1] != patched) {
+				lprintf(stderr, "Conflicting patches for %016llX: %016llX and %016llX\n",
+					original, set->patched[set->table[slot] - 1], patched);
+				goto error;
+			}
+			if (set->align[set->table[slot] - 1] != align) {
+				lprintf(stderr, "Conflicting alignments for %016llX: %u and %u\n",
+					original, set->align[set->table[slot] - 1], align);
+				goto error;
+			}
+			lprintf(stderr, "Ignoring duplicate pair %016llX %016llX\n", original, patched);
+			continue;
+		}
+		set->original[set->nb_patterns] = original;
+		set->patched[set->nb_patterns] = patched;
+		set->min_count[set->nb_patterns] = min_count;
+		set->max_count[set->nb_patterns] = max_count;
+		set->align[set->nb_patterns] = align;
+		set->min_align = min(set->min_align, align);
+		set->table[slot] = (uint32_t)++set->nb_patterns;
+		bit = (uint32_t)(hash >> 32) & ((1 << FILTER_BITS) - 1);
+		set->filter[bit >> 6] |= 1ULL << (bit & 0x3f);
+	}
+
+	// If we have byte patterns, everything needs to go through the byte matcher.
+	// QWORDs are little endian, which is also the byte order of the file data.
+	if (set->nb_byte_patterns != 0) {
+		memset(qword_mask, 0xff, sizeof(qword_mask));
+		for (i = 0; i < (int)set->nb_patterns; i++) {
+			nb_byte_patterns = set->nb_byte_patterns;
+			if (!AddBytePattern(set, (uint8_t*)&set->original[i], qword_mask, (uint8_t*)&set->patched[i],
+				qword_mask, sizeof(uint64_t), set->align[i], TRUE))
+				goto error;
+			if (set->nb_byte_patterns > nb_byte_patterns) {
+				set->byte_patterns[nb_byte_patterns].min_count = set->min_count[i];
+				set->byte_patterns[nb_byte_patterns].max_count = set->max_count[i];
+			}
+		}
+		set->matcher = CreateByteMatcher(set->byte_patterns, set->nb_byte_patterns);
+		if (set->matcher == NULL)
+			goto error;
+	}
+
+	// A scan can only stop early if all the patterns have a maximum number of matches, and
+	// none of them must be absent, since the whole file needs to be searched to confirm it
+	set->bounded = TRUE;
+	for (i = 0; i < (int)GetNumberOfPatterns(set); i++) {
+		GetPatternCounts(set, i, &min_count, &max_count);
+		if (min_count != 0 || max_count != UINT32_MAX)
+			set->counted = TRUE;
+		if (max_count == 0 || max_count == UINT32_MAX)
+			set->bounded = FALSE;
+	}
+	return set;
+
+error:
+	FreePatternSet(set);
+	return NULL;
+}
+
+void FreePatternSet(PATTERN_SET* set)
+{
+	size_t i;
+
+	if (set == NULL)
+		return;
+	free(set->original);
+	free(set->patched);
+	free(set->table);
+	free(set->filter);
+	free(set->min_count);
+	free(set->max_count);
+	free(set->align);
+	if (set->byte_patterns != NULL) {
+		for (i = 0; i < set->nb_byte_patterns; i++)
+			FreeBytePattern(&set->byte_patterns[i]);
+	}
+	free(set->byte_patterns);
+	FreeByteMatcher(set->matcher);
+	free(set);
+}
+
+static size_t FindMatchScalar(const PATTERN_SET* set, const uint64_t* data, size_t start, size_t count)
+{
+	size_t pos, i;
+
+	for (pos = start; pos < count; pos++) {
+		for (i = 0; i < set->nb_patterns; i++) {
+			if (data[pos] == set->original[i])
+				return pos;
+		}
+	}
+	return count;
+}
+
+static size_t FindMatchTable(const PATTERN_SET* set, const uint64_t* data, size_t start, size_t count)
+{
+	size_t pos;
+	uint64_t hash;
+
+	for (pos = start; pos < count; pos++) {
+		hash = HashValue(data[pos]);
+		if (InFilter(set, hash) && ProbeTable(set, data[pos], hash) >= 0)
+			return pos;
+	}
+	return count;
+}
+
+#if defined(HAVE_AVX2_MATCHER)
+static size_t FindMatchAVX2(const PATTERN_SET* set, const uint64_t* data, size_t start, size_t count)
+{
+	size_t pos, i;
+	unsigned long index;
+	int mask;
+	__m256i v0, v1, acc0, acc1, pattern;
+
+	for (pos = start; pos + MATCH_BLOCK <= count; pos += MATCH_BLOCK) {
+		v0 = _mm256_loadu_si256((const __m256i*)&data[pos]);
+		v1 = _mm256_loadu_si256((const __m256i*)&data[pos + 4]);
+		acc0 = _mm256_setzero_si256();
+		acc1 = _mm256_setzero_si256();
+		for (i = 0; i < set->nb_patterns; i++) {
+			pattern = _mm256_set1_epi64x((long long)set->original[i]);
+			acc0 = _mm256_or_si256(acc0, _mm256_cmpeq_epi64(v0, pattern));
+			acc1 = _mm256_or_si256(acc1, _mm256_cmpeq_epi64(v1, pattern));
+		}
+		mask = _mm256_movemask_pd(_mm256_castsi256_pd(acc0)) |
+			(_mm256_movemask_pd(_mm256_castsi256_pd(acc1)) << 4);
+		if (mask != 0) {
+			_mm256_zeroupper();
+			_BitScanForward(&index, (unsigned long)mask);
+			return pos + index;
+		}
+	}
+	_mm256_zeroupper();
+	return FindMatchScalar(set, data, pos, count);
+}
+
+static BOOL HasAVX2(void)
+{
+	int regs[4];
+
+	__cpuid(regs, 0);
+	if (regs[0] < 7)
+		return FALSE;
+	// We need the OS to save the YMM registers (OSXSAVE + AVX, and XCR0 bits 1 and 2)
+	__cpuid(regs, 1);
+	if ((regs[2] & (1 << 27)) == 0 || (regs[2] & (1 << 28)) == 0)
+		return FALSE;
+	if ((_xgetbv(0) & 0x06) != 0x06)
+		return FALSE;
+	__cpuidex(regs, 7, 0);
+	return (regs[1] & (1 << 5)) ? TRUE : FALSE;
+}
+#endif
+
+#if defined(HAVE_NEON_MATCHER)
+static size_t FindMatchNEON(const PATTERN_SET* set, const uint64_t* data, size_t start, size_t count)
+{
+	size_t pos, i;
+	uint64x2_t v0, v1, v2, v3, acc0, acc1, acc2, acc3, pattern;
+
+	for (pos = start; pos + MATCH_BLOCK <= count; pos += MATCH_BLOCK) {
+		v0 = vld1q_u64(&data[pos]);
+		v1 = vld1q_u64(&data[pos + 2]);
+		v2 = vld1q_u64(&data[pos + 4]);
+		v3 = vld1q_u64(&data[pos + 6]);
+		acc0 = acc1 = acc2 = acc3 = vdupq_n_u64(0);
+		for (i = 0; i < set->nb_patterns; i++) {
+			pattern = vdupq_n_u64(set->original[i]);
+			acc0 = vorrq_u64(acc0, vceqq_u64(v0, pattern));
+			acc1 = vorrq_u64(acc1, vceqq_u64(v1, pattern));
+			acc2 = vorrq_u64(acc2, vceqq_u64(v2, pattern));
+			acc3 = vorrq_u64(acc3, vceqq_u64(v3, pattern));
+		}
+		acc0 = vorrq_u64(vorrq_u64(acc0, acc1), vorrq_u64(acc2, acc3));
+		// Only a match in the block tells us to look for the exact position
+		if (vmaxvq_u32(vreinterpretq_u32_u64(acc0)) != 0)
+			return FindMatchScalar(set, data, pos, pos + MATCH_BLOCK);
+	}
+	return FindMatchScalar(set, data, pos, count);
+}
+#endif
+
+static FindMatch_t pfFindMatch = FindMatchScalar;
+static size_t max_vector_patterns = SCALAR_MAX_PATTERNS;
+
+/*
+ * Select the fastest vector matcher available for the CPU we are running on.
+ * Returns the name of the selected matcher.
+ */
+const char* InitMatcher(void)
+{
+#if defined(HAVE_AVX2_MATCHER)
+	if (HasAVX2()) {
+		pfFindMatch = FindMatchAVX2;
+		max_vector_patterns = AVX2_MAX_PATTERNS;
+		return "AVX2";
+	}
+#elif defined(HAVE_NEON_MATCHER)
+	if (IsProcessorFeaturePresent(PF_ARM_NEON_INSTRUCTIONS_AVAILABLE)) {
+		pfFindMatch = FindMatchNEON;
+		max_vector_patterns = NEON_MAX_PATTERNS;
+		return "NEON";
+	}
+#endif
+	pfFindMatch = FindMatchScalar;
+	max_vector_patterns = SCALAR_MAX_PATTERNS;
+	return "scalar";
+}
+
+/*
+ * Get or override the number of patterns above which the hashed lookup is used,
+ * instead of the matcher selected by InitMatcher().
+ */
+size_t GetMatcherCutoff(void)
+{
+	return max_vector_patterns;
+}
+
+void SetMatcherCutoff(size_t max_patterns)
+{
+	max_vector_patterns = max_patterns;
+}
+
+/*
+ * Return the index of the first QWORD from data[start] to data[count - 1]
+ * that matches one of the ORIGINAL values from the set, or count if none.
+ */
+size_t FindMatch(const PATTERN_SET* set, const uint64_t* data, size_t start, size_t count)
+{
+	if (set->nb_patterns > max_vector_patterns)
+		return FindMatchTable(set, data, start, count);
+	return pfFindMatch(set, data, start, count);
+}
@@ -1141,6 +1141,16 @@ static __inline BOOL MoveFileU(const char* lpExistingFileName, const char* lpNew
 	return ret;
 }
 
+static __inline BOOL MoveFileExU(const char* lpExistingFileName, const char* lpNewFileName, DWORD dwFlags)
+{
+	wconvert(lpExistingFileName);
+	wconvert(lpNewFileName);
+	BOOL ret = MoveFileExW(wlpExistingFileName, wlpNewFileName, dwFlags);
+	wfree(lpNewFileName);
+	wfree(lpExistingFileName);
+	return ret;
+}
+
 // The following expects PropertyBuffer to contain a single Unicode string
 static __inline BOOL SetupDiGetDeviceRegistryPropertyU(HDEVINFO DeviceInfoSet, PSP_DEVINFO_DATA DeviceInfoData,
 	DWORD Property, PDWORD PropertyRegDataType, PBYTE PropertyBuffer, DWORD PropertyBufferSize, PDWORD RequiredSize)
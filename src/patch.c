@@ -0,0 +1,502 @@
+/*
+ * winpatch - Windows system file patcher
+ * Patching engine
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef _DEBUG
+#define _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "winpatch.h"
+
+// QWORDs that don't need to be 64-bit aligned are searched for at each of their shifts
+// one block at a time, so that the data is still in the cache for the extra passes
+#define SHIFT_BLOCK_SIZE (64 * 1024)
+
+static BOOL AddEdit(EDIT_LIST* list, uint64_t offset, uint32_t len, BOOL qword, int pattern,
+	const uint8_t* patched, const uint8_t* mask)
+{
+	PATCH_EDIT* new_edits;
+
+	if (list->nb_edits >= list->max_edits) {
+		list->max_edits = (list->max_edits == 0) ? 16 : 2 * list->max_edits;
+		new_edits = realloc(list->edits, list->max_edits * sizeof(PATCH_EDIT));
+		if (new_edits == NULL) {
+			lprintf(stderr, "Could not allocate edit list\n");
+			return FALSE;
+		}
+		list->edits = new_edits;
+	}
+	list->edits[list->nb_edits].offset = offset;
+	list->edits[list->nb_edits].len = len;
+	list->edits[list->nb_edits].qword = qword;
+	list->edits[list->nb_edits].pattern = pattern;
+	list->edits[list->nb_edits].patched = patched;
+	list->edits[list->nb_edits].mask = mask;
+	list->nb_edits++;
+	return TRUE;
+}
+
+static BOOL AddBytePatternEdit(void* ctx, int pattern, uint64_t offset)
+{
+	EDIT_LIST* list = (EDIT_LIST*)ctx;
+	const BYTE_PATTERN* p = &list->set->byte_patterns[pattern];
+
+	return AddEdit(list, offset, p->len, p->qword, pattern, p->patched, p->patched_mask);
+}
+
+static int CompareEdits(const void* a, const void* b)
+{
+	const PATCH_EDIT* ea = (const PATCH_EDIT*)a;
+	const PATCH_EDIT* eb = (const PATCH_EDIT*)b;
+
+	if (ea->offset != eb->offset)
+		return (ea->offset < eb->offset) ? -1 : 1;
+	// Prefer the longest match, and make sure the order is deterministic
+	if (ea->len != eb->len)
+		return (ea->len > eb->len) ? -1 : 1;
+	return (ea->patched < eb->patched) ? -1 : ((ea->patched > eb->patched) ? 1 : 0);
+}
+
+/*
+ * Sort the edits in file order, and drop the ones that overlap a previous edit.
+ */
+static void SortEdits(EDIT_LIST* list)
+{
+	int i, j;
+
+	if (list->nb_edits <= 1)
+		return;
+	qsort(list->edits, list->nb_edits, sizeof(PATCH_EDIT), CompareEdits);
+	for (i = 1, j = 0; i < list->nb_edits; i++) {
+		if (list->edits[i].offset < list->edits[j].offset + list->edits[j].len) {
+			lprintf(stderr, "Ignoring match at %08llX, which overlaps match at %08llX\n",
+				list->edits[i].offset, list->edits[j].offset);
+			continue;
+		}
+		list->edits[++j] = list->edits[i];
+	}
+	list->nb_edits = j + 1;
+}
+
+// The number of matches of each pattern, for sets that expect a specific number of them
+typedef struct {
+	const PATTERN_SET* set;
+	uint32_t* counts;		// NULL if the set has no expectations
+	size_t nb_patterns;
+	size_t nb_saturated;	// Number of patterns that reached their maximum number of matches
+	BOOL stop_early;		// Whether to stop the scan once all the patterns reached their maximum
+} MATCH_COUNTS;
+
+static BOOL InitMatchCounts(MATCH_COUNTS* mc, const PATTERN_SET* set, BOOL stop_early)
+{
+	memset(mc, 0, sizeof(MATCH_COUNTS));
+	mc->set = set;
+	mc->stop_early = stop_early;
+	if (!set->counted)
+		return TRUE;
+	mc->nb_patterns = GetNumberOfPatterns(set);
+	mc->counts = calloc(mc->nb_patterns, sizeof(uint32_t));
+	return (mc->counts != NULL);
+}
+
+static void PrintPattern(const PATTERN_SET* set, int pattern)
+{
+	if (set->matcher == NULL)
+		lprintf(stderr, "%016llX", set->original[pattern]);
+	else
+		lprintf(stderr, "Byte pattern #%d", pattern + 1);
+}
+
+/*
+ * Account for a match of a pattern. Returns FALSE if the pattern already has its
+ * maximum number of matches, in which case the file must be rejected.
+ */
+static BOOL CountMatch(MATCH_COUNTS* mc, int pattern)
+{
+	uint32_t min_count, max_count;
+
+	if (mc->counts == NULL)
+		return TRUE;
+	GetPatternCounts(mc->set, pattern, &min_count, &max_count);
+	if (mc->counts[pattern] >= max_count) {
+		PrintPattern(mc->set, pattern);
+		lprintf(stderr, " matches more than %u time(s)\n", max_count);
+		return FALSE;
+	}
+	if (++mc->counts[pattern] == max_count)
+		mc->nb_saturated++;
+	return TRUE;
+}
+
+// Once all the patterns have their maximum number of matches, the rest of the file can be skipped
+// if requested, at the cost of not detecting the extra matches it may contain
+static __inline BOOL IsScanComplete(const MATCH_COUNTS* mc)
+{
+	return mc->stop_early && mc->set->bounded && mc->nb_saturated == mc->nb_patterns;
+}
+
+/*
+ * Check that all the patterns have at least their minimum number of matches.
+ */
+static BOOL CheckMinCounts(const MATCH_COUNTS* mc)
+{
+	uint32_t min_count, max_count;
+	size_t i;
+	BOOL r = TRUE;
+
+	if (mc->counts == NULL)
+		return TRUE;
+	for (i = 0; i < mc->nb_patterns; i++) {
+		GetPatternCounts(mc->set, (int)i, &min_count, &max_count);
+		if (mc->counts[i] < min_count) {
+			PrintPattern(mc->set, (int)i);
+			lprintf(stderr, " matches %u time(s), instead of at least %u\n", mc->counts[i], min_count);
+			r = FALSE;
+		}
+	}
+	return r;
+}
+
+// Byte pattern matches from a window, which is at offset pos in the file
+typedef struct {
+	EDIT_LIST* list;
+	uint64_t pos;
+	MATCH_COUNTS* mc;
+	BOOL failed;			// Whether the search was stopped by an error, rather than completed
+} WINDOW_MATCH_CTX;
+
+static BOOL AddWindowMatch(void* ctx, int pattern, uint64_t offset)
+{
+	WINDOW_MATCH_CTX* wctx = (WINDOW_MATCH_CTX*)ctx;
+
+	// Matches that start in the overlap are reported by the next window
+	if (offset >= WINDOW_SIZE)
+		return TRUE;
+	if (!CountMatch(wctx->mc, pattern) || !AddBytePatternEdit(wctx->list, pattern, wctx->pos + offset)) {
+		wctx->failed = TRUE;
+		return FALSE;
+	}
+	return !IsScanComplete(wctx->mc);
+}
+
+/*
+ * Add the QWORDs, from data[first] to data[count - 1], that match one of the ORIGINAL values
+ * of the set, where data is at offset pos in the file. Returns FALSE on error.
+ */
+static BOOL AddQwordMatches(const PATTERN_SET* set, const uint64_t* data, size_t first, size_t count,
+	uint64_t pos, MATCH_COUNTS* mc, EDIT_LIST* list)
+{
+	uint64_t offset;
+	size_t i;
+	int k;
+
+	for (i = FindMatch(set, data, first, count); i < count; i = FindMatch(set, data, i + 1, count)) {
+		k = LookupPattern(set, data[i]);
+		offset = pos + i * sizeof(uint64_t);
+		// Shifted QWORDs only match the patterns whose alignment allows it
+		if ((offset & (set->align[k] - 1)) != 0)
+			continue;
+		if (!CountMatch(mc, k) || !AddEdit(list, offset, sizeof(uint64_t), TRUE, k, (const uint8_t*)&set->patched[k], NULL))
+			return FALSE;
+		if (IsScanComplete(mc))
+			break;
+	}
+	return TRUE;
+}
+
+/*
+ * Scan a single window of a mapped file, at offset pos, over the part of a range that it
+ * covers. Returns FALSE on error.
+ */
+static BOOL ScanWindow(const uint8_t* data, uint64_t pos, size_t len, const SCAN_RANGE* range,
+	const PATTERN_SET* set, MATCH_COUNTS* mc, EDIT_LIST* list)
+{
+	WINDOW_MATCH_CTX ctx = { list, pos, mc, FALSE };
+	size_t start, end, block, lo, hi, first, count, shift;
+
+	start = (size_t)(max(range->start, pos) - pos);
+	end = (size_t)min(range->end - pos, len);
+	if (set->matcher != NULL)
+		return SearchBytePatterns(set, data, start, end, AddWindowMatch, &ctx) || !ctx.failed;
+	// Only consider the QWORDs that are fully inside the range, and that start in this window
+	for (block = start & ~((size_t)SHIFT_BLOCK_SIZE - 1); block < min(end, WINDOW_SIZE) && !IsScanComplete(mc);
+		block += SHIFT_BLOCK_SIZE) {
+		lo = max(block, start);
+		hi = min(block + SHIFT_BLOCK_SIZE, WINDOW_SIZE);
+		for (shift = 0; shift < sizeof(uint64_t) && !IsScanComplete(mc); shift += set->min_align) {
+			if (hi <= shift || end < shift)
+				continue;
+			first = (lo > shift) ? (lo - shift + sizeof(uint64_t) - 1) / sizeof(uint64_t) : 0;
+			count = min((hi - shift + sizeof(uint64_t) - 1) / sizeof(uint64_t), (end - shift) / sizeof(uint64_t));
+			if (first < count && !AddQwordMatches(set, (const uint64_t*)&data[shift], first, count,
+				pos + shift, mc, list))
+				return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * Scan the provided ranges of a mapped file, for all the QWORDs, or byte patterns, that
+ * match one of the ORIGINAL values from the pattern set, at an offset that has the
+ * alignment of the pattern, and add them to the edit list, in file order. The file is
+ * scanned one window at a time, with each window extending WINDOW_OVERLAP bytes past the
+ * next one, so that a byte pattern that starts in a window is always fully contained in
+ * it. If a pattern has more or fewer matches than expected, the scan fails, so that the
+ * file doesn't get altered. With stop_early, and if all the patterns of the set have a
+ * maximum number of matches, the scan stops as soon as they all reached it, so that any
+ * extra match past that point goes undetected. If out is not NULL, the whole file is
+ * also copied into out, from the same windows, so that it is only read once, including
+ * the parts that are outside of the ranges, or past the point where the scan stopped.
+ * Returns the number of edits, or -1 on error.
+ */
+int ScanAndCopyFile(FILE_WINDOW* w, FILE_WINDOW* out, const SCAN_RANGE* ranges, int nb_ranges,
+	const PATTERN_SET* set, BOOL stop_early, EDIT_LIST* list)
+{
+	MATCH_COUNTS mc;
+	const uint8_t* data;
+	uint8_t* dst;
+	uint64_t pos, first = w->size, last = 0;
+	size_t len;
+	int r, nb_edits = -1;
+	BOOL covered;
+
+	list->set = set;
+	if (!InitMatchCounts(&mc, set, stop_early))
+		return -1;
+	for (r = 0; r < nb_ranges; r++) {
+		first = min(first, ranges[r].start);
+		last = max(last, ranges[r].end);
+	}
+	if (out != NULL) {
+		first = 0;
+		last = w->size;
+	}
+	// Windows start on a WINDOW_SIZE boundary, which keeps QWORDs and byte patterns aligned
+	for (pos = first & ~((uint64_t)WINDOW_SIZE - 1); pos < last; pos += WINDOW_SIZE) {
+		for (r = 0, covered = FALSE; r < nb_ranges && !covered; r++)
+			covered = (ranges[r].start < pos + WINDOW_SIZE && ranges[r].end > pos);
+		covered = covered && !IsScanComplete(&mc);
+		if (!covered && out == NULL) {
+			if (IsScanComplete(&mc))
+				break;
+			continue;
+		}
+		len = (size_t)min(w->size - pos, WINDOW_SIZE + WINDOW_OVERLAP);
+		data = MapFileWindow(w, pos, len);
+		if (data == NULL)
+			goto out;
+		if (out != NULL) {
+			dst = MapFileWindow(out, pos, (size_t)min(w->size - pos, WINDOW_SIZE));
+			if (dst == NULL)
+				goto out;
+			memcpy(dst, data, (size_t)min(w->size - pos, WINDOW_SIZE));
+		}
+		for (r = 0; r < nb_ranges && covered && !IsScanComplete(&mc); r++) {
+			if (ranges[r].start < pos + WINDOW_SIZE && ranges[r].end > pos &&
+				!ScanWindow(data, pos, len, &ranges[r], set, &mc, list))
+				goto out;
+		}
+	}
+	if (!CheckMinCounts(&mc))
+		goto out;
+
+	// Byte patterns and shifted QWORDs can match anywhere, in any order, and overlap each other
+	if (set->matcher != NULL || set->min_align < sizeof(uint64_t))
+		SortEdits(list);
+	nb_edits = list->nb_edits;
+
+out:
+	free(mc.counts);
+	return nb_edits;
+}
+
+int ScanFile(FILE_WINDOW* w, const SCAN_RANGE* ranges, int nb_ranges,
+	const PATTERN_SET* set, BOOL stop_early, EDIT_LIST* list)
+{
+	return ScanAndCopyFile(w, NULL, ranges, nb_ranges, set, stop_early, list);
+}
+
+/*
+ * Add the edits from a pinned manifest block, which has already been checked against the file.
+ */
+int AddPinnedEdits(const PINNED_BLOCK* block, EDIT_LIST* list)
+{
+	int i;
+
+	for (i = 0; i < block->nb_patches; i++) {
+		if (!AddEdit(list, block->patches[i].offset, block->patches[i].pattern.len, block->patches[i].pattern.qword,
+			-1, block->patches[i].pattern.patched, block->patches[i].pattern.patched_mask))
+			return -1;
+	}
+	SortEdits(list);
+	return list->nb_edits;
+}
+
+/*
+ * Add the edits for cached matches, which have already been checked against the file.
+ */
+int AddCachedEdits(const PATTERN_SET* set, const CACHED_MATCH* matches, int nb_matches, EDIT_LIST* list)
+{
+	const BYTE_PATTERN* p;
+	int i;
+
+	list->set = set;
+	for (i = 0; i < nb_matches; i++) {
+		if (set->matcher != NULL) {
+			p = &set->byte_patterns[matches[i].pattern];
+			if (!AddEdit(list, matches[i].offset, p->len, p->qword, matches[i].pattern, p->patched, p->patched_mask))
+				return -1;
+		} else if (!AddEdit(list, matches[i].offset, sizeof(uint64_t), TRUE, matches[i].pattern,
+			(const uint8_t*)&set->patched[matches[i].pattern], NULL)) {
+			return -1;
+		}
+	}
+	SortEdits(list);
+	return list->nb_edits;
+}
+
+/*
+ * Format the data of an edit, as a QWORD value or as colon separated hex bytes,
+ * into str, which must be able to hold 3 * MAX_PATTERN_LENGTH characters.
+ */
+void FormatEditData(char* str, const uint8_t* data, uint32_t len, BOOL qword)
+{
+	uint64_t val;
+	uint32_t i;
+
+	if (qword) {
+		memcpy(&val, data, sizeof(uint64_t));
+		sprintf_s(str, 3 * MAX_PATTERN_LENGTH, "%016llX", val);
+		return;
+	}
+	for (i = 0; i < len; i++)
+		sprintf_s(&str[3 * i], 4, (i + 1 < len) ? "%02X:" : "%02X", data[i]);
+	if (len == 0)
+		str[0] = 0;
+}
+
+void PrintEdit(const uint8_t* old_data, const PATCH_EDIT* edit, const uint8_t* data)
+{
+	char old_str[3 * MAX_PATTERN_LENGTH], new_str[3 * MAX_PATTERN_LENGTH];
+
+	FormatEditData(old_str, old_data, edit->len, edit->qword);
+	FormatEditData(new_str, data, edit->len, edit->qword);
+	lprintf(stdout, "%08llX: %s -> %s\n", edit->offset, old_str, new_str);
+}
+
+void GetPatchedData(const uint8_t* old_data, const PATCH_EDIT* edit, uint8_t* data)
+{
+	uint32_t j;
+
+	for (j = 0; j < edit->len; j++)
+		data[j] = (edit->mask == NULL || edit->mask[j] != 0) ? edit->patched[j] : old_data[j];
+}
+
+/*
+ * Apply all the edits from the list to a mapped file, and set *delta to the change to
+ * the PE checksum that results from these edits. Returns FALSE on error.
+ */
+BOOL ApplyEdits(FILE_WINDOW* w, const EDIT_LIST* list, uint64_t checksum_offset, uint32_t* delta)
+{
+	int i;
+	uint8_t data[MAX_PATTERN_LENGTH], *target;
+	const PATCH_EDIT* edit;
+	LOG_BUFFER log;
+	BOOL buffered, r = FALSE;
+
+	*delta = 0;
+	// Files can have a lot of matches, which we want to print all at once
+	buffered = StartLogBuffering(&log);
+	for (i = 0; i < list->nb_edits; i++) {
+		edit = &list->edits[i];
+		target = MapFileWindow(w, edit->offset, edit->len);
+		if (target == NULL)
+			goto out;
+		GetPatchedData(target, edit, data);
+		PrintEdit(target, edit, data);
+		// The CheckSum field is not part of the sum, so altering it means we need a full recompute
+		if (edit->offset < checksum_offset + sizeof(DWORD) && checksum_offset < edit->offset + edit->len)
+			*delta = CHECKSUM_DELTA_INVALID;
+		*delta = ChecksumDelta(*delta, target, data, edit->offset, edit->len);
+		memcpy(target, data, edit->len);
+	}
+	r = TRUE;
+
+out:
+	EndLogBuffering(&log, buffered);
+	return r;
+}
+
+/*
+ * Patch an image that is fully mapped in memory (a buffer, or a view of a file), for
+ * all the matches from a pattern set. Unless PATCH_FLAG_RAW is set, the image must be
+ * a PE one, whose digital signature is then removed, and whose PE checksum is updated,
+ * with the details of that update stored in update, if not NULL. Since a buffer can't
+ * be shrunk, it is up to the caller to only use the first update->new_size bytes.
+ * Note that, when accessing a view of a file, read errors raise EXCEPTION_IN_PAGE_ERROR,
+ * which the caller needs to handle. Returns the number of elements patched, or -1 on
+ * error.
+ */
+int PatchBuffer(const PATTERN_SET* set, uint8_t* buf, uint64_t size, DWORD flags, PE_UPDATE* update)
+{
+	FILE_WINDOW w;
+	EDIT_LIST list = { 0 };
+	SCAN_RANGE range = { 0, size };
+	PIMAGE_NT_HEADERS32 pImageNTHeader32;
+	PE_UPDATE pe_update;
+	uint64_t checksum_offset = UINT64_MAX;
+	uint32_t delta;
+	int patched;
+
+	if (update == NULL)
+		update = &pe_update;
+	memset(update, 0, sizeof(PE_UPDATE));
+	update->new_size = size;
+	if (set == NULL || buf == NULL || size > SIZE_MAX)
+		return -1;
+	if (size < sizeof(uint64_t))
+		return 0;
+	InitMemoryWindow(&w, buf, size);
+	if (!(flags & PATCH_FLAG_RAW)) {
+		pImageNTHeader32 = (size <= MAXDWORD) ? GetNtHeaders(buf, size) : NULL;
+		if (pImageNTHeader32 == NULL) {
+			lprintf(stderr, "Not a valid PE image\n");
+			return -1;
+		}
+		checksum_offset = (uint8_t*)GetCheckSumField(pImageNTHeader32) - buf;
+	}
+	patched = ScanFile(&w, &range, 1, set, FALSE, &list);
+	if (patched > 0) {
+		if (!ApplyEdits(&w, &list, checksum_offset, &delta) ||
+			(!(flags & PATCH_FLAG_RAW) && !UpdatePEImage(&w, delta, (flags & PATCH_FLAG_VERIFY_CHECKSUM) != 0, update)))
+			patched = -1;
+	}
+	free(list.edits);
+	return patched;
+}
@@ -0,0 +1,479 @@
+/*
+ * winpatch - Windows system file patcher
+ * PE image post-processing
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef _DEBUG
+#define _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <imagehlp.h>
+
+#include "winpatch.h"
+
+#pragma comment(lib, "imagehlp.lib")
+
+// WIN_CERTIFICATE entries are aligned to 8 bytes
+#define CERT_ALIGN(n) (((n) + 7) & ~7ULL)
+
+/*
+ * Validate the DOS and NT headers of a mapped file, and make sure that everything
+ * we need to access in the optional header lies within the file.
+ * Returns a pointer to the NT headers, or NULL if this is not a PE file we can process.
+ */
+PIMAGE_NT_HEADERS32 GetNtHeaders(uint8_t* base, uint64_t size)
+{
+	PIMAGE_DOS_HEADER pImageDOSHeader = (PIMAGE_DOS_HEADER)base;
+	PIMAGE_NT_HEADERS32 pImageNTHeader32;
+	DWORD dwNumberOfRvaAndSizes;
+	uint64_t opt_size;
+
+	// The PE checksum field is only 32-bit, so the file length must be too
+	if (size < sizeof(IMAGE_DOS_HEADER) || size > MAXDWORD)
+		return NULL;
+	if (pImageDOSHeader->e_magic != IMAGE_DOS_SIGNATURE || pImageDOSHeader->e_lfanew < 0)
+		return NULL;
+	if ((uint64_t)pImageDOSHeader->e_lfanew + offsetof(IMAGE_NT_HEADERS32, OptionalHeader) +
+		offsetof(IMAGE_OPTIONAL_HEADER32, CheckSum) + sizeof(DWORD) > size)
+		return NULL;
+	pImageNTHeader32 = (PIMAGE_NT_HEADERS32)&base[pImageDOSHeader->e_lfanew];
+	if (pImageNTHeader32->Signature != IMAGE_NT_SIGNATURE)
+		return NULL;
+
+	// Unlike the Machine field, the optional header magic tells us which NT headers we have
+	switch (pImageNTHeader32->OptionalHeader.Magic) {
+	case IMAGE_NT_OPTIONAL_HDR32_MAGIC:
+		opt_size = offsetof(IMAGE_OPTIONAL_HEADER32, DataDirectory);
+		break;
+	case IMAGE_NT_OPTIONAL_HDR64_MAGIC:
+		opt_size = offsetof(IMAGE_OPTIONAL_HEADER64, DataDirectory);
+		break;
+	default:
+		return NULL;
+	}
+	if ((uint64_t)pImageDOSHeader->e_lfanew + offsetof(IMAGE_NT_HEADERS32, OptionalHeader) + opt_size > size)
+		return NULL;
+	dwNumberOfRvaAndSizes = (pImageNTHeader32->OptionalHeader.Magic == IMAGE_NT_OPTIONAL_HDR32_MAGIC) ?
+		pImageNTHeader32->OptionalHeader.NumberOfRvaAndSizes :
+		((PIMAGE_NT_HEADERS64)pImageNTHeader32)->OptionalHeader.NumberOfRvaAndSizes;
+	if (dwNumberOfRvaAndSizes > IMAGE_DIRECTORY_ENTRY_SECURITY) {
+		opt_size += (IMAGE_DIRECTORY_ENTRY_SECURITY + 1) * sizeof(IMAGE_DATA_DIRECTORY);
+		if (opt_size > pImageNTHeader32->FileHeader.SizeOfOptionalHeader ||
+			(uint64_t)pImageDOSHeader->e_lfanew + offsetof(IMAGE_NT_HEADERS32, OptionalHeader) + opt_size > size)
+			return NULL;
+	}
+	// The section headers follow the optional header
+	if ((uint64_t)pImageDOSHeader->e_lfanew + offsetof(IMAGE_NT_HEADERS32, OptionalHeader) +
+		pImageNTHeader32->FileHeader.SizeOfOptionalHeader +
+		(uint64_t)pImageNTHeader32->FileHeader.NumberOfSections * sizeof(IMAGE_SECTION_HEADER) > size)
+		return NULL;
+
+	return pImageNTHeader32;
+}
+
+/*
+ * Return the Security data directory of validated NT headers, or NULL if there is none.
+ */
+PIMAGE_DATA_DIRECTORY GetSecurityDirectory(PIMAGE_NT_HEADERS32 pImageNTHeader32)
+{
+	PIMAGE_NT_HEADERS64 pImageNTHeader64 = (PIMAGE_NT_HEADERS64)pImageNTHeader32;
+
+	if (pImageNTHeader32->OptionalHeader.Magic == IMAGE_NT_OPTIONAL_HDR32_MAGIC) {
+		if (pImageNTHeader32->OptionalHeader.NumberOfRvaAndSizes <= IMAGE_DIRECTORY_ENTRY_SECURITY)
+			return NULL;
+		return &pImageNTHeader32->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_SECURITY];
+	}
+	if (pImageNTHeader64->OptionalHeader.NumberOfRvaAndSizes <= IMAGE_DIRECTORY_ENTRY_SECURITY)
+		return NULL;
+	return &pImageNTHeader64->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_SECURITY];
+}
+
+/*
+ * Return a pointer to the CheckSum field of validated NT headers.
+ * The field is at the same offset for both PE32 and PE32+.
+ */
+DWORD* GetCheckSumField(PIMAGE_NT_HEADERS32 pImageNTHeader32)
+{
+	return &pImageNTHeader32->OptionalHeader.CheckSum;
+}
+
+static int CompareRanges(const void* a, const void* b)
+{
+	const SCAN_RANGE* ra = (const SCAN_RANGE*)a;
+	const SCAN_RANGE* rb = (const SCAN_RANGE*)b;
+	return (ra->start < rb->start) ? -1 : ((ra->start > rb->start) ? 1 : 0);
+}
+
+/*
+ * Build the list of file ranges that a scan should be restricted to, from the raw data
+ * of the sections whose names are provided. The ranges are sorted and do not overlap.
+ * Returns the number of ranges (which can be 0 if no section matched), or -1 on error.
+ */
+int GetSectionRanges(FILE_WINDOW* w, char* const* names, int nb_names, SCAN_RANGE** ranges)
+{
+	PIMAGE_NT_HEADERS32 pImageNTHeader32;
+	PIMAGE_SECTION_HEADER pSection;
+	uint64_t start, end, size = w->size;
+	int i, j, nb_ranges = 0;
+
+	*ranges = NULL;
+	pImageNTHeader32 = (size <= MAXDWORD) ? GetNtHeaders(w->head, w->head_len) : NULL;
+	if (pImageNTHeader32 == NULL)
+		return -1;
+	// GetNtHeaders() checked that the section headers lie within the file
+	pSection = (PIMAGE_SECTION_HEADER)((uint8_t*)&pImageNTHeader32->OptionalHeader +
+		pImageNTHeader32->FileHeader.SizeOfOptionalHeader);
+	if (pImageNTHeader32->FileHeader.NumberOfSections == 0)
+		return 0;
+	*ranges = calloc(pImageNTHeader32->FileHeader.NumberOfSections, sizeof(SCAN_RANGE));
+	if (*ranges == NULL)
+		return -1;
+
+	for (i = 0; i < pImageNTHeader32->FileHeader.NumberOfSections; i++) {
+		// Section names that are exactly 8 characters long are not NUL terminated
+		for (j = 0; j < nb_names; j++) {
+			if (strlen(names[j]) <= IMAGE_SIZEOF_SHORT_NAME &&
+				strncmp((char*)pSection[i].Name, names[j], IMAGE_SIZEOF_SHORT_NAME) == 0)
+				break;
+		}
+		if (j >= nb_names || pSection[i].PointerToRawData == 0)
+			continue;
+		start = pSection[i].PointerToRawData;
+		end = start + pSection[i].SizeOfRawData;
+		if (start >= size)
+			continue;
+		if (end > size)
+			end = size;
+		(*ranges)[nb_ranges].start = start;
+		(*ranges)[nb_ranges].end = end;
+		nb_ranges++;
+	}
+
+	// Merge overlapping ranges, so that we can't report the same match twice
+	qsort(*ranges, nb_ranges, sizeof(SCAN_RANGE), CompareRanges);
+	for (i = 1, j = 0; i < nb_ranges; i++) {
+		if ((*ranges)[i].start <= (*ranges)[j].end) {
+			if ((*ranges)[i].end > (*ranges)[j].end)
+				(*ranges)[j].end = (*ranges)[i].end;
+		} else {
+			(*ranges)[++j] = (*ranges)[i];
+		}
+	}
+	return (nb_ranges == 0) ? 0 : j + 1;
+}
+
+/*
+ * Copy the name of the section whose raw data holds the provided file offset into name,
+ * which must be able to hold IMAGE_SIZEOF_SHORT_NAME + 1 characters. Returns FALSE, with
+ * an empty name, if the offset doesn't belong to any section (or the file isn't a PE).
+ */
+BOOL GetSectionName(PIMAGE_NT_HEADERS32 pImageNTHeader32, uint64_t offset, char* name)
+{
+	PIMAGE_SECTION_HEADER pSection;
+	int i;
+
+	name[0] = 0;
+	if (pImageNTHeader32 == NULL)
+		return FALSE;
+	pSection = (PIMAGE_SECTION_HEADER)((uint8_t*)&pImageNTHeader32->OptionalHeader +
+		pImageNTHeader32->FileHeader.SizeOfOptionalHeader);
+	for (i = 0; i < pImageNTHeader32->FileHeader.NumberOfSections; i++) {
+		if (pSection[i].PointerToRawData != 0 && offset >= pSection[i].PointerToRawData &&
+			offset < (uint64_t)pSection[i].PointerToRawData + pSection[i].SizeOfRawData) {
+			// Section names that are exactly 8 characters long are not NUL terminated
+			memcpy(name, pSection[i].Name, IMAGE_SIZEOF_SHORT_NAME);
+			name[IMAGE_SIZEOF_SHORT_NAME] = 0;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/*
+ * Return the contribution, modulo 0xFFFF, of len bytes located at the provided file
+ * offset, to the 16-bit ones' complement sum that the PE checksum is derived from.
+ */
+uint32_t ChecksumBytes(const uint8_t* data, uint64_t offset, size_t len)
+{
+	uint64_t sum = 0;
+	size_t i = 0;
+
+	// Bytes at odd offsets are the high part of a little endian WORD
+	if (len > 0 && (offset & 1)) {
+		sum += (uint64_t)data[0] << 8;
+		i = 1;
+	}
+	for (; i + 1 < len; i += 2)
+		sum += data[i] | ((uint32_t)data[i + 1] << 8);
+	if (i < len)
+		sum += data[i];
+	return (uint32_t)(sum % 0xFFFF);
+}
+
+/*
+ * Account for the replacement of old_data with new_data in a running checksum delta.
+ */
+uint32_t ChecksumDelta(uint32_t delta, const uint8_t* old_data, const uint8_t* new_data, uint64_t offset, size_t len)
+{
+	if (delta == CHECKSUM_DELTA_INVALID)
+		return delta;
+	return (delta + 0xFFFF - ChecksumBytes(old_data, offset, len) + ChecksumBytes(new_data, offset, len)) % 0xFFFF;
+}
+
+/*
+ * Subtract a WORD from a 16-bit partial sum, in the exact same manner as CheckSumMappedFile().
+ */
+static __inline uint32_t ChecksumSubtract(uint32_t sum, uint32_t val)
+{
+	return (sum >= val) ? sum - val : ((sum - val) & 0xFFFF) - 1;
+}
+
+/*
+ * Compute the final PE checksum, from the sum of all the WORDs of the file but the
+ * CheckSum field (modulo 0xFFFF), the current value of that field, and the file length.
+ * This produces the same value as CheckSumMappedFile() does.
+ */
+DWORD ChecksumFinalize(uint32_t sum, DWORD dwField, uint64_t length)
+{
+	// The ones' complement sum of a non-empty PE file is never 0, so 0xFFFF means 0 modulo 0xFFFF
+	sum = (sum + (dwField & 0xFFFF) + (dwField >> 16)) % 0xFFFF;
+	if (sum == 0)
+		sum = 0xFFFF;
+	sum = ChecksumSubtract(sum, dwField & 0xFFFF);
+	sum = ChecksumSubtract(sum, dwField >> 16);
+	return sum + (DWORD)length;
+}
+
+/*
+ * Add the contribution of a file range to a running checksum sum, going through
+ * as many windows as needed.
+ */
+static BOOL ChecksumRange(FILE_WINDOW* w, uint64_t start, uint64_t end, uint32_t* sum)
+{
+	uint8_t* data;
+	size_t len;
+
+	for (; start < end; start += len) {
+		len = (size_t)min(end - start, WINDOW_SIZE);
+		data = MapFileWindow(w, start, len);
+		if (data == NULL)
+			return FALSE;
+		*sum = (*sum + ChecksumBytes(data, start, len)) % 0xFFFF;
+	}
+	return TRUE;
+}
+
+static BOOL WipeRange(FILE_WINDOW* w, uint64_t start, uint64_t end)
+{
+	uint8_t* data;
+	size_t len;
+
+	for (; start < end; start += len) {
+		len = (size_t)min(end - start, WINDOW_SIZE);
+		data = MapFileWindow(w, start, len);
+		if (data == NULL)
+			return FALSE;
+		memset(data, 0, len);
+	}
+	return TRUE;
+}
+
+/*
+ * Perform all the post-patching of a PE image in a single pass over the mapped file:
+ * - Remove the certificate table and clear the Security data directory.
+ * - Compute the new PE checksum and write it into the optional header.
+ * Unless verify is set, or the current checksum can't be trusted, the new checksum is
+ * derived from the current one, using delta, the checksum change that results from all
+ * the edits that were applied (see ChecksumDelta()), instead of summing the whole file.
+ * Since the file can't be shrunk while it is mapped, the size it must be truncated
+ * to, once unmapped, is returned in update->new_size.
+ */
+BOOL UpdatePEImage(FILE_WINDOW* w, uint32_t delta, BOOL verify, PE_UPDATE* update)
+{
+	const uint8_t zero[sizeof(IMAGE_DATA_DIRECTORY)] = { 0 };
+	PIMAGE_NT_HEADERS32 pImageNTHeader32;
+	PIMAGE_DATA_DIRECTORY pSecurityDir;
+	LPWIN_CERTIFICATE pCert;
+	DWORD dwHeaderSum, dwCheckSum, dwPartialSum, *pdwCheckSum;
+	uint64_t pos, end, size = w->size;
+	uint32_t sum = 0;
+
+	memset(update, 0, sizeof(PE_UPDATE));
+	update->new_size = size;
+
+	// The headers are always in the first view, which remains mapped
+	pImageNTHeader32 = (size <= MAXDWORD) ? GetNtHeaders(w->head, w->head_len) : NULL;
+	if (pImageNTHeader32 == NULL) {
+		lprintf(stderr, "Not a valid PE image\n");
+		return FALSE;
+	}
+	pdwCheckSum = GetCheckSumField(pImageNTHeader32);
+	update->old_checksum = *pdwCheckSum;
+
+	// A zero checksum means none was computed, and one that's smaller than the file
+	// length, or too large to come from a 16-bit sum, could not have been valid
+	dwPartialSum = update->old_checksum - (DWORD)size;
+	if (update->old_checksum == 0 || update->old_checksum < size || dwPartialSum > 0xFFFF)
+		delta = CHECKSUM_DELTA_INVALID;
+
+	// Note that, unlike other data directories, the Security one uses a file offset
+	pSecurityDir = GetSecurityDirectory(pImageNTHeader32);
+	if (pSecurityDir != NULL && pSecurityDir->VirtualAddress != 0 && pSecurityDir->Size != 0) {
+		pos = pSecurityDir->VirtualAddress;
+		end = pos + pSecurityDir->Size;
+		if (end > size) {
+			lprintf(stderr, "Certificate table lies outside the file\n");
+			return FALSE;
+		}
+		while (pos + offsetof(WIN_CERTIFICATE, bCertificate) <= end) {
+			pCert = (LPWIN_CERTIFICATE)MapFileWindow(w, pos, offsetof(WIN_CERTIFICATE, bCertificate));
+			if (pCert == NULL)
+				return FALSE;
+			if (pCert->dwLength < offsetof(WIN_CERTIFICATE, bCertificate) || pos + pCert->dwLength > end) {
+				lprintf(stderr, "Invalid certificate table entry\n");
+				return FALSE;
+			}
+			update->nb_certs++;
+			pos += CERT_ALIGN(pCert->dwLength);
+		}
+		pos = pSecurityDir->VirtualAddress;
+		if (CERT_ALIGN(end) >= size) {
+			// The table is at the end of the file (which it should always be) => drop it
+			if (delta != CHECKSUM_DELTA_INVALID) {
+				if (!ChecksumRange(w, pos, size, &sum))
+					return FALSE;
+				delta = (delta + 0xFFFF - sum) % 0xFFFF;
+			}
+			update->new_size = pos;
+		} else {
+			// Can't truncate, so just wipe it
+			lprintf(stdout, "Certificate table is not at the end of the file\n");
+			if (delta != CHECKSUM_DELTA_INVALID) {
+				if (!ChecksumRange(w, pos, end, &sum))
+					return FALSE;
+				delta = (delta + 0xFFFF - sum) % 0xFFFF;
+			}
+			if (!WipeRange(w, pos, end))
+				return FALSE;
+		}
+		delta = ChecksumDelta(delta, (uint8_t*)pSecurityDir, zero, (uint8_t*)pSecurityDir - w->head, sizeof(zero));
+		pSecurityDir->VirtualAddress = 0;
+		pSecurityDir->Size = 0;
+	}
+
+	if (delta != CHECKSUM_DELTA_INVALID) {
+		dwCheckSum = ChecksumFinalize((dwPartialSum + delta) % 0xFFFF, update->old_checksum, update->new_size);
+		update->incremental = TRUE;
+	}
+	if (verify || !update->incremental) {
+		if (update->new_size <= w->head_len) {
+			// CheckSumMappedFile() disregards the current value of the CheckSum field
+			if (CheckSumMappedFile(w->head, (DWORD)update->new_size, &dwHeaderSum, &dwPartialSum) == NULL) {
+				lprintf(stderr, "Could not compute checksum: Error %u\n", GetLastError());
+				return FALSE;
+			}
+		} else {
+			// Too large for a single view, so sum the file window by window, and then
+			// take out the CheckSum field, which is not part of the PE checksum
+			sum = 0;
+			if (!ChecksumRange(w, 0, update->new_size, &sum))
+				return FALSE;
+			sum = (sum + 0xFFFF - ChecksumBytes((uint8_t*)pdwCheckSum, (uint8_t*)pdwCheckSum - w->head, sizeof(DWORD))) % 0xFFFF;
+			dwPartialSum = ChecksumFinalize(sum, *pdwCheckSum, update->new_size);
+		}
+		if (update->incremental && dwPartialSum != dwCheckSum) {
+			lprintf(stderr, "Incremental checksum %08X does not match computed checksum %08X - "
+				"original checksum must have been invalid\n", dwCheckSum, dwPartialSum);
+			update->incremental = FALSE;
+		}
+		dwCheckSum = dwPartialSum;
+	}
+	*pdwCheckSum = dwCheckSum;
+	update->new_checksum = dwCheckSum;
+
+	return TRUE;
+}
+
+/*
+ * Recompute the PE checksum of an image that is fully mapped in memory, without altering
+ * anything else, and write it into the optional header. The new checksum is also stored
+ * in checksum, if not NULL.
+ */
+BOOL UpdatePEChecksum(uint8_t* buf, uint64_t size, DWORD* checksum)
+{
+	PIMAGE_NT_HEADERS32 pImageNTHeader32;
+	DWORD dwHeaderSum, dwCheckSum;
+
+	pImageNTHeader32 = (size <= MAXDWORD) ? GetNtHeaders(buf, size) : NULL;
+	if (pImageNTHeader32 == NULL) {
+		lprintf(stderr, "Not a valid PE image\n");
+		return FALSE;
+	}
+	// CheckSumMappedFile() disregards the current value of the CheckSum field
+	if (CheckSumMappedFile(buf, (DWORD)size, &dwHeaderSum, &dwCheckSum) == NULL) {
+		lprintf(stderr, "Could not compute checksum: Error %u\n", GetLastError());
+		return FALSE;
+	}
+	*GetCheckSumField(pImageNTHeader32) = dwCheckSum;
+	if (checksum != NULL)
+		*checksum = dwCheckSum;
+	return TRUE;
+}
+
+/*
+ * Get the ranges of a PE image that UpdatePEImage(), and the signing that follows, can
+ * alter: the CheckSum field, the Security data directory and the certificate table.
+ * ranges must have room for 3 entries. Returns the number of ranges, or -1 on error.
+ */
+int GetPEUpdateRanges(FILE_WINDOW* w, SCAN_RANGE* ranges)
+{
+	PIMAGE_NT_HEADERS32 pImageNTHeader32;
+	PIMAGE_DATA_DIRECTORY pSecurityDir;
+	uint8_t* base = w->head;
+	uint64_t end, size = w->size;
+	int nb_ranges = 0;
+
+	pImageNTHeader32 = (size <= MAXDWORD) ? GetNtHeaders(w->head, w->head_len) : NULL;
+	if (pImageNTHeader32 == NULL)
+		return -1;
+	ranges[nb_ranges].start = (uint8_t*)GetCheckSumField(pImageNTHeader32) - base;
+	ranges[nb_ranges].end = ranges[nb_ranges].start + sizeof(DWORD);
+	nb_ranges++;
+	pSecurityDir = GetSecurityDirectory(pImageNTHeader32);
+	if (pSecurityDir == NULL)
+		return nb_ranges;
+	ranges[nb_ranges].start = (uint8_t*)pSecurityDir - base;
+	ranges[nb_ranges].end = ranges[nb_ranges].start + sizeof(IMAGE_DATA_DIRECTORY);
+	nb_ranges++;
+	if (pSecurityDir->VirtualAddress != 0 && pSecurityDir->Size != 0 && pSecurityDir->VirtualAddress < size) {
+		// A table at the end of the file gets dropped along with its padding
+		end = (uint64_t)pSecurityDir->VirtualAddress + pSecurityDir->Size;
+		ranges[nb_ranges].start = pSecurityDir->VirtualAddress;
+		ranges[nb_ranges].end = (CERT_ALIGN(end) >= size) ? size : end;
+		nb_ranges++;
+	}
+	return nb_ranges;
+}
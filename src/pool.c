@@ -0,0 +1,142 @@
+/*
+ * winpatch - Windows system file patcher
+ * Worker pool
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef _DEBUG
+#define _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "winpatch.h"
+
+typedef struct {
+	volatile LONG next;
+	int nb_jobs;
+	JOB_FUNC func;
+	void* ctx;
+	int* results;
+	BOOL* done;
+	LOG_BUFFER* logs;
+	CRITICAL_SECTION lock;
+	CONDITION_VARIABLE completed;
+} WORKER_POOL;
+
+static DWORD WINAPI WorkerThread(LPVOID param)
+{
+	WORKER_POOL* pool = (WORKER_POOL*)param;
+	int index;
+
+	while ((index = InterlockedIncrement(&pool->next) - 1) < pool->nb_jobs) {
+		SetThreadLog(&pool->logs[index]);
+		pool->results[index] = pool->func(pool->ctx, index);
+		SetThreadLog(NULL);
+		EnterCriticalSection(&pool->lock);
+		pool->done[index] = TRUE;
+		WakeAllConditionVariable(&pool->completed);
+		LeaveCriticalSection(&pool->lock);
+	}
+	return 0;
+}
+
+/*
+ * Return the number of worker threads to use by default.
+ */
+int GetDefaultNumberOfThreads(void)
+{
+	DWORD n = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+	return (n == 0) ? 1 : (int)n;
+}
+
+/*
+ * Run func(ctx, index) for each index in [0, nb_jobs), on at most nb_threads threads,
+ * and store the value returned by each job in results[index]. The output that each
+ * job produces through lprintf() is buffered, and printed in the order of the jobs,
+ * as soon as all the jobs that precede it have completed.
+ */
+BOOL RunJobs(int nb_jobs, int nb_threads, JOB_FUNC func, void* ctx, int* results)
+{
+	BOOL r = FALSE;
+	int i, nb_started = 0;
+	HANDLE* threads = NULL;
+	WORKER_POOL pool = { 0 };
+
+	if (nb_threads > nb_jobs)
+		nb_threads = nb_jobs;
+	// No need for buffering or for extra threads when running a single worker
+	if (nb_threads <= 1) {
+		for (i = 0; i < nb_jobs; i++)
+			results[i] = func(ctx, i);
+		return TRUE;
+	}
+
+	pool.nb_jobs = nb_jobs;
+	pool.func = func;
+	pool.ctx = ctx;
+	pool.results = results;
+	pool.done = calloc(nb_jobs, sizeof(BOOL));
+	pool.logs = calloc(nb_jobs, sizeof(LOG_BUFFER));
+	threads = calloc(nb_threads, sizeof(HANDLE));
+	if (pool.done == NULL || pool.logs == NULL || threads == NULL) {
+		lprintf(stderr, "Could not allocate worker pool\n");
+		goto out;
+	}
+	InitializeCriticalSection(&pool.lock);
+	InitializeConditionVariable(&pool.completed);
+
+	for (nb_started = 0; nb_started < nb_threads; nb_started++) {
+		threads[nb_started] = CreateThread(NULL, 0, WorkerThread, &pool, 0, NULL);
+		if (threads[nb_started] == NULL) {
+			lprintf(stderr, "Could not start worker thread: Error %u\n", GetLastError());
+			break;
+		}
+	}
+	// Jobs are picked from a shared counter, so we're fine as long as one thread started
+	if (nb_started == 0) {
+		DeleteCriticalSection(&pool.lock);
+		goto out;
+	}
+
+	for (i = 0; i < nb_jobs; i++) {
+		EnterCriticalSection(&pool.lock);
+		while (!pool.done[i])
+			SleepConditionVariableCS(&pool.completed, &pool.lock, INFINITE);
+		LeaveCriticalSection(&pool.lock);
+		FlushLog(&pool.logs[i]);
+	}
+
+	for (i = 0; i < nb_started; i++) {
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+	}
+	DeleteCriticalSection(&pool.lock);
+	r = TRUE;
+
+out:
+	free(threads);
+	free(pool.done);
+	free(pool.logs);
+	return r;
+}
@@ -0,0 +1,287 @@
+/*
+ * winpatch - Windows system file patcher
+ * Asynchronous read-ahead
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef _DEBUG
+#define _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "msapi_utf8.h"
+#include "winpatch.h"
+
+/*
+ * While the jobs process the current files, the files that come next in the batch
+ * are read, through overlapped I/O on a completion port, so that the device queue
+ * remains full, and the data is in the system cache by the time a job maps it.
+ * The reads are buffered since the jobs access the files through mappings, which
+ * would not benefit from reads that bypass the cache (FILE_FLAG_NO_BUFFERING).
+ */
+#define READ_AHEAD_CHUNK_SIZE (1024 * 1024)
+#define READ_AHEAD_QUEUE_DEPTH 8
+// Don't evict the files that are being processed for the sake of a very large one
+#define READ_AHEAD_MAX_SIZE (256ULL * 1024 * 1024)
+
+// Completion keys of the packets that aren't I/O completions
+#define READ_AHEAD_WAKEUP 1
+#define READ_AHEAD_STOP 2
+
+typedef struct {
+	HANDLE hFile;
+	int index;
+	uint64_t size;
+	uint64_t offset;
+	int refs;
+} READ_AHEAD_FILE;
+
+typedef struct {
+	OVERLAPPED ov;			// Must be first
+	READ_AHEAD_FILE* file;
+	uint8_t* buf;
+} READ_AHEAD_REQUEST;
+
+struct _READ_AHEAD {
+	char* const* paths;
+	int nb_files;
+	int depth;
+	volatile LONG current;
+	HANDLE hPort;
+	HANDLE hThread;
+	READ_AHEAD_REQUEST requests[READ_AHEAD_QUEUE_DEPTH];
+};
+
+static READ_AHEAD_FILE* OpenReadAheadFile(READ_AHEAD* ra, int index)
+{
+	READ_AHEAD_FILE* file;
+	LARGE_INTEGER liSize;
+	HANDLE hFile;
+
+	// The jobs must still be able to modify, back up or replace the file
+	hFile = CreateFileU(ra->paths[index], GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, 0);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return NULL;
+	file = calloc(1, sizeof(READ_AHEAD_FILE));
+	if (file == NULL || !GetFileSizeEx(hFile, &liSize) ||
+		CreateIoCompletionPort(hFile, ra->hPort, 0, 0) == NULL) {
+		free(file);
+		CloseHandle(hFile);
+		return NULL;
+	}
+	file->hFile = hFile;
+	file->index = index;
+	file->size = min((uint64_t)liSize.QuadPart, READ_AHEAD_MAX_SIZE);
+	file->refs = 1;
+	return file;
+}
+
+static void ReleaseReadAheadFile(READ_AHEAD_FILE* file)
+{
+	if (--file->refs > 0)
+		return;
+	CloseHandle(file->hFile);
+	free(file);
+}
+
+/*
+ * Issue a read for the next chunk of a file. Returns FALSE if no completion is
+ * to be expected for it.
+ */
+static BOOL IssueRead(READ_AHEAD_FILE* file, READ_AHEAD_REQUEST* req)
+{
+	memset(&req->ov, 0, sizeof(OVERLAPPED));
+	req->ov.Offset = (DWORD)file->offset;
+	req->ov.OffsetHigh = (DWORD)(file->offset >> 32);
+	// A read that succeeds right away still queues a completion packet
+	if (!ReadFile(file->hFile, req->buf, READ_AHEAD_CHUNK_SIZE, NULL, &req->ov) &&
+		GetLastError() != ERROR_IO_PENDING)
+		return FALSE;
+	file->offset += READ_AHEAD_CHUNK_SIZE;
+	file->refs++;
+	req->file = file;
+	return TRUE;
+}
+
+/*
+ * Cancel the reads that are in flight for the files up to index. The handle of each
+ * file is closed once all of its reads have completed.
+ */
+static void CancelReads(READ_AHEAD* ra, int index)
+{
+	int i;
+
+	for (i = 0; i < READ_AHEAD_QUEUE_DEPTH; i++) {
+		if (ra->requests[i].file != NULL && ra->requests[i].file->index <= index)
+			CancelIoEx(ra->requests[i].file->hFile, &ra->requests[i].ov);
+	}
+}
+
+static DWORD WINAPI ReadAheadThread(LPVOID param)
+{
+	READ_AHEAD* ra = (READ_AHEAD*)param;
+	READ_AHEAD_FILE* file = NULL;
+	READ_AHEAD_REQUEST* req;
+	OVERLAPPED* ov;
+	ULONG_PTR key;
+	DWORD size;
+	int i, current, next = 0, nb_pending = 0;
+	BOOL stop = FALSE;
+
+	while (TRUE) {
+		// Keep as many reads in flight as we can, for the files that are within range
+		while (!stop) {
+			current = ra->current;
+			if (file == NULL) {
+				// Files that have already been picked up by a job are skipped
+				next = max(next, current + 1);
+				if (next >= ra->nb_files || next > current + ra->depth)
+					break;
+				file = OpenReadAheadFile(ra, next++);
+				continue;
+			}
+			// Once a job has picked the file up, our reads only compete with the job's
+			if (file->offset >= file->size || file->index <= current) {
+				ReleaseReadAheadFile(file);
+				file = NULL;
+				continue;
+			}
+			for (req = NULL, i = 0; i < READ_AHEAD_QUEUE_DEPTH && req == NULL; i++) {
+				if (ra->requests[i].file == NULL)
+					req = &ra->requests[i];
+			}
+			if (req == NULL)
+				break;
+			if (IssueRead(file, req)) {
+				nb_pending++;
+			} else {
+				ReleaseReadAheadFile(file);
+				file = NULL;
+			}
+		}
+		if (stop && nb_pending == 0)
+			break;
+
+		// Failed I/O still dequeues a packet, with ov set
+		if (!GetQueuedCompletionStatus(ra->hPort, &size, &key, &ov, INFINITE) && ov == NULL)
+			break;
+		if (ov == NULL) {
+			if (key == READ_AHEAD_STOP && !stop) {
+				stop = TRUE;
+				CancelReads(ra, ra->nb_files);
+			} else if (key == READ_AHEAD_WAKEUP) {
+				CancelReads(ra, ra->current);
+			}
+			continue;
+		}
+		req = (READ_AHEAD_REQUEST*)ov;
+		ReleaseReadAheadFile(req->file);
+		req->file = NULL;
+		nb_pending--;
+	}
+
+	if (file != NULL)
+		ReleaseReadAheadFile(file);
+	return 0;
+}
+
+/*
+ * Start reading ahead of the jobs, from a list of nb_files paths, which must remain
+ * valid until StopReadAhead(). Since the first depth files are picked up by the jobs
+ * straight away, reading starts with the next ones, and then remains at most depth
+ * files ahead of the last job that was started. Returns NULL on error.
+ */
+READ_AHEAD* StartReadAhead(char* const* paths, int nb_files, int depth)
+{
+	READ_AHEAD* ra;
+	int i;
+
+	ra = calloc(1, sizeof(READ_AHEAD));
+	if (ra == NULL)
+		return NULL;
+	ra->paths = paths;
+	ra->nb_files = nb_files;
+	ra->depth = max(depth, 1);
+	ra->current = ra->depth - 1;
+	for (i = 0; i < READ_AHEAD_QUEUE_DEPTH; i++) {
+		ra->requests[i].buf = VirtualAlloc(NULL, READ_AHEAD_CHUNK_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		if (ra->requests[i].buf == NULL)
+			goto error;
+	}
+	ra->hPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+	if (ra->hPort == NULL)
+		goto error;
+	ra->hThread = CreateThread(NULL, 0, ReadAheadThread, ra, 0, NULL);
+	if (ra->hThread == NULL)
+		goto error;
+	return ra;
+
+error:
+	lprintf(stderr, "Could not start read-ahead: Error %u\n", GetLastError());
+	if (ra->hPort != NULL)
+		CloseHandle(ra->hPort);
+	for (i = 0; i < READ_AHEAD_QUEUE_DEPTH; i++) {
+		if (ra->requests[i].buf != NULL)
+			VirtualFree(ra->requests[i].buf, 0, MEM_RELEASE);
+	}
+	free(ra);
+	return NULL;
+}
+
+/*
+ * Let the read-ahead know that a job has started processing the file at index.
+ */
+void AdvanceReadAhead(READ_AHEAD* ra, int index)
+{
+	LONG current;
+
+	if (ra == NULL)
+		return;
+	// Jobs may start out of order, when running in parallel
+	do {
+		current = ra->current;
+		if (index <= current)
+			return;
+	} while (InterlockedCompareExchange(&ra->current, index, current) != current);
+	PostQueuedCompletionStatus(ra->hPort, 0, READ_AHEAD_WAKEUP, NULL);
+}
+
+/*
+ * Cancel the reads that are still in flight and release all the resources.
+ */
+void StopReadAhead(READ_AHEAD* ra)
+{
+	int i;
+
+	if (ra == NULL)
+		return;
+	PostQueuedCompletionStatus(ra->hPort, 0, READ_AHEAD_STOP, NULL);
+	WaitForSingleObject(ra->hThread, INFINITE);
+	CloseHandle(ra->hThread);
+	CloseHandle(ra->hPort);
+	for (i = 0; i < READ_AHEAD_QUEUE_DEPTH; i++)
+		VirtualFree(ra->requests[i].buf, 0, MEM_RELEASE);
+	free(ra);
+}
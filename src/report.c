@@ -0,0 +1,142 @@
+/*
+ * winpatch - Windows system file patcher
+ * Match reporting
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef _DEBUG
+#define _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "msapi_utf8.h"
+#include "winpatch.h"
+
+/*
+ * Record the original and patched data, as well as the section, of all the edits from
+ * the list, before they are applied. This must be called only once for each report.
+ */
+BOOL AddReportEntries(MATCH_REPORT* report, FILE_WINDOW* w, PIMAGE_NT_HEADERS32 pImageNTHeader32,
+	const EDIT_LIST* list)
+{
+	const PATCH_EDIT* edit;
+	MATCH_ENTRY* entry;
+	const uint8_t* old_data;
+	size_t size = 0, pos = 0;
+	int i;
+
+	if (list->nb_edits == 0)
+		return TRUE;
+	// The data of all the entries goes into a single allocation
+	for (i = 0; i < list->nb_edits; i++)
+		size += 2 * (size_t)list->edits[i].len;
+	report->entries = calloc(list->nb_edits, sizeof(MATCH_ENTRY));
+	report->data = malloc(size);
+	if (report->entries == NULL || report->data == NULL)
+		return FALSE;
+
+	for (i = 0; i < list->nb_edits; i++) {
+		edit = &list->edits[i];
+		old_data = MapFileWindow(w, edit->offset, edit->len);
+		if (old_data == NULL)
+			return FALSE;
+		entry = &report->entries[report->nb_entries++];
+		entry->offset = edit->offset;
+		entry->len = edit->len;
+		entry->qword = edit->qword;
+		entry->data = &report->data[pos];
+		memcpy(entry->data, old_data, edit->len);
+		GetPatchedData(old_data, edit, &entry->data[edit->len]);
+		GetSectionName(pImageNTHeader32, edit->offset, entry->section);
+		pos += 2 * (size_t)edit->len;
+	}
+	return TRUE;
+}
+
+void FreeMatchReports(MATCH_REPORT* reports, int nb_reports)
+{
+	int i;
+
+	if (reports == NULL)
+		return;
+	for (i = 0; i < nb_reports; i++) {
+		free(reports[i].entries);
+		free(reports[i].data);
+	}
+	free(reports);
+}
+
+/*
+ * Write the matches of each file, along with the result for that file, as JSON.
+ * Offsets are in bytes from the start of the file, and the data is formatted the
+ * same way as on the console. Use "-" for stdout. Returns FALSE if the report could
+ * not be fully written.
+ */
+BOOL WriteMatchReport(const char* path, const FILE_STATS* stats, const MATCH_REPORT* reports, int nb_files)
+{
+	FILE* fd;
+	const MATCH_ENTRY* entry;
+	char old_str[3 * MAX_PATTERN_LENGTH], new_str[3 * MAX_PATTERN_LENGTH];
+	int i, j, nb_failed = 0, nb_matches = 0;
+	BOOL r;
+
+	fd = (strcmp(path, "-") == 0) ? stdout : fopenU(path, "w");
+	if (fd == NULL) {
+		lprintf(stderr, "Could not create report '%s'\n", path);
+		return FALSE;
+	}
+
+	fprintf(fd, "{\n  \"files\": [\n");
+	for (i = 0; i < nb_files; i++) {
+		if (stats[i].result < 0)
+			nb_failed++;
+		nb_matches += reports[i].nb_entries;
+		fprintf(fd, "    { \"path\": ");
+		WriteJsonString(fd, stats[i].path);
+		fprintf(fd, ", \"result\": %d, \"matches\": [", stats[i].result);
+		for (j = 0; j < reports[i].nb_entries; j++) {
+			entry = &reports[i].entries[j];
+			FormatEditData(old_str, entry->data, entry->len, entry->qword);
+			FormatEditData(new_str, &entry->data[entry->len], entry->len, entry->qword);
+			fprintf(fd, "%s\n      { \"offset\": %llu, \"original\": \"%s\", \"patched\": \"%s\", \"section\": ",
+				(j == 0) ? "" : ",", entry->offset, old_str, new_str);
+			if (entry->section[0] == 0)
+				fprintf(fd, "null");
+			else
+				WriteJsonString(fd, entry->section);
+			fprintf(fd, " }");
+		}
+		fprintf(fd, "%s]%s\n", (reports[i].nb_entries == 0) ? "" : "\n    ", (i + 1 < nb_files) ? " }," : " }");
+	}
+	fprintf(fd, "  ],\n  \"totals\": { \"files\": %d, \"failed\": %d, \"matches\": %d }\n}\n",
+		nb_files, nb_failed, nb_matches);
+
+	r = (fflush(fd) == 0 && !ferror(fd));
+	if (fd != stdout && fclose(fd) != 0)
+		r = FALSE;
+	if (!r)
+		lprintf(stderr, "Could not write report '%s'\n", path);
+	return r;
+}
@@ -0,0 +1,234 @@
+/*
+ * winpatch - Windows system file patcher
+ * Byte pattern search
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef _DEBUG
+#define _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "winpatch.h"
+
+/*
+ * Byte patterns are searched through their anchor, i.e. their longest run of non
+ * wildcard bytes, and each anchor hit is then checked against the whole pattern.
+ * With a single pattern, the anchor is searched with Boyer-Moore-Horspool, which
+ * skips over most of the data. With multiple patterns, all the anchors are fed to
+ * an Aho-Corasick automaton, compiled into a DFA, so that the data is processed in
+ * a single pass, with one table lookup per byte, regardless of the number of patterns.
+ * The alignment of each pattern is only checked on anchor hits, so patterns that use
+ * different alignments share that same pass, and the loads it performs.
+ */
+struct _BYTE_MATCHER {
+	BOOL horspool;
+	uint32_t shift[256];		// Horspool skip table
+	uint32_t nb_states;
+	int32_t* next;				// DFA transitions (nb_states * 256)
+	int32_t* output;			// First pattern whose anchor ends at this state, or -1
+	int32_t* dict;				// Nearest state, through failure links, that has an output, or -1
+	int32_t* out_next;			// Next pattern with the same anchor, or -1
+};
+
+static BYTE_MATCHER* CreateHorspoolMatcher(const BYTE_PATTERN* pattern)
+{
+	BYTE_MATCHER* matcher = calloc(1, sizeof(BYTE_MATCHER));
+	const uint8_t* anchor = &pattern->original[pattern->anchor];
+	uint32_t i;
+
+	if (matcher == NULL)
+		return NULL;
+	matcher->horspool = TRUE;
+	for (i = 0; i < 256; i++)
+		matcher->shift[i] = pattern->anchor_len;
+	for (i = 0; i + 1 < pattern->anchor_len; i++)
+		matcher->shift[anchor[i]] = pattern->anchor_len - 1 - i;
+	return matcher;
+}
+
+static BYTE_MATCHER* CreateAhoCorasickMatcher(const BYTE_PATTERN* patterns, size_t nb_patterns)
+{
+	BYTE_MATCHER* matcher = calloc(1, sizeof(BYTE_MATCHER));
+	int32_t *fail = NULL, *queue = NULL, s, t, u;
+	uint32_t i, j, c, max_states = 1, head = 0, tail = 0;
+
+	if (matcher == NULL)
+		return NULL;
+	for (i = 0; i < nb_patterns; i++)
+		max_states += patterns[i].anchor_len;
+	matcher->next = malloc((size_t)max_states * 256 * sizeof(int32_t));
+	matcher->output = malloc(max_states * sizeof(int32_t));
+	matcher->dict = malloc(max_states * sizeof(int32_t));
+	matcher->out_next = malloc(nb_patterns * sizeof(int32_t));
+	fail = calloc(max_states, sizeof(int32_t));
+	queue = malloc(max_states * sizeof(int32_t));
+	if (matcher->next == NULL || matcher->output == NULL || matcher->dict == NULL ||
+		matcher->out_next == NULL || fail == NULL || queue == NULL)
+		goto error;
+	memset(matcher->next, 0xff, (size_t)max_states * 256 * sizeof(int32_t));
+	memset(matcher->output, 0xff, max_states * sizeof(int32_t));
+	memset(matcher->dict, 0xff, max_states * sizeof(int32_t));
+
+	// Build the trie of all the anchors
+	matcher->nb_states = 1;
+	for (i = 0; i < nb_patterns; i++) {
+		for (s = 0, j = 0; j < patterns[i].anchor_len; j++) {
+			c = patterns[i].original[patterns[i].anchor + j];
+			if (matcher->next[s * 256 + c] < 0)
+				matcher->next[s * 256 + c] = matcher->nb_states++;
+			s = matcher->next[s * 256 + c];
+		}
+		matcher->out_next[i] = matcher->output[s];
+		matcher->output[s] = (int32_t)i;
+	}
+
+	// Compute the failure links breadth first, and turn the trie into a DFA
+	for (c = 0; c < 256; c++) {
+		u = matcher->next[c];
+		if (u < 0) {
+			matcher->next[c] = 0;
+		} else {
+			fail[u] = 0;
+			queue[tail++] = u;
+		}
+	}
+	while (head < tail) {
+		s = queue[head++];
+		for (c = 0; c < 256; c++) {
+			u = matcher->next[s * 256 + c];
+			t = matcher->next[fail[s] * 256 + c];
+			if (u < 0) {
+				matcher->next[s * 256 + c] = t;
+				continue;
+			}
+			fail[u] = t;
+			matcher->dict[u] = (matcher->output[t] >= 0) ? t : matcher->dict[t];
+			queue[tail++] = u;
+		}
+	}
+
+	free(fail);
+	free(queue);
+	return matcher;
+
+error:
+	lprintf(stderr, "Could not allocate pattern matcher\n");
+	free(fail);
+	free(queue);
+	FreeByteMatcher(matcher);
+	return NULL;
+}
+
+/*
+ * Compile the byte patterns of a set into a matcher.
+ */
+BYTE_MATCHER* CreateByteMatcher(const BYTE_PATTERN* patterns, size_t nb_patterns)
+{
+	if (nb_patterns == 0)
+		return NULL;
+	if (nb_patterns == 1)
+		return CreateHorspoolMatcher(&patterns[0]);
+	return CreateAhoCorasickMatcher(patterns, nb_patterns);
+}
+
+void FreeByteMatcher(BYTE_MATCHER* matcher)
+{
+	if (matcher == NULL)
+		return;
+	free(matcher->next);
+	free(matcher->output);
+	free(matcher->dict);
+	free(matcher->out_next);
+	free(matcher);
+}
+
+static __inline BOOL VerifyMatch(const BYTE_PATTERN* pattern, const uint8_t* data, uint64_t offset)
+{
+	uint32_t i;
+
+	// Alignments are powers of two
+	if ((offset & (pattern->align - 1)) != 0)
+		return FALSE;
+	for (i = 0; i < pattern->len; i++) {
+		if ((data[i] & pattern->original_mask[i]) != pattern->original[i])
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Report all the occurrences of the set's byte patterns that lie fully inside
+ * [start, end) through the provided callback, including overlapping ones.
+ * Stops and returns FALSE if the callback returns FALSE.
+ */
+BOOL SearchBytePatterns(const PATTERN_SET* set, const uint8_t* base, uint64_t start, uint64_t end,
+	MATCH_CALLBACK callback, void* ctx)
+{
+	const BYTE_MATCHER* matcher = set->matcher;
+	const BYTE_PATTERN* p;
+	const uint8_t* anchor;
+	uint64_t pos, offset, limit;
+	int32_t s, t, i;
+
+	if (matcher == NULL)
+		return TRUE;
+
+	if (matcher->horspool) {
+		p = &set->byte_patterns[0];
+		anchor = &p->original[p->anchor];
+		if (end - start < p->len)
+			return TRUE;
+		// Last position at which the anchor can start while the full pattern still fits
+		limit = end - p->len + p->anchor;
+		for (pos = start + p->anchor; pos <= limit; pos += matcher->shift[base[pos + p->anchor_len - 1]]) {
+			if (base[pos + p->anchor_len - 1] != anchor[p->anchor_len - 1] ||
+				memcmp(&base[pos], anchor, p->anchor_len - 1) != 0)
+				continue;
+			offset = pos - p->anchor;
+			if (VerifyMatch(p, &base[offset], offset) && !callback(ctx, 0, offset))
+				return FALSE;
+		}
+		return TRUE;
+	}
+
+	for (s = 0, pos = start; pos < end; pos++) {
+		s = matcher->next[s * 256 + base[pos]];
+		for (t = (matcher->output[s] >= 0) ? s : matcher->dict[s]; t >= 0; t = matcher->dict[t]) {
+			for (i = matcher->output[t]; i >= 0; i = matcher->out_next[i]) {
+				p = &set->byte_patterns[i];
+				// The anchor ends at pos, so the pattern starts at pos + 1 - anchor_len - anchor
+				if (pos + 1 < start + p->anchor + p->anchor_len)
+					continue;
+				offset = pos + 1 - p->anchor_len - p->anchor;
+				if (offset + p->len > end)
+					continue;
+				if (VerifyMatch(p, &base[offset], offset) && !callback(ctx, i, offset))
+					return FALSE;
+			}
+		}
+	}
+	return TRUE;
+}
@@ -0,0 +1,168 @@
+/*
+ * winpatch - Windows system file patcher
+ * Timing instrumentation
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef _DEBUG
+#define _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "msapi_utf8.h"
+#include "winpatch.h"
+
+static const char* stage_name[NB_STAGES] = {
+	"ownership", "backup", "open", "map", "scan", "patch", "checksum", "flush", "sign"
+};
+
+uint64_t GetTicks(void)
+{
+	LARGE_INTEGER li;
+
+	QueryPerformanceCounter(&li);
+	return (uint64_t)li.QuadPart;
+}
+
+double TicksToMs(uint64_t ticks)
+{
+	static LARGE_INTEGER frequency = { 0 };
+
+	if (frequency.QuadPart == 0)
+		QueryPerformanceFrequency(&frequency);
+	return (double)ticks * 1000.0 / (double)frequency.QuadPart;
+}
+
+static void AddStats(FILE_STATS* total, const FILE_STATS* stats)
+{
+	int i;
+
+	for (i = 0; i < NB_STAGES; i++)
+		total->ticks[i] += stats->ticks[i];
+	total->bytes_scanned += stats->bytes_scanned;
+	total->nb_matches += stats->nb_matches;
+	total->nb_opens += stats->nb_opens;
+	total->nb_maps += stats->nb_maps;
+}
+
+void WriteJsonString(FILE* fd, const char* str)
+{
+	fputc('"', fd);
+	for (; *str != 0; str++) {
+		if (*str == '"' || *str == '\\')
+			fprintf(fd, "\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			fprintf(fd, "\\u%04x", (unsigned char)*str);
+		else
+			fputc(*str, fd);
+	}
+	fputc('"', fd);
+}
+
+static void WriteJsonStats(FILE* fd, const FILE_STATS* stats)
+{
+	int i;
+
+	for (i = 0; i < NB_STAGES; i++)
+		fprintf(fd, "\"%s_ms\": %.3f, ", stage_name[i], TicksToMs(stats->ticks[i]));
+	fprintf(fd, "\"bytes_scanned\": %llu, \"matches\": %u, \"opens\": %u, \"maps\": %u",
+		stats->bytes_scanned, stats->nb_matches, stats->nb_opens, stats->nb_maps);
+}
+
+static void WriteCsvStats(FILE* fd, const FILE_STATS* stats)
+{
+	int i;
+
+	for (i = 0; i < NB_STAGES; i++)
+		fprintf(fd, ",%.3f", TicksToMs(stats->ticks[i]));
+	fprintf(fd, ",%llu,%u,%u,%u", stats->bytes_scanned, stats->nb_matches, stats->nb_opens, stats->nb_maps);
+}
+
+/*
+ * Write the per file statistics, followed by the batch totals, as CSV if the
+ * path ends with ".csv", or as JSON otherwise. Use "-" for stdout.
+ * keygen_ticks is the time spent creating the signing key, which is also accounted
+ * for in the signing stage of the file that triggered it. Returns FALSE if the
+ * timings could not be fully written.
+ */
+BOOL WriteTimings(const char* path, const FILE_STATS* stats, int nb_files, uint64_t wall_ticks, uint64_t keygen_ticks)
+{
+	FILE* fd;
+	FILE_STATS total = { 0 };
+	size_t len = strlen(path);
+	BOOL csv = (len >= 4 && _stricmp(&path[len - 4], ".csv") == 0);
+	const char* p;
+	int i, nb_failed = 0;
+	BOOL r;
+
+	fd = (strcmp(path, "-") == 0) ? stdout : fopenU(path, "w");
+	if (fd == NULL) {
+		lprintf(stderr, "Could not create timings file '%s'\n", path);
+		return FALSE;
+	}
+	for (i = 0; i < nb_files; i++) {
+		AddStats(&total, &stats[i]);
+		if (stats[i].result < 0)
+			nb_failed++;
+	}
+
+	if (csv) {
+		fprintf(fd, "path,result");
+		for (i = 0; i < NB_STAGES; i++)
+			fprintf(fd, ",%s_ms", stage_name[i]);
+		fprintf(fd, ",bytes_scanned,matches,opens,maps,wall_ms,keygen_ms\n");
+		for (i = 0; i < nb_files; i++) {
+			// Quotes are not valid in Windows paths, but be safe
+			fputc('"', fd);
+			for (p = stats[i].path; *p != 0; p++)
+				fprintf(fd, (*p == '"') ? "\"\"" : "%c", *p);
+			fprintf(fd, "\",%d", stats[i].result);
+			WriteCsvStats(fd, &stats[i]);
+			fprintf(fd, ",%.3f,\n", TicksToMs(stats[i].total_ticks));
+		}
+		fprintf(fd, "TOTAL,%d", nb_failed);
+		WriteCsvStats(fd, &total);
+		fprintf(fd, ",%.3f,%.3f\n", TicksToMs(wall_ticks), TicksToMs(keygen_ticks));
+	} else {
+		fprintf(fd, "{\n  \"files\": [\n");
+		for (i = 0; i < nb_files; i++) {
+			fprintf(fd, "    { \"path\": ");
+			WriteJsonString(fd, stats[i].path);
+			fprintf(fd, ", \"result\": %d, ", stats[i].result);
+			WriteJsonStats(fd, &stats[i]);
+			fprintf(fd, ", \"wall_ms\": %.3f }%s\n", TicksToMs(stats[i].total_ticks), (i + 1 < nb_files) ? "," : "");
+		}
+		fprintf(fd, "  ],\n  \"totals\": { \"files\": %d, \"failed\": %d, ", nb_files, nb_failed);
+		WriteJsonStats(fd, &total);
+		fprintf(fd, ", \"wall_ms\": %.3f, \"keygen_ms\": %.3f }\n}\n", TicksToMs(wall_ticks), TicksToMs(keygen_ticks));
+	}
+
+	r = (fflush(fd) == 0 && !ferror(fd));
+	if (fd != stdout && fclose(fd) != 0)
+		r = FALSE;
+	if (!r)
+		lprintf(stderr, "Could not write timings file '%s'\n", path);
+	return r;
+}
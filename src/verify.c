@@ -0,0 +1,214 @@
+/*
+ * winpatch - Windows system file patcher
+ * Post-patch verification
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef _DEBUG
+#define _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <bcrypt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "msapi_utf8.h"
+#include "winpatch.h"
+
+#pragma comment(lib, "bcrypt.lib")
+
+/*
+ * Compute the SHA-256 of a mapped file and, if it is a PE image, its PE checksum (the
+ * way MapFileAndCheckSum() does) and whether it has a certificate table, all in a single
+ * sequential pass over the file.
+ */
+BOOL CheckImage(FILE_WINDOW* w, IMAGE_CHECK* check)
+{
+	BOOL r = FALSE;
+	BCRYPT_ALG_HANDLE hAlg = NULL;
+	BCRYPT_HASH_HANDLE hHash = NULL;
+	PIMAGE_NT_HEADERS32 pImageNTHeader32;
+	PIMAGE_DATA_DIRECTORY pSecurityDir;
+	DWORD* pdwCheckSum = NULL;
+	uint8_t* data;
+	uint64_t pos, checksum_offset = 0;
+	uint32_t sum = 0;
+	size_t len;
+
+	memset(check, 0, sizeof(IMAGE_CHECK));
+	pImageNTHeader32 = (w->size <= MAXDWORD) ? GetNtHeaders(w->head, w->head_len) : NULL;
+	if (pImageNTHeader32 != NULL) {
+		check->pe = TRUE;
+		pdwCheckSum = GetCheckSumField(pImageNTHeader32);
+		checksum_offset = (uint8_t*)pdwCheckSum - w->head;
+		check->checksum = *pdwCheckSum;
+		pSecurityDir = GetSecurityDirectory(pImageNTHeader32);
+		check->has_signature = (pSecurityDir != NULL && pSecurityDir->VirtualAddress != 0 &&
+			pSecurityDir->Size != 0 && (uint64_t)pSecurityDir->VirtualAddress + pSecurityDir->Size <= w->size);
+	}
+
+	if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&hAlg, BCRYPT_SHA256_ALGORITHM, NULL, 0)) ||
+		!BCRYPT_SUCCESS(BCryptCreateHash(hAlg, &hHash, NULL, 0, NULL, 0, 0))) {
+		lprintf(stderr, "Could not initialize SHA-256 hash\n");
+		goto out;
+	}
+	for (pos = 0; pos < w->size; pos += len) {
+		len = (size_t)min(w->size - pos, WINDOW_SIZE);
+		data = MapFileWindow(w, pos, len);
+		if (data == NULL || !BCRYPT_SUCCESS(BCryptHashData(hHash, data, (ULONG)len, 0)))
+			goto out;
+		if (check->pe)
+			sum = (sum + ChecksumBytes(data, pos, len)) % 0xFFFF;
+	}
+	if (!BCRYPT_SUCCESS(BCryptFinishHash(hHash, check->sha256, SHA256_DIGEST_SIZE, 0)))
+		goto out;
+	if (check->pe) {
+		// The CheckSum field is not part of the sum
+		sum = (sum + 0xFFFF - ChecksumBytes((uint8_t*)pdwCheckSum, checksum_offset, sizeof(DWORD))) % 0xFFFF;
+		check->computed_checksum = ChecksumFinalize(sum, check->checksum, w->size);
+	}
+	r = TRUE;
+
+out:
+	if (hHash != NULL)
+		BCryptDestroyHash(hHash);
+	if (hAlg != NULL)
+		BCryptCloseAlgorithmProvider(hAlg, 0);
+	return r;
+}
+
+void FreeHashRecords(HASH_RECORD* records, int nb_records)
+{
+	int i;
+
+	if (records == NULL)
+		return;
+	for (i = 0; i < nb_records; i++)
+		free(records[i].path);
+	free(records);
+}
+
+/*
+ * Read a list of the SHA-256 of patched files, as written by WriteHashRecords(). Each
+ * line is the hash, in hex, followed by whitespace and the path of the file, which is
+ * the same format as the one from sha256sum. Returns NULL on error.
+ */
+HASH_RECORD* ReadHashRecords(const char* path, int* nb_records)
+{
+	FILE* fd;
+	char line[1024], *p, *file_path;
+	int line_nr = 0;
+	size_t len;
+	HASH_RECORD *records = NULL, *new_records;
+
+	*nb_records = 0;
+	fd = fopenU(path, "r");
+	if (fd == NULL) {
+		lprintf(stderr, "Could not open hash list '%s'\n", path);
+		return NULL;
+	}
+
+	while (fgets(line, sizeof(line), fd) != NULL) {
+		line_nr++;
+		p = line;
+		// Skip the UTF-8 BOM, if any
+		if (line_nr == 1 && memcmp(p, "\xef\xbb\xbf", 3) == 0)
+			p += 3;
+		len = strlen(p);
+		while (len > 0 && (p[len - 1] == '\r' || p[len - 1] == '\n'))
+			p[--len] = 0;
+		if (len == 0 || p[0] == '#')
+			continue;
+		file_path = &p[2 * SHA256_DIGEST_SIZE];
+		// sha256sum prefixes the path with '*' for files read in binary mode
+		if (len > 2 * SHA256_DIGEST_SIZE + 1 && (*file_path == ' ' || *file_path == '\t')) {
+			while (*file_path == ' ' || *file_path == '\t' || *file_path == '*')
+				file_path++;
+		}
+		if (len <= 2 * SHA256_DIGEST_SIZE + 1 || file_path == &p[2 * SHA256_DIGEST_SIZE] || *file_path == 0) {
+			lprintf(stderr, "%s:%d: Expected a SHA-256 followed by a path\n", path, line_nr);
+			goto error;
+		}
+		p[2 * SHA256_DIGEST_SIZE] = 0;
+		new_records = realloc(records, (*nb_records + 1) * sizeof(HASH_RECORD));
+		if (new_records == NULL) {
+			lprintf(stderr, "realloc error\n");
+			goto error;
+		}
+		records = new_records;
+		records[*nb_records].valid = ParseHexDigest(p, records[*nb_records].sha256, SHA256_DIGEST_SIZE);
+		if (!records[*nb_records].valid) {
+			lprintf(stderr, "%s:%d: Invalid SHA-256 '%s'\n", path, line_nr, p);
+			goto error;
+		}
+		records[*nb_records].path = _strdup(file_path);
+		if (records[*nb_records].path == NULL)
+			goto error;
+		(*nb_records)++;
+	}
+	fclose(fd);
+	if (*nb_records == 0) {
+		lprintf(stderr, "No files listed in '%s'\n", path);
+		free(records);
+		return NULL;
+	}
+	return records;
+
+error:
+	fclose(fd);
+	FreeHashRecords(records, *nb_records);
+	*nb_records = 0;
+	return NULL;
+}
+
+/*
+ * Write the SHA-256 of all the records that are valid, in the format that
+ * ReadHashRecords() expects. Use "-" for stdout. Returns FALSE if the list could
+ * not be fully written.
+ */
+BOOL WriteHashRecords(const char* path, const HASH_RECORD* records, int nb_records)
+{
+	FILE* fd;
+	int i, j;
+	BOOL r;
+
+	fd = (strcmp(path, "-") == 0) ? stdout : fopenU(path, "w");
+	if (fd == NULL) {
+		lprintf(stderr, "Could not create hash list '%s'\n", path);
+		return FALSE;
+	}
+	for (i = 0; i < nb_records; i++) {
+		if (!records[i].valid)
+			continue;
+		for (j = 0; j < SHA256_DIGEST_SIZE; j++)
+			fprintf(fd, "%02x", records[i].sha256[j]);
+		fprintf(fd, "  %s\n", records[i].path);
+	}
+	// A truncated list would make the files that are missing from it fail verification
+	r = (fflush(fd) == 0 && !ferror(fd));
+	if (fd != stdout && fclose(fd) != 0)
+		r = FALSE;
+	if (!r)
+		lprintf(stderr, "Could not write hash list '%s'\n", path);
+	return r;
+}
@@ -0,0 +1,149 @@
+/*
+ * winpatch - Windows system file patcher
+ * Windowed file mapping
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef _DEBUG
+#define _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "winpatch.h"
+
+/*
+ * Files that are small enough are mapped in a single view. Larger ones are accessed
+ * through a view of their beginning, which holds the headers and remains mapped, and
+ * a second view, of at most WINDOW_SIZE + WINDOW_OVERLAP bytes, that slides along the
+ * file, so that the address space we use remains bounded, regardless of the file size.
+ */
+#define SINGLE_VIEW_MAX_SIZE (2ULL * WINDOW_SIZE)
+
+/*
+ * Create a mapping of the first size bytes of a file (which extends the file if needed).
+ */
+BOOL OpenFileWindow(FILE_WINDOW* w, HANDLE hFile, uint64_t size, BOOL writable)
+{
+	SYSTEM_INFO si;
+
+	memset(w, 0, sizeof(FILE_WINDOW));
+	GetSystemInfo(&si);
+	w->hFile = hFile;
+	w->size = size;
+	w->granularity = si.dwAllocationGranularity;
+	w->access = writable ? FILE_MAP_ALL_ACCESS : FILE_MAP_READ;
+	w->hMapping = CreateFileMapping(hFile, NULL, writable ? PAGE_READWRITE : PAGE_READONLY,
+		(DWORD)(size >> 32), (DWORD)size, NULL);
+	if (w->hMapping == NULL) {
+		lprintf(stderr, "Could not create file mapping: Error %u\n", GetLastError());
+		return FALSE;
+	}
+	w->head_len = (size_t)((size <= SINGLE_VIEW_MAX_SIZE) ? size : WINDOW_SIZE);
+	w->head = (uint8_t*)MapViewOfFile(w->hMapping, w->access, 0, 0, w->head_len);
+	if (w->head == NULL) {
+		lprintf(stderr, "Could not get mapped view address: Error %u\n", GetLastError());
+		CloseHandle(w->hMapping);
+		w->hMapping = NULL;
+		return FALSE;
+	}
+	w->nb_maps = 1;
+	return TRUE;
+}
+
+/*
+ * Access a buffer that is already fully mapped through the window interface.
+ */
+void InitMemoryWindow(FILE_WINDOW* w, uint8_t* base, uint64_t size)
+{
+	memset(w, 0, sizeof(FILE_WINDOW));
+	w->size = size;
+	w->head = base;
+	w->head_len = (size_t)size;
+}
+
+/*
+ * Return a pointer to len bytes of the file at offset, remapping the sliding view if
+ * needed. len can't be larger than WINDOW_SIZE + WINDOW_OVERLAP. The pointer remains
+ * valid until the next call, unless the data lies in the first view, whose pointers
+ * remain valid until the window is closed. Returns NULL on error.
+ */
+uint8_t* MapFileWindow(FILE_WINDOW* w, uint64_t offset, size_t len)
+{
+	uint64_t start;
+	size_t view_len;
+
+	if (offset > w->size || len > w->size - offset)
+		return NULL;
+	if (offset + len <= w->head_len)
+		return &w->head[offset];
+	if (w->data != NULL && offset >= w->offset && offset + len <= w->offset + w->len)
+		return &w->data[offset - w->offset];
+	if (w->hMapping == NULL || len > WINDOW_SIZE + WINDOW_OVERLAP)
+		return NULL;
+
+	if (w->data != NULL) {
+		UnmapViewOfFile(w->data);
+		w->data = NULL;
+	}
+	// Views must start on an allocation granularity boundary
+	start = offset & ~((uint64_t)w->granularity - 1);
+	view_len = (size_t)min(w->size - start, (offset - start) + WINDOW_SIZE + WINDOW_OVERLAP);
+	w->data = (uint8_t*)MapViewOfFile(w->hMapping, w->access, (DWORD)(start >> 32), (DWORD)start, view_len);
+	if (w->data == NULL) {
+		lprintf(stderr, "Could not map view at offset %08llX: Error %u\n", start, GetLastError());
+		return NULL;
+	}
+	w->offset = start;
+	w->len = view_len;
+	w->nb_maps++;
+	return &w->data[offset - start];
+}
+
+/*
+ * Write all the modified data back to the file.
+ */
+BOOL FlushFileWindow(FILE_WINDOW* w)
+{
+	if (w->hMapping == NULL)
+		return TRUE;
+	if (!FlushViewOfFile(w->head, 0) || (w->data != NULL && !FlushViewOfFile(w->data, 0)))
+		return FALSE;
+	// Views that were unmapped along the way may still have dirty pages in the cache
+	if (w->nb_maps > 2 && !FlushFileBuffers(w->hFile))
+		return FALSE;
+	return TRUE;
+}
+
+void CloseFileWindow(FILE_WINDOW* w)
+{
+	if (w->hMapping == NULL)
+		return;
+	if (w->data != NULL)
+		UnmapViewOfFile(w->data);
+	if (w->head != NULL)
+		UnmapViewOfFile(w->head);
+	CloseHandle(w->hMapping);
+	memset(w, 0, sizeof(FILE_WINDOW));
+}
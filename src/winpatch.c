@@ -31,11 +31,12 @@
 #include <stdbool.h>
 #include <accctrl.h>
 #include <aclapi.h>
-#include <imagehlp.h>
 
 #include "msapi_utf8.h"
+#include "winpatch.h"
 
-#pragma comment(lib, "imagehlp.lib")
+// For PathMatchSpecW()
+#pragma comment(lib, "shlwapi.lib")
 
 #define _STRINGIFY(x) #x
 #define STRINGIFY(x) _STRINGIFY(x)
@@ -57,7 +58,64 @@
 #define APP_VERSION_STR STRINGIFY(APP_VERSION)
 #endif
 
-extern BOOL SelfSignFile(LPCSTR szFileName, LPCSTR szCertSubject);
+// Maximum number of values (path + QWORDs) on a single line of a batch list
+#define MAX_BATCH_TOKENS 1024
+// Maximum number of sections that the scan can be restricted to
+#define MAX_SECTION_FILTERS 16
+// Size of the chunks that stdin is read, and stdout written, in
+#define STDIO_BUFFER_SIZE (1024 * 1024)
+// Inputs from stdin up to this size are patched in memory, and larger ones spooled to a temporary file
+#define STDIO_MEMORY_LIMIT (256 * 1024 * 1024)
+
+typedef struct {
+	char* path;
+	char* output;			// Where to write the patched file, or NULL to patch in place
+	PATTERN_SET* set;
+	FILE_STATS* stats;
+	CATALOG_HASH* hash;		// Where to store the catalog hash of the patched file, if needed
+	HASH_RECORD* record;	// Where to store the SHA-256 of the patched file, or the expected one
+	MATCH_REPORT* report;	// Where to record the matches, if a report was requested
+	int nb_jobs;
+} PATCH_JOB;
+
+static char system_dir[128];
+// Privilege adjustment applies to the whole process token, so it must not
+// run concurrently between jobs
+static CRITICAL_SECTION ownership_lock;
+// The SIDs, DACL and token used to take ownership, which are shared by all the jobs
+static struct {
+	PSID pSIDAdmin;
+	PSID pSIDEveryone;
+	PACL pACL;
+	HANDLE hToken;
+	BOOL bPrivilegeEnabled;
+} ownership = { 0 };
+// All the files are signed with the same certificate
+static SIGNING_SESSION* signing_session = NULL;
+static BOOL verify_checksum = FALSE;
+static char* section_filter[MAX_SECTION_FILTERS];
+static int nb_section_filters = 0;
+static PINNED_MANIFEST* pinned_manifest = NULL;
+static BOOL use_cache = FALSE;
+// Stop scanning once all the patterns have their maximum number of matches
+static BOOL stop_early = FALSE;
+// Only report the matches, without altering anything
+static BOOL scan_only = FALSE;
+// When scanning a directory tree, only the files with matches are reported
+static BOOL tree_scan = FALSE;
+static BACKUP_MODE backup_mode = BACKUP_FULL;
+// Put the original files back, from their backups
+static BOOL restore = FALSE;
+// Patch files that aren't PE images, such as disk images, without any post-processing
+static BOOL raw_mode = FALSE;
+// When a catalog is created, the embedded signatures can be skipped
+static BOOL embed_signature = TRUE;
+// Patch the file from stdin, and write the result to stdout
+static BOOL stdio_mode = FALSE;
+// Check patched files against the SHA-256 recorded when patching them
+static BOOL verify_mode = FALSE;
+// Reads the files that come next in a batch, while the current ones are being processed
+static READ_AHEAD* read_ahead = NULL;
 
 static DWORD ReadRegistryKey32(HKEY root, const char* key_name)
 {
@@ -117,11 +175,11 @@ BOOL IsCurrentProcessElevated(void)
 
 	if (ReadRegistryKey32(HKEY_LOCAL_MACHINE, "Software\\Microsoft\\Windows\\CurrentVersion\\Policies\\System\\EnableLUA") == 1) {
 		if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token)) {
-			fprintf(stderr, "Could not get current process token: Error %u\n", GetLastError());
+			lprintf(stderr, "Could not get current process token: Error %u\n", GetLastError());
 			goto out;
 		}
 		if (!GetTokenInformation(token, TokenElevation, &te, sizeof(te), &size)) {
-			fprintf(stderr, "Could not get token information: Error %u\n", GetLastError());
+			lprintf(stderr, "Could not get token information: Error %u\n", GetLastError());
 			goto out;
 		}
 		r = (te.TokenIsElevated != 0);
@@ -156,7 +214,7 @@ static BOOL SetPrivilege(
 		lpszPrivilege,   // privilege to lookup 
 		&luid))        // receives LUID of privilege
 	{
-		fprintf(stderr, "LookupPrivilegeValue error: %u\n", GetLastError());
+		lprintf(stderr, "LookupPrivilegeValue error: %u\n", GetLastError());
 		return FALSE;
 	}
 
@@ -175,12 +233,12 @@ static BOOL SetPrivilege(
 		sizeof(TOKEN_PRIVILEGES),
 		(PTOKEN_PRIVILEGES)NULL,
 		(PDWORD)NULL)) {
-		fprintf(stderr, "AdjustTokenPrivileges error: %u\n", GetLastError());
+		lprintf(stderr, "AdjustTokenPrivileges error: %u\n", GetLastError());
 		return FALSE;
 	}
 
 	if (GetLastError() == ERROR_NOT_ALL_ASSIGNED) {
-		fprintf(stderr, "The token does not have the specified privilege.\n");
+		lprintf(stderr, "The token does not have the specified privilege.\n");
 		return FALSE;
 	}
 
@@ -188,35 +246,23 @@ static BOOL SetPrivilege(
 }
 
 /*
- * https://docs.microsoft.com/en-us/windows/win32/secauthz/taking-object-ownership-in-c--
+ * Everything TakeOwnership() needs that does not depend on the file is set up
+ * once, and shared by all the jobs.
  */
-static BOOL TakeOwnership(const char* filename)
+static BOOL InitOwnership(void)
 {
-	BOOL bRetval = FALSE;
-	HANDLE hToken = NULL;
-	PSID pSIDAdmin = NULL;
-	PSID pSIDEveryone = NULL;
-	PACL pACL = NULL;
 	SID_IDENTIFIER_AUTHORITY SIDAuthWorld = SECURITY_WORLD_SID_AUTHORITY;
 	SID_IDENTIFIER_AUTHORITY SIDAuthNT = SECURITY_NT_AUTHORITY;
 	EXPLICIT_ACCESS ea[2];
-	DWORD dwRes;
-	wchar_t* pszFilename = utf8_to_wchar(filename);
-
-	if (pszFilename == NULL) {
-		fprintf(stderr, "Could not convert filename '%s'\n", filename);
-		goto Cleanup;
-	}
 
-	// Specify the DACL to use.
 	// Create a SID for the Everyone group.
 	if (!AllocateAndInitializeSid(&SIDAuthWorld, 1,
 		SECURITY_WORLD_RID,
 		0,
 		0, 0, 0, 0, 0, 0,
-		&pSIDEveryone)) {
-		fprintf(stderr, "AllocateAndInitializeSid (Everyone): Error %u\n", GetLastError());
-		goto Cleanup;
+		&ownership.pSIDEveryone)) {
+		lprintf(stderr, "AllocateAndInitializeSid (Everyone): Error %u\n", GetLastError());
+		return FALSE;
 	}
 
 	// Create a SID for the BUILTIN\Administrators group.
@@ -224,9 +270,9 @@ static BOOL TakeOwnership(const char* filename)
 		SECURITY_BUILTIN_DOMAIN_RID,
 		DOMAIN_ALIAS_RID_ADMINS,
 		0, 0, 0, 0, 0, 0,
-		&pSIDAdmin)) {
-		fprintf(stderr, "AllocateAndInitializeSid (Admin): Error %u\n", GetLastError());
-		goto Cleanup;
+		&ownership.pSIDAdmin)) {
+		lprintf(stderr, "AllocateAndInitializeSid (Admin): Error %u\n", GetLastError());
+		return FALSE;
 	}
 
 	ZeroMemory(&ea, 2 * sizeof(EXPLICIT_ACCESS));
@@ -237,7 +283,7 @@ static BOOL TakeOwnership(const char* filename)
 	ea[0].grfInheritance = NO_INHERITANCE;
 	ea[0].Trustee.TrusteeForm = TRUSTEE_IS_SID;
 	ea[0].Trustee.TrusteeType = TRUSTEE_IS_WELL_KNOWN_GROUP;
-	ea[0].Trustee.ptstrName = (LPTSTR)pSIDEveryone;
+	ea[0].Trustee.ptstrName = (LPTSTR)ownership.pSIDEveryone;
 
 	// Set full control for Administrators.
 	ea[1].grfAccessPermissions = GENERIC_ALL;
@@ -245,346 +291,1704 @@ static BOOL TakeOwnership(const char* filename)
 	ea[1].grfInheritance = NO_INHERITANCE;
 	ea[1].Trustee.TrusteeForm = TRUSTEE_IS_SID;
 	ea[1].Trustee.TrusteeType = TRUSTEE_IS_GROUP;
-	ea[1].Trustee.ptstrName = (LPTSTR)pSIDAdmin;
+	ea[1].Trustee.ptstrName = (LPTSTR)ownership.pSIDAdmin;
 
-	if (SetEntriesInAcl(2, ea, NULL, &pACL) != ERROR_SUCCESS) {
-		fprintf(stderr, "Failed SetEntriesInAcl\n");
+	if (SetEntriesInAcl(2, ea, NULL, &ownership.pACL) != ERROR_SUCCESS) {
+		ownership.pACL = NULL;
+		lprintf(stderr, "Failed SetEntriesInAcl\n");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void FreeOwnership(void)
+{
+	// The privilege was left enabled for the whole batch
+	if (ownership.bPrivilegeEnabled && !SetPrivilege(ownership.hToken, "SeTakeOwnershipPrivilege", FALSE))
+		lprintf(stderr, "SetPrivilege call failed unexpectedly.\n");
+	if (ownership.hToken != NULL)
+		CloseHandle(ownership.hToken);
+	if (ownership.pSIDAdmin != NULL)
+		FreeSid(ownership.pSIDAdmin);
+	if (ownership.pSIDEveryone != NULL)
+		FreeSid(ownership.pSIDEveryone);
+	if (ownership.pACL != NULL)
+		LocalFree(ownership.pACL);
+	ownership.hToken = NULL;
+	ownership.pSIDAdmin = NULL;
+	ownership.pSIDEveryone = NULL;
+	ownership.pACL = NULL;
+	ownership.bPrivilegeEnabled = FALSE;
+}
+
+/*
+ * Enable the SE_TAKE_OWNERSHIP_NAME privilege, the first time a job needs it.
+ * It then remains enabled until FreeOwnership(), rather than being toggled for
+ * each file, which means that the jobs don't need to be serialized around it.
+ */
+static BOOL EnableTakeOwnershipPrivilege(void)
+{
+	BOOL r;
+
+	EnterCriticalSection(&ownership_lock);
+	if (!ownership.bPrivilegeEnabled) {
+		if (ownership.hToken == NULL &&
+			!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES, &ownership.hToken)) {
+			ownership.hToken = NULL;
+			lprintf(stderr, "OpenProcessToken failed: Error %u\n", GetLastError());
+		} else if (SetPrivilege(ownership.hToken, "SeTakeOwnershipPrivilege", TRUE)) {
+			ownership.bPrivilegeEnabled = TRUE;
+		} else {
+			lprintf(stderr, "You must be logged on as Administrator.\n");
+		}
+	}
+	r = ownership.bPrivilegeEnabled;
+	LeaveCriticalSection(&ownership_lock);
+	return r;
+}
+
+/*
+ * Check whether a DACL grants all the rights from dwMask to a SID, through the ACEs
+ * that explicitly reference that SID (group memberships are not considered).
+ */
+static BOOL IsAccessGranted(PACL pDACL, PSID pSID, DWORD dwMask)
+{
+	GENERIC_MAPPING mapping = { FILE_GENERIC_READ, FILE_GENERIC_WRITE, FILE_GENERIC_EXECUTE, FILE_ALL_ACCESS };
+	ACE_HEADER* pAce;
+	DWORD i, dwAceMask, dwGranted = 0;
+
+	// A NULL DACL grants full access to everyone
+	if (pDACL == NULL)
+		return TRUE;
+	for (i = 0; i < pDACL->AceCount; i++) {
+		if (!GetAce(pDACL, i, (LPVOID*)&pAce) || (pAce->AceFlags & INHERIT_ONLY_ACE))
+			continue;
+		if (pAce->AceType != ACCESS_ALLOWED_ACE_TYPE && pAce->AceType != ACCESS_DENIED_ACE_TYPE)
+			continue;
+		// Allowed and denied ACEs have the same layout
+		if (!EqualSid((PSID)&((ACCESS_ALLOWED_ACE*)pAce)->SidStart, pSID))
+			continue;
+		dwAceMask = ((ACCESS_ALLOWED_ACE*)pAce)->Mask;
+		MapGenericMask(&dwAceMask, &mapping);
+		// ACEs are evaluated in order, so a denial only applies to the rights not granted yet
+		if (pAce->AceType == ACCESS_DENIED_ACE_TYPE) {
+			if (dwAceMask & dwMask & ~dwGranted)
+				return FALSE;
+		} else {
+			dwGranted |= dwAceMask;
+		}
+		if ((dwGranted & dwMask) == dwMask)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/*
+ * https://docs.microsoft.com/en-us/windows/win32/secauthz/taking-object-ownership-in-c--
+ * The current security descriptor is queried first, since reading it is a lot cheaper
+ * than rewriting it, so that files we were already given full control of are left alone,
+ * and the DACL write that is bound to fail is skipped for files we don't own.
+ */
+static BOOL TakeOwnership(const char* filename)
+{
+	BOOL bRetval = FALSE, bOwner = FALSE;
+	PSID pSIDOwner = NULL;
+	PACL pDACL = NULL;
+	PSECURITY_DESCRIPTOR pSD = NULL;
+	DWORD dwRes;
+	wchar_t* pszFilename = utf8_to_wchar(filename);
+
+	if (pszFilename == NULL) {
+		lprintf(stderr, "Could not convert filename '%s'\n", filename);
 		goto Cleanup;
 	}
 
-	// Try to modify the object's DACL.
-	dwRes = SetNamedSecurityInfoW(
+	dwRes = GetNamedSecurityInfoW(
 		pszFilename,                 // name of the object
 		SE_FILE_OBJECT,              // type of object
-		DACL_SECURITY_INFORMATION,   // change only the object's DACL
-		NULL, NULL,                  // do not change owner or group
-		pACL,                        // DACL specified
-		NULL);                       // do not change SACL
+		OWNER_SECURITY_INFORMATION | DACL_SECURITY_INFORMATION,
+		&pSIDOwner, NULL,            // owner, but not group
+		&pDACL,                      // DACL
+		NULL,                        // not SACL
+		&pSD);                       // descriptor the above point into
 
 	if (dwRes == ERROR_SUCCESS) {
-		bRetval = TRUE;
-		// No more processing needed.
-		goto Cleanup;
-	}
-	if (dwRes != ERROR_ACCESS_DENIED) {
-		printf("First SetNamedSecurityInfo call failed: %u\n", dwRes);
-		goto Cleanup;
+		if (IsAccessGranted(pDACL, ownership.pSIDAdmin, FILE_ALL_ACCESS)) {
+			bRetval = TRUE;
+			// Nothing to change.
+			goto Cleanup;
+		}
+		bOwner = (pSIDOwner != NULL && EqualSid(pSIDOwner, ownership.pSIDAdmin)) ||
+			IsAccessGranted(pDACL, ownership.pSIDAdmin, WRITE_DAC);
 	}
 
-	// If the preceding call failed because access was denied, 
-	// enable the SE_TAKE_OWNERSHIP_NAME privilege, create a SID for 
-	// the Administrators group, take ownership of the object, and 
-	// disable the privilege. Then try again to set the object's DACL.
-
-	// Open a handle to the access token for the calling process.
-	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES, &hToken)) {
-		fprintf(stderr, "OpenProcessToken failed: Error %u\n", GetLastError());
-		goto Cleanup;
+	// Try to modify the object's DACL, unless we know that this will be denied.
+	if (dwRes != ERROR_SUCCESS || bOwner) {
+		dwRes = SetNamedSecurityInfoW(
+			pszFilename,                 // name of the object
+			SE_FILE_OBJECT,              // type of object
+			DACL_SECURITY_INFORMATION,   // change only the object's DACL
+			NULL, NULL,                  // do not change owner or group
+			ownership.pACL,              // DACL specified
+			NULL);                       // do not change SACL
+
+		if (dwRes == ERROR_SUCCESS) {
+			bRetval = TRUE;
+			// No more processing needed.
+			goto Cleanup;
+		}
+		if (dwRes != ERROR_ACCESS_DENIED) {
+			lprintf(stdout, "First SetNamedSecurityInfo call failed: %u\n", dwRes);
+			goto Cleanup;
+		}
 	}
 
-	// Enable the SE_TAKE_OWNERSHIP_NAME privilege.
-	if (!SetPrivilege(hToken, "SeTakeOwnershipPrivilege", TRUE)) {
-		fprintf(stderr, "You must be logged on as Administrator.\n");
+	// If access is denied, take ownership of the object, with the
+	// SE_TAKE_OWNERSHIP_NAME privilege, and then set the object's DACL.
+	if (!EnableTakeOwnershipPrivilege())
 		goto Cleanup;
-	}
 
 	// Set the owner in the object's security descriptor.
 	dwRes = SetNamedSecurityInfoW(
 		pszFilename,                 // name of the object
 		SE_FILE_OBJECT,              // type of object
 		OWNER_SECURITY_INFORMATION,  // change only the object's owner
-		pSIDAdmin,                   // SID of Administrator group
+		ownership.pSIDAdmin,         // SID of Administrator group
 		NULL,
 		NULL,
 		NULL);
 
 	if (dwRes != ERROR_SUCCESS) {
-		fprintf(stderr, "Could not set owner: Error %u\n", dwRes);
-		goto Cleanup;
-	}
-
-	// Disable the SE_TAKE_OWNERSHIP_NAME privilege.
-	if (!SetPrivilege(hToken, "SeTakeOwnershipPrivilege", FALSE)) {
-		fprintf(stderr, "SetPrivilege call failed unexpectedly.\n");
+		lprintf(stderr, "Could not set owner: Error %u\n", dwRes);
 		goto Cleanup;
 	}
 
-	// Try again to modify the object's DACL, now that we are the owner.
+	// Modify the object's DACL, now that we are the owner.
 	dwRes = SetNamedSecurityInfoW(
 		(LPWSTR)pszFilename,         // name of the object
 		SE_FILE_OBJECT,              // type of object
 		DACL_SECURITY_INFORMATION,   // change only the object's DACL
 		NULL, NULL,                  // do not change owner or group
-		pACL,                        // DACL specified
+		ownership.pACL,              // DACL specified
 		NULL);                       // do not change SACL
 
 	if (dwRes == ERROR_SUCCESS)
 		bRetval = TRUE;
 	else
-		fprintf(stderr, "Second SetNamedSecurityInfo call failed: Error %u\n", dwRes);
+		lprintf(stderr, "Second SetNamedSecurityInfo call failed: Error %u\n", dwRes);
 
 Cleanup:
-	if (pSIDAdmin)
-		FreeSid(pSIDAdmin);
-	if (pSIDEveryone)
-		FreeSid(pSIDEveryone);
-	if (pACL)
-		LocalFree(pACL);
-	if (hToken)
-		CloseHandle(hToken);
+	if (pSD)
+		LocalFree(pSD);
 	free(pszFilename);
 	return bRetval;
 }
 
-BOOL CreateBackup(const char* path)
+/*
+ * Record the matches from a scan, so that the next run on the same file can skip it.
+ */
+static void RecordMatches(uint64_t key, const EDIT_LIST* list)
 {
-	BOOL bRet = FALSE;
-	struct _stat64 st;
-	size_t size = safe_strlen(path) + 5;
-	char* backup_path = NULL;
+	CACHED_MATCH* matches;
+	int i;
+
+	matches = malloc((list->nb_edits + 1) * sizeof(CACHED_MATCH));
+	if (matches == NULL)
+		return;
+	for (i = 0; i < list->nb_edits; i++) {
+		matches[i].offset = list->edits[i].offset;
+		matches[i].pattern = list->edits[i].pattern;
+	}
+	WriteMatchCache(key, matches, list->nb_edits);
+	free(matches);
+}
 
-	if (_stat64U(path, &st) != 0)
-		return FALSE;
+/*
+ * Report all the edits from the list, as they would be applied, without altering the file.
+ */
+static BOOL ReportEdits(FILE_WINDOW* w, const EDIT_LIST* list, const char* filename)
+{
+	uint8_t data[MAX_PATTERN_LENGTH];
+	const uint8_t* old_data;
+	LOG_BUFFER log;
+	BOOL buffered, r = FALSE;
+	int i;
 
-	backup_path = malloc(size);
-	if (backup_path == NULL)
-		return FALSE;
-	strcpy_s(backup_path, size, path);
-	strcat_s(backup_path, size, ".bak");
-	if (_stat64U(backup_path, &st) == 0) {
-		fprintf(stdout, "Backup '%s' already exists - keeping it\n", backup_path);
-		free(backup_path);
+	if (tree_scan && list->nb_edits == 0)
 		return TRUE;
+	buffered = StartLogBuffering(&log);
+	if (tree_scan)
+		lprintf(stdout, "\n%s\n", filename);
+	for (i = 0; i < list->nb_edits; i++) {
+		old_data = MapFileWindow(w, list->edits[i].offset, list->edits[i].len);
+		if (old_data == NULL)
+			goto out;
+		GetPatchedData(old_data, &list->edits[i], data);
+		PrintEdit(old_data, &list->edits[i], data);
 	}
-	bRet = CopyFileU(path, backup_path, TRUE);
-	if (bRet)
-		fprintf(stdout, "Saved backup as '%s'\n", backup_path);
-	free(backup_path);
-	return bRet;
+	lprintf(stdout, "Found %d match(es)\n", list->nb_edits);
+	r = TRUE;
+
+out:
+	EndLogBuffering(&log, buffered);
+	return r;
 }
 
-static DWORD RemoveDigitalSignature(const char* filename)
+/*
+ * Save the original data of everything that is about to be altered into a delta backup.
+ */
+static BOOL SaveDeltaBackup(const char* filename, FILE_WINDOW* w, const EDIT_LIST* list)
 {
-	DWORD dwNumCerts = -1;
-	HANDLE hFile = NULL;
+	SCAN_RANGE* ranges;
+	int i, nb_ranges;
+	BOOL r = FALSE;
 
-	hFile = CreateFileU(filename, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
-		NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
-	if (hFile == NULL) {
-		fprintf(stderr, "Could not open file to remove digital signature: Error %u\n", GetLastError());
+	// The edits, followed by the ranges that the PE update and signing alter
+	ranges = malloc((list->nb_edits + 3) * sizeof(SCAN_RANGE));
+	if (ranges == NULL)
+		return FALSE;
+	for (i = 0; i < list->nb_edits; i++) {
+		ranges[i].start = list->edits[i].offset;
+		ranges[i].end = list->edits[i].offset + list->edits[i].len;
+	}
+	nb_ranges = raw_mode ? 0 : GetPEUpdateRanges(w, &ranges[list->nb_edits]);
+	if (nb_ranges >= 0)
+		r = WriteDeltaBackup(filename, w, ranges, list->nb_edits + nb_ranges);
+	free(ranges);
+	return r;
+}
+
+/*
+ * Map the file once, and patch, in place, all the 64-bit aligned QWORDs, or byte patterns,
+ * that match one of the ORIGINAL values from the pattern set. Then, using the same mapping,
+ * remove the digital signature and update the PE checksum from the changes that were
+ * applied. The file is only flushed once at the end, and is left untouched if no match
+ * was found. Files of any size are accessed through a FILE_WINDOW, so that we never map
+ * more than a few windows of it at once. In scan only mode, the file is mapped read-only,
+ * and the matches are only reported. If hOutput is valid, the file is also mapped read-only
+ * and copied into hOutput by the scan, from the same windows, so that it only gets read
+ * once, with the patching and post-processing then applied to the copy. If buf is not NULL,
+ * the image is patched in that buffer, of *buf_size bytes, instead of hFile, and *buf_size
+ * is updated with the size it must be truncated to. In raw mode, the file doesn't have to be
+ * a PE image, and no post-processing is performed. If report is not NULL, the matches are
+ * also recorded there, before being patched.
+ * Returns the number of elements patched (or found), or -1 on error.
+ */
+static int ScanAndPatch(HANDLE hFile, uint8_t* buf, uint64_t* buf_size, HANDLE hOutput, const char* filename,
+	const PATTERN_SET* set, FILE_STATS* stats, MATCH_REPORT* report)
+{
+	int patched = -1;
+	FILE_WINDOW w = { 0 }, out = { 0 }, *target = &w;
+	LARGE_INTEGER liSize;
+	BOOL read_only = scan_only || (hOutput != INVALID_HANDLE_VALUE);
+	uint32_t delta;
+	uint64_t checksum_offset = UINT64_MAX;
+	uint8_t *src, *dst;
+	size_t len;
+	BOOL copied = FALSE;
+	PIMAGE_NT_HEADERS32 pImageNTHeader32 = NULL;
+	const PINNED_BLOCK* block;
+	EDIT_LIST list = { 0 };
+	SCAN_RANGE file_range, *ranges = NULL;
+	const SCAN_RANGE* scan_ranges;
+	CACHED_MATCH* cached = NULL;
+	int i, nb_ranges, nb_cached = -1;
+	uint64_t key = 0, start, pos;
+	BOOL r, has_key = FALSE;
+	PE_UPDATE update = { 0 };
+
+	if (buf != NULL) {
+		liSize.QuadPart = (LONGLONG)*buf_size;
+	} else if (!GetFileSizeEx(hFile, &liSize)) {
+		lprintf(stderr, "Could not get size of '%s': Error %u\n", filename, GetLastError());
 		return -1;
 	}
+	if ((uint64_t)liSize.QuadPart < sizeof(uint64_t))
+		return 0;
 
-	if (ImageEnumerateCertificates(hFile, CERT_SECTION_TYPE_ANY, &dwNumCerts, NULL, 0)) {
-		switch(dwNumCerts) {
-		case 0:
-			break;
-		case 1:
-			if (!ImageRemoveCertificate(hFile, 0)) {
-				fprintf(stderr, "Could not delete digital signatures: Error %u\n", GetLastError());
-				dwNumCerts = -1;
+	start = GetTicks();
+	if (buf != NULL) {
+		InitMemoryWindow(&w, buf, liSize.QuadPart);
+		r = TRUE;
+	} else {
+		r = OpenFileWindow(&w, hFile, liSize.QuadPart, !read_only);
+	}
+	stats->ticks[STAGE_MAP] += GetTicks() - start;
+	if (!r)
+		goto out;
+
+	// Accessing a mapped view turns read errors into exceptions, which we need to handle
+	__try {
+		// Don't alter anything we won't be able to sign afterwards
+		if (!raw_mode) {
+			pImageNTHeader32 = (w.size <= MAXDWORD) ? GetNtHeaders(w.head, w.head_len) : NULL;
+			if (pImageNTHeader32 == NULL) {
+				// A tree may hold other files than PE images, that simply have no matches
+				if (tree_scan)
+					patched = 0;
+				else
+					lprintf(stderr, "'%s' is not a valid PE image\n", filename);
+				__leave;
 			}
-			break;
-		default:
-			fprintf(stderr, "Unexpected number of signatures!\n");
-			dwNumCerts = -1;
-			break;
+			checksum_offset = (uint8_t*)GetCheckSumField(pImageNTHeader32) - w.head;
+		}
+		if (hOutput != INVALID_HANDLE_VALUE) {
+			start = GetTicks();
+			r = OpenFileWindow(&out, hOutput, w.size, TRUE);
+			stats->ticks[STAGE_MAP] += GetTicks() - start;
+			if (!r) {
+				lprintf(stderr, "Could not map output file\n");
+				__leave;
+			}
+		}
+		start = GetTicks();
+		// If the file is in the pinned manifest, we can skip the scan altogether
+		block = FindPinnedBlock(pinned_manifest, &w);
+		if (block != NULL && CheckPinnedBlock(block, &w)) {
+			if (!tree_scan)
+				lprintf(stdout, "Using pinned offsets from manifest\n");
+			patched = AddPinnedEdits(block, &list);
+		} else if (set == NULL) {
+			if (tree_scan)
+				patched = 0;
+			else
+				lprintf(stderr, "'%s' does not match the pinned manifest, and no patch data was provided\n", filename);
+			__leave;
+		} else {
+			if (block != NULL && !tree_scan)
+				lprintf(stdout, "Falling back to scanning\n");
+			// An identical file may already have been scanned with the same patterns
+			if (use_cache && !scan_only && !raw_mode)
+				has_key = GetCacheKey(&w, set, section_filter, nb_section_filters, &key);
+			if (has_key) {
+				nb_cached = ReadMatchCache(key, &cached);
+				if (nb_cached >= 0 && !CheckCachedMatches(set, &w, cached, nb_cached))
+					nb_cached = -1;
+			}
+			if (nb_cached >= 0) {
+				if (!tree_scan)
+					lprintf(stdout, "Using cached match offsets\n");
+				patched = AddCachedEdits(set, cached, nb_cached, &list);
+			} else {
+				if (nb_section_filters == 0) {
+					file_range.start = 0;
+					file_range.end = w.size;
+					nb_ranges = 1;
+				} else {
+					nb_ranges = GetSectionRanges(&w, section_filter, nb_section_filters, &ranges);
+					if (nb_ranges < 0) {
+						lprintf(stderr, "Could not read the section headers of '%s'\n", filename);
+						__leave;
+					}
+					if (nb_ranges == 0 && !tree_scan)
+						lprintf(stdout, "None of the requested sections were found\n");
+				}
+				scan_ranges = (ranges == NULL) ? &file_range : ranges;
+				// The copy to the output, if any, is accounted for as part of the scan
+				patched = ScanAndCopyFile(&w, (hOutput != INVALID_HANDLE_VALUE) ? &out : NULL, scan_ranges, nb_ranges,
+					set, stop_early, &list);
+				copied = (hOutput != INVALID_HANDLE_VALUE);
+				for (i = 0; i < nb_ranges; i++)
+					stats->bytes_scanned += scan_ranges[i].end - scan_ranges[i].start;
+				// Must be recorded before the edits are applied, as they alter the fingerprint.
+				// A scan that stopped early didn't check the rest of the file, so it isn't cached.
+				if (has_key && patched >= 0 && !stop_early)
+					RecordMatches(key, &list);
+			}
+		}
+		stats->ticks[STAGE_SCAN] += GetTicks() - start;
+		if (patched > 0 && report != NULL && !AddReportEntries(report, &w, pImageNTHeader32, &list)) {
+			lprintf(stderr, "Could not record the matches for the report\n");
+			patched = -1;
+			__leave;
+		}
+		if (scan_only) {
+			if (patched >= 0 && !ReportEdits(&w, &list, filename))
+				patched = -1;
+			__leave;
 		}
+		// When writing to a separate output, the original file is its own backup
+		if (patched > 0 && backup_mode == BACKUP_DELTA && hOutput == INVALID_HANDLE_VALUE && !stdio_mode) {
+			start = GetTicks();
+			r = SaveDeltaBackup(filename, &w, &list);
+			stats->ticks[STAGE_BACKUP] += GetTicks() - start;
+			if (!r) {
+				lprintf(stderr, "Could not create delta backup of %s\n", filename);
+				patched = -1;
+				__leave;
+			}
+		}
+		if (patched > 0 && hOutput != INVALID_HANDLE_VALUE && !copied) {
+			// Pinned and cached edits don't read the whole source, so it is copied here
+			start = GetTicks();
+			for (pos = 0; pos < w.size; pos += len) {
+				len = (size_t)min(w.size - pos, WINDOW_SIZE);
+				src = MapFileWindow(&w, pos, len);
+				dst = MapFileWindow(&out, pos, len);
+				if (src == NULL || dst == NULL) {
+					patched = -1;
+					__leave;
+				}
+				memcpy(dst, src, len);
+			}
+			stats->ticks[STAGE_PATCH] += GetTicks() - start;
+		}
+		if (hOutput != INVALID_HANDLE_VALUE)
+			target = &out;
+		if (patched > 0) {
+			stats->nb_matches = patched;
+			start = GetTicks();
+			r = ApplyEdits(target, &list, checksum_offset, &delta);
+			stats->ticks[STAGE_PATCH] += GetTicks() - start;
+			if (!r) {
+				patched = -1;
+				__leave;
+			}
+			if (raw_mode)
+				__leave;
+			start = GetTicks();
+			r = UpdatePEImage(target, delta, verify_checksum, &update);
+			stats->ticks[STAGE_CHECKSUM] += GetTicks() - start;
+			if (r) {
+				if (update.nb_certs == 0)
+					lprintf(stdout, "No digital signature to remove\n");
+				else
+					lprintf(stdout, "Removed digital signature\n");
+				lprintf(stdout, "PE Checksum: %08X%s\n", update.new_checksum, update.incremental ? " (incremental)" : "");
+			} else {
+				patched = -1;
+			}
+		}
+	} __except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH) {
+		lprintf(stderr, "I/O error while accessing '%s'\n", filename);
+		patched = -1;
+	}
+
+	// A spooled stdin is read back through the cache, and discarded, so it's not worth flushing
+	if (patched > 0 && !scan_only && !stdio_mode) {
+		start = GetTicks();
+		if (!FlushFileWindow(target)) {
+			lprintf(stderr, "Could not flush patched data: Error %u\n", GetLastError());
+			patched = -1;
+		}
+		stats->ticks[STAGE_FLUSH] += GetTicks() - start;
 	}
 
+out:
+	free(ranges);
+	free(cached);
+	free(list.edits);
+	stats->nb_maps += w.nb_maps + out.nb_maps;
+	CloseFileWindow(&out);
+	CloseFileWindow(&w);
+
+	// The certificate table can only be dropped once the file is no longer mapped
+	if (patched > 0 && !scan_only && !raw_mode && update.new_size < (uint64_t)liSize.QuadPart) {
+		liSize.QuadPart = update.new_size;
+		if (hOutput != INVALID_HANDLE_VALUE)
+			hFile = hOutput;
+		if (buf != NULL) {
+			*buf_size = update.new_size;
+		} else if (!SetFilePointerEx(hFile, liSize, NULL, FILE_BEGIN) || !SetEndOfFile(hFile)) {
+			lprintf(stderr, "Could not truncate certificate table: Error %u\n", GetLastError());
+			patched = -1;
+		}
+	}
+	return patched;
+}
+
+/*
+ * Report the matches in a single file, without taking ownership, creating a backup
+ * or signing it. Returns the number of matches, or -1 on error.
+ */
+static int ScanOnlyFile(const char* path, const PATTERN_SET* set, FILE_STATS* stats, MATCH_REPORT* report)
+{
+	int found;
+	HANDLE hFile;
+	uint64_t start;
+
+	start = GetTicks();
+	hFile = CreateFileU(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+	stats->ticks[STAGE_OPEN] += GetTicks() - start;
+	if (hFile == INVALID_HANDLE_VALUE) {
+		lprintf(stderr, "Could not open '%s': Error %u\n", path, GetLastError());
+		return -1;
+	}
+	stats->nb_opens++;
+
+	found = ScanAndPatch(hFile, NULL, NULL, INVALID_HANDLE_VALUE, path, set, stats, report);
+	if (found < 0)
+		lprintf(stderr, "Could not scan '%s'\n", path);
 	safe_closehandle(hFile);
-	return dwNumCerts;
+	return found;
 }
 
-static BOOL UpdateChecksum(const char* filename, DWORD* dwCheckSum)
+/*
+ * Apply the embedded digital signature to a patched file, unless it is only covered
+ * by a catalog, and compute its catalog hash if needed.
+ */
+static BOOL SignPatchedFile(const char* path, HANDLE hFile, FILE_STATS* stats, CATALOG_HASH* hash)
 {
-	BOOL bRet = FALSE;
-	HANDLE hFile = NULL, hFileMapping = NULL;
-	PIMAGE_DOS_HEADER pImageDOSHeader = NULL;
-	PIMAGE_NT_HEADERS32 pImageNTHeader32 = NULL;
-	PIMAGE_NT_HEADERS64 pImageNTHeader64 = NULL;
+	uint64_t start;
+	BOOL r = TRUE;
+
+	start = GetTicks();
+	if (embed_signature) {
+		lprintf(stdout, "Applying digital signature...\n");
+		r = SignFile(signing_session, path, hFile);
+		if (!r)
+			lprintf(stderr, "Could not sign file\n");
+	}
+	// The hash leaves out the embedded signature, so it can be computed after signing
+	if (r && hash != NULL)
+		r = HashCatalogMember(path, hFile, hash);
+	stats->ticks[STAGE_SIGN] += GetTicks() - start;
+	return r;
+}
 
-	hFile = CreateFileU(filename, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
-		NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
-	if (hFile == NULL) {
-		fprintf(stderr, "Could not open file to update checksum: %u\n", GetLastError());
+/*
+ * Record the SHA-256 of a file, once it has been fully patched and signed, so that it
+ * can be checked with --verify.
+ */
+static BOOL RecordPatchedFile(HANDLE hFile, FILE_STATS* stats, HASH_RECORD* record)
+{
+	FILE_WINDOW w;
+	LARGE_INTEGER liSize;
+	uint64_t start;
+	BOOL r;
+
+	start = GetTicks();
+	if (!GetFileSizeEx(hFile, &liSize) || !OpenFileWindow(&w, hFile, liSize.QuadPart, FALSE))
 		return FALSE;
+	__try {
+		r = Sha256(&w, record->sha256);
+	} __except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH) {
+		r = FALSE;
+	}
+	stats->nb_maps += w.nb_maps;
+	CloseFileWindow(&w);
+	stats->ticks[STAGE_SIGN] += GetTicks() - start;
+	record->valid = r;
+	return r;
+}
+
+/*
+ * Patch a single file, and perform all the other operations that are needed
+ * to make it usable. If hash is not NULL, the catalog hash of the patched file
+ * is also computed, if record is not NULL, its SHA-256 is recorded, and if
+ * report is not NULL, the matches are added to it. Returns the number of elements patched, or -1 on error.
+ */
+static int PatchFile(const char* path, const PATTERN_SET* set, FILE_STATS* stats, CATALOG_HASH* hash,
+	HASH_RECORD* record, MATCH_REPORT* report)
+{
+	int patched = -1;
+	HANDLE hFile = INVALID_HANDLE_VALUE;
+	uint64_t start;
+	BOOL r;
+
+	if (_strnicmp(path, system_dir, strlen(system_dir)) == 0) {
+		lprintf(stderr, "Patching of active system files is prohibited!\n");
+		return -1;
+	}
+
+	start = GetTicks();
+	r = TakeOwnership(path);
+	stats->ticks[STAGE_OWNERSHIP] += GetTicks() - start;
+	if (!r) {
+		lprintf(stderr, "Could not take ownership of %s\n", path);
+		return -1;
+	}
+
+	start = GetTicks();
+	r = CreateBackup(path, backup_mode);
+	stats->ticks[STAGE_BACKUP] += GetTicks() - start;
+	if (!r) {
+		lprintf(stderr, "Could not create backup of %s\n", path);
+		return -1;
+	}
+
+	// The same handle is used for patching, post-processing and signing
+	start = GetTicks();
+	hFile = CreateFileU(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ,
+		NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+	stats->ticks[STAGE_OPEN] += GetTicks() - start;
+	if (hFile == INVALID_HANDLE_VALUE) {
+		lprintf(stderr, "Could not open '%s': Error %u\n", path, GetLastError());
+		return -1;
+	}
+	stats->nb_opens++;
+
+	patched = ScanAndPatch(hFile, NULL, NULL, INVALID_HANDLE_VALUE, path, set, stats, report);
+	if (patched < 0) {
+		lprintf(stderr, "Could not patch '%s'\n", path);
+		goto out;
+	}
+	if (patched == 0) {
+		lprintf(stdout, "No elements were patched - aborting\n");
+		goto out;
+	}
+
+	if (!raw_mode && !SignPatchedFile(path, hFile, stats, hash)) {
+		patched = -1;
+		goto out;
+	}
+	if (record != NULL && !RecordPatchedFile(hFile, stats, record)) {
+		lprintf(stderr, "Could not hash patched file\n");
+		patched = -1;
+		goto out;
+	}
+	lprintf(stdout, "Successfully patched '%s'\n", path);
+
+out:
+	safe_closehandle(hFile);
+	return patched;
+}
+
+/*
+ * Write a patched copy of a file to output, and sign it. The original file is only read
+ * once, by the scan, and left untouched, so it serves as the backup. The copy is written
+ * under a temporary name, and only replaces output once it has been fully patched and
+ * signed, so that an existing output is left alone if anything fails, or if there is
+ * nothing to patch. Returns the number of elements patched, or -1 on error.
+ */
+static int PatchToOutput(const char* path, const char* output, const PATTERN_SET* set, FILE_STATS* stats,
+	CATALOG_HASH* hash, HASH_RECORD* record, MATCH_REPORT* report)
+{
+	int patched = -1;
+	HANDLE hFile = INVALID_HANDLE_VALUE, hOutput = INVALID_HANDLE_VALUE;
+	char temp_path[MAX_PATH + 4];
+	uint64_t start;
+	BOOL created = FALSE;
+
+	if (_strnicmp(output, system_dir, strlen(system_dir)) == 0) {
+		lprintf(stderr, "Writing to the active system directory is prohibited!\n");
+		return -1;
+	}
+	if (strlen(output) >= MAX_PATH) {
+		lprintf(stderr, "Output path '%s' is too long\n", output);
+		return -1;
+	}
+	sprintf_s(temp_path, sizeof(temp_path), "%s.tmp", output);
+
+	start = GetTicks();
+	hFile = CreateFileU(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+	stats->ticks[STAGE_OPEN] += GetTicks() - start;
+	if (hFile == INVALID_HANDLE_VALUE) {
+		lprintf(stderr, "Could not open '%s': Error %u\n", path, GetLastError());
+		return -1;
+	}
+	stats->nb_opens++;
+
+	// The same handle is used for writing, post-processing and signing the output
+	start = GetTicks();
+	hOutput = CreateFileU(temp_path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ,
+		NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+	stats->ticks[STAGE_OPEN] += GetTicks() - start;
+	if (hOutput == INVALID_HANDLE_VALUE) {
+		lprintf(stderr, "Could not create '%s': Error %u\n", temp_path, GetLastError());
+		goto out;
 	}
+	created = TRUE;
+	stats->nb_opens++;
 
-	hFileMapping = CreateFileMapping(hFile, NULL, PAGE_READWRITE, 0, 0, NULL);
-	if (hFileMapping == NULL) {
-		fprintf(stderr, "Could not create file mapping to update checksum: Error %u\n", GetLastError());
+	patched = ScanAndPatch(hFile, NULL, NULL, hOutput, path, set, stats, report);
+	if (patched < 0) {
+		lprintf(stderr, "Could not patch '%s'\n", path);
+		goto out;
+	}
+	if (patched == 0) {
+		lprintf(stdout, "No elements were patched - aborting\n");
 		goto out;
 	}
 
-	pImageDOSHeader = (PIMAGE_DOS_HEADER)MapViewOfFile(hFileMapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
-	if (pImageDOSHeader == NULL) {
-		fprintf(stderr, "Could not get mapped view address to update checksum: Error %u\n", GetLastError());
+	if (!raw_mode && !SignPatchedFile(temp_path, hOutput, stats, hash)) {
+		patched = -1;
 		goto out;
 	}
-	if (pImageDOSHeader->e_magic != IMAGE_DOS_SIGNATURE) {
-		fprintf(stderr, "DOS header not found\n");
+	if (record != NULL && !RecordPatchedFile(hOutput, stats, record)) {
+		lprintf(stderr, "Could not hash patched file\n");
+		patched = -1;
 		goto out;
 	}
-	pImageNTHeader32 = (PIMAGE_NT_HEADERS32)((uintptr_t)pImageDOSHeader + pImageDOSHeader->e_lfanew);
-	if (pImageNTHeader32->Signature != IMAGE_NT_SIGNATURE) {
-		fprintf(stderr, "NT header not found\n");
+
+out:
+	safe_closehandle(hOutput);
+	safe_closehandle(hFile);
+	if (patched > 0) {
+		if (MoveFileExU(temp_path, output, MOVEFILE_REPLACE_EXISTING)) {
+			lprintf(stdout, "Successfully wrote patched '%s' to '%s'\n", path, output);
+		} else {
+			lprintf(stderr, "Could not replace '%s': Error %u\n", output, GetLastError());
+			patched = -1;
+		}
+	}
+	// Don't leave an incomplete or unpatched copy behind
+	if (patched <= 0 && created)
+		DeleteFileU(temp_path);
+	return patched;
+}
+
+/*
+ * Write size bytes from buf to hDst, in chunks that pipes can take.
+ */
+static BOOL WriteStream(HANDLE hDst, const uint8_t* buf, uint64_t size)
+{
+	uint64_t pos;
+	DWORD len, written;
+
+	for (pos = 0; pos < size; pos += len) {
+		len = (DWORD)min(size - pos, STDIO_BUFFER_SIZE);
+		if (!WriteFile(hDst, &buf[pos], len, &written, NULL) || written != len) {
+			lprintf(stderr, "Write error: Error %u\n", GetLastError());
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * Copy everything from hSrc, until the end of the file or pipe, to hDst.
+ */
+static BOOL CopyStream(HANDLE hSrc, HANDLE hDst, uint8_t* buf, DWORD buf_size)
+{
+	DWORD size;
+
+	while (TRUE) {
+		if (!ReadFile(hSrc, buf, buf_size, &size, NULL)) {
+			// This is how the end of a pipe is reported
+			if (GetLastError() == ERROR_BROKEN_PIPE)
+				return TRUE;
+			lprintf(stderr, "Read error: Error %u\n", GetLastError());
+			return FALSE;
+		}
+		if (size == 0)
+			return TRUE;
+		if (!WriteStream(hDst, buf, size))
+			return FALSE;
+	}
+}
+
+/*
+ * Read from hSrc into buf, which has max_size bytes of address space reserved, until
+ * either the end of the file or pipe, in which case *eof is set, or max_size bytes have
+ * been read. The memory is only committed as it gets filled, and max_size must be a
+ * multiple of STDIO_BUFFER_SIZE.
+ */
+static BOOL ReadStream(HANDLE hSrc, uint8_t* buf, uint64_t max_size, uint64_t* size, BOOL* eof)
+{
+	uint64_t committed = 0;
+	DWORD len;
+
+	*size = 0;
+	*eof = FALSE;
+	while (*size < max_size) {
+		if (*size == committed) {
+			if (VirtualAlloc(&buf[committed], STDIO_BUFFER_SIZE, MEM_COMMIT, PAGE_READWRITE) == NULL) {
+				lprintf(stderr, "Could not allocate memory: Error %u\n", GetLastError());
+				return FALSE;
+			}
+			committed += STDIO_BUFFER_SIZE;
+		}
+		if (!ReadFile(hSrc, &buf[*size], (DWORD)(committed - *size), &len, NULL)) {
+			// This is how the end of a pipe is reported
+			if (GetLastError() != ERROR_BROKEN_PIPE) {
+				lprintf(stderr, "Read error: Error %u\n", GetLastError());
+				return FALSE;
+			}
+			len = 0;
+		}
+		if (len == 0) {
+			*eof = TRUE;
+			break;
+		}
+		*size += len;
+	}
+	return TRUE;
+}
+
+/*
+ * Patch an image read from stdin, and write the result to stdout. The PE checksum and
+ * Security directory, at the beginning of the image, can only be updated once all of it
+ * has been scanned, and a pipe can't be rewound, so the data has to be held somewhere.
+ * Images of up to STDIO_MEMORY_LIMIT are read into memory, and patched there, through
+ * the same scan and patch engine as files. Larger ones are spooled into a temporary file,
+ * that is flagged to remain in the system cache and be deleted once closed, so that,
+ * unless memory runs short, it never gets written to disk, and that is then processed
+ * through the same mapping windows as any other file, so memory use remains bounded
+ * regardless of the size of the image. Since the output is a stream, it can't be signed.
+ * Returns the number of elements patched, or -1 on error.
+ */
+static int PatchStdio(const PATTERN_SET* set, FILE_STATS* stats, MATCH_REPORT* report)
+{
+	int patched = -1;
+	HANDLE hTemp = INVALID_HANDLE_VALUE;
+	HANDLE hInput = GetStdHandle(STD_INPUT_HANDLE), hOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+	char temp_dir[MAX_PATH], temp_path[MAX_PATH];
+	uint8_t *mem = NULL, *buf = NULL;
+	LARGE_INTEGER liZero = { 0 };
+	uint64_t size, start;
+	BOOL eof, r;
+
+	if (hInput == INVALID_HANDLE_VALUE || hOutput == INVALID_HANDLE_VALUE) {
+		lprintf(stderr, "Could not access stdin or stdout\n");
+		return -1;
+	}
+	// Only the address space is reserved, as most images are much smaller than the limit
+	mem = VirtualAlloc(NULL, STDIO_MEMORY_LIMIT, MEM_RESERVE, PAGE_READWRITE);
+	if (mem == NULL) {
+		lprintf(stderr, "Could not allocate memory: Error %u\n", GetLastError());
+		return -1;
+	}
+	if (!ReadStream(hInput, mem, STDIO_MEMORY_LIMIT, &size, &eof)) {
+		lprintf(stderr, "Could not read stdin\n");
 		goto out;
 	}
 
-	switch (pImageNTHeader32->FileHeader.Machine) {
-	case IMAGE_FILE_MACHINE_IA64:
-	case IMAGE_FILE_MACHINE_ALPHA64:
-	case IMAGE_FILE_MACHINE_AMD64:
-	case IMAGE_FILE_MACHINE_ARM64:
-		pImageNTHeader64 = (PIMAGE_NT_HEADERS64)pImageNTHeader32;
-		if (pImageNTHeader64->OptionalHeader.CheckSum != dwCheckSum[0]) {
-			fprintf(stderr, "Old checksum does not match! Is this a 64-bit executable?");
+	if (!eof) {
+		// Too large to be patched in memory, so spool what we have, and the rest, to a file
+		buf = malloc(STDIO_BUFFER_SIZE);
+		if (buf == NULL)
+			goto out;
+		start = GetTicks();
+		if (GetTempPathU(sizeof(temp_dir), temp_dir) == 0 || GetTempFileNameU(temp_dir, "wpt", 0, temp_path) == 0) {
+			lprintf(stderr, "Could not get temporary file name: Error %u\n", GetLastError());
+			goto out;
+		}
+		hTemp = CreateFileU(temp_path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+			FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, 0);
+		stats->ticks[STAGE_OPEN] += GetTicks() - start;
+		if (hTemp == INVALID_HANDLE_VALUE) {
+			lprintf(stderr, "Could not create temporary file: Error %u\n", GetLastError());
+			DeleteFileU(temp_path);
 			goto out;
 		}
-		pImageNTHeader64->OptionalHeader.CheckSum = dwCheckSum[1];
-		fprintf(stdout, "64-bit checksum updated\n");
-		break;
-	default:
-		if (pImageNTHeader32->OptionalHeader.CheckSum != dwCheckSum[0]) {
-			fprintf(stderr, "Old checksum does not match! Is this a 32-bit executable?");
+		stats->nb_opens++;
+		if (!WriteStream(hTemp, mem, size) || !CopyStream(hInput, hTemp, buf, STDIO_BUFFER_SIZE)) {
+			lprintf(stderr, "Could not read stdin\n");
 			goto out;
 		}
-		pImageNTHeader32->OptionalHeader.CheckSum = dwCheckSum[1];
-		fprintf(stdout, "32-bit checksum updated\n");
-		break;
+		VirtualFree(mem, 0, MEM_RELEASE);
+		mem = NULL;
+	}
+
+	patched = ScanAndPatch(hTemp, mem, &size, INVALID_HANDLE_VALUE, "<stdin>", set, stats, report);
+	if (patched < 0) {
+		lprintf(stderr, "Could not patch stdin\n");
+		goto out;
+	}
+	// Unpatched images are passed through unchanged
+	if (mem != NULL)
+		r = WriteStream(hOutput, mem, size);
+	else
+		r = SetFilePointerEx(hTemp, liZero, NULL, FILE_BEGIN) && CopyStream(hTemp, hOutput, buf, STDIO_BUFFER_SIZE);
+	if (!r) {
+		lprintf(stderr, "Could not write stdout\n");
+		patched = -1;
+		goto out;
 	}
-	bRet = TRUE;
+	if (patched == 0)
+		lprintf(stdout, "No elements were patched\n");
 
 out:
-	if (pImageDOSHeader != NULL)
-		UnmapViewOfFile(pImageDOSHeader);
-	safe_closehandle(hFileMapping);
-	safe_closehandle(hFile);
-	return bRet;
+	safe_closehandle(hTemp);
+	if (mem != NULL)
+		VirtualFree(mem, 0, MEM_RELEASE);
+	free(buf);
+	return patched;
 }
 
-static int main_utf8(int argc, char** argv)
+/*
+ * Check a patched file against the SHA-256 that was recorded when it was patched and,
+ * unless in raw mode, check that its PE checksum is valid and that it is signed, all
+ * in a single sequential pass over the file. Returns 1 if the file passes, or -1 if
+ * it doesn't, or can't be read.
+ */
+static int VerifyFile(const char* path, const HASH_RECORD* record, FILE_STATS* stats)
 {
-	FILE* file = NULL;
-	DWORD r, dwCheckSum[2];
-	int i, patched = 0;
-	uint64_t* patch, val, pos;
-	char system_dir[128];
-
-	if (!IsCurrentProcessElevated()) {
-		fprintf(stderr, "This command must be run from an elevated prompt.\n");
+	int r = -1;
+	HANDLE hFile;
+	FILE_WINDOW w = { 0 };
+	LARGE_INTEGER liSize;
+	IMAGE_CHECK check;
+	uint64_t start;
+	BOOL ok;
+
+	start = GetTicks();
+	hFile = CreateFileU(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+	stats->ticks[STAGE_OPEN] += GetTicks() - start;
+	if (hFile == INVALID_HANDLE_VALUE) {
+		lprintf(stderr, "Could not open '%s': Error %u\n", path, GetLastError());
 		return -1;
 	}
+	stats->nb_opens++;
+	if (!GetFileSizeEx(hFile, &liSize) || liSize.QuadPart == 0) {
+		lprintf(stdout, "FAIL: '%s' is empty\n", path);
+		goto out;
+	}
 
-	if (argc < 2) {
-		fprintf(stderr, "Usage: %s filename [QWORD QWORD [QWORD QWORD]...].\n", appname(argv[0]));
-		fprintf(stderr, "The QWORDs *must* be aligned to 64-bit.\n");
-		return -2;
+	start = GetTicks();
+	ok = OpenFileWindow(&w, hFile, liSize.QuadPart, FALSE);
+	stats->ticks[STAGE_MAP] += GetTicks() - start;
+	if (!ok)
+		goto out;
+	start = GetTicks();
+	__try {
+		ok = CheckImage(&w, &check);
+	} __except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH) {
+		ok = FALSE;
+	}
+	stats->ticks[STAGE_SCAN] += GetTicks() - start;
+	stats->bytes_scanned += w.size;
+	if (!ok) {
+		lprintf(stderr, "Could not read '%s'\n", path);
+		goto out;
 	}
 
-	fprintf(stderr, "%s %s © 2020 Pete Batard <pete@akeo.ie>\n\n",
-		appname(argv[0]), APP_VERSION_STR);
+	r = 1;
+	if (memcmp(check.sha256, record->sha256, SHA256_DIGEST_SIZE) != 0) {
+		lprintf(stdout, "FAIL: SHA-256 differs from the one recorded when patching\n");
+		r = -1;
+	}
+	if (!raw_mode) {
+		if (!check.pe) {
+			lprintf(stdout, "FAIL: Not a valid PE image\n");
+			r = -1;
+		} else if (check.checksum != check.computed_checksum) {
+			lprintf(stdout, "FAIL: PE checksum is %08X, but should be %08X\n", check.checksum, check.computed_checksum);
+			r = -1;
+		}
+		// Files that are only covered by a catalog have no embedded signature
+		if (check.pe && embed_signature && !check.has_signature) {
+			lprintf(stdout, "FAIL: No digital signature\n");
+			r = -1;
+		}
+	}
+	if (r > 0)
+		lprintf(stdout, "PASS: '%s'\n", path);
 
-	if (GetSystemDirectoryU(system_dir, sizeof(system_dir)) == 0)
-		static_strcpy(system_dir, "C:\\Windows\\System32");
-	if (_strnicmp(argv[1], system_dir, strlen(system_dir)) == 0) {
-		fprintf(stderr, "Patching of active system files is prohibited!\n");
+out:
+	stats->nb_maps += w.nb_maps;
+	CloseFileWindow(&w);
+	safe_closehandle(hFile);
+	return r;
+}
+
+/*
+ * Put back the original content of a file that was patched, from its backup.
+ */
+static int RestorePatchedFile(const char* path)
+{
+	if (_strnicmp(path, system_dir, strlen(system_dir)) == 0) {
+		lprintf(stderr, "Restoring of active system files is prohibited!\n");
 		return -1;
 	}
+	return RestoreFile(path) ? 1 : -1;
+}
 
-	if (!TakeOwnership(argv[1])) {
-		fprintf(stderr, "Could not take ownership of %s\n", argv[1]);
-		return -1;
+static void FreeJobs(PATCH_JOB* jobs, int nb_jobs, const PATTERN_SET* default_set)
+{
+	int i;
+
+	if (jobs == NULL)
+		return;
+	for (i = 0; i < nb_jobs; i++) {
+		free(jobs[i].path);
+		free(jobs[i].output);
+		if (jobs[i].set != default_set)
+			FreePatternSet(jobs[i].set);
 	}
+	free(jobs);
+}
 
-	if (!CreateBackup(argv[1])) {
-		fprintf(stderr, "Could not create backup of %s\n", argv[1]);
-		return -1;
+static int CompareTargets(const void* a, const void* b)
+{
+	return _stricmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+/*
+ * Check that no two jobs write to the same file, which their workers would otherwise
+ * clobber in parallel. With --output, this happens when batch entries from different
+ * directories have the same name. Returns FALSE, after listing them, if any do.
+ */
+static BOOL CheckUniqueTargets(const PATCH_JOB* jobs, int nb_jobs)
+{
+	const char** targets;
+	int i;
+	BOOL r = TRUE;
+
+	if (nb_jobs <= 1)
+		return TRUE;
+	targets = malloc(nb_jobs * sizeof(char*));
+	if (targets == NULL)
+		return FALSE;
+	for (i = 0; i < nb_jobs; i++)
+		targets[i] = (jobs[i].output != NULL) ? jobs[i].output : jobs[i].path;
+	qsort(targets, nb_jobs, sizeof(char*), CompareTargets);
+	for (i = 1; i < nb_jobs; i++) {
+		// Only report each duplicate once
+		if (_stricmp(targets[i - 1], targets[i]) == 0 && (i < 2 || _stricmp(targets[i - 2], targets[i]) != 0)) {
+			lprintf(stderr, "'%s' would be written by more than one batch entry\n", targets[i]);
+			r = FALSE;
+		}
 	}
+	free(targets);
+	return r;
+}
 
-	if (argc <= 2) {
-		fprintf(stderr, "No patch data provided!\n");
-		return -1;
+/*
+ * Read a batch list, where each line is a file path (double quoted if it contains
+ * spaces), optionally followed by the [ORIGINAL PATCHED] pairs to apply to that
+ * file. Lines that don't provide pairs use the ones from the command line.
+ * Empty lines and lines starting with '#' are ignored.
+ */
+static PATCH_JOB* ReadBatchList(const char* list, PATTERN_SET* default_set, int* nb_jobs)
+{
+	FILE* fd;
+	char line[4096], *p, *token[MAX_BATCH_TOKENS];
+	int i, nb_tokens, line_nr = 0;
+	PATCH_JOB *jobs = NULL, *new_jobs;
+
+	*nb_jobs = 0;
+	fd = fopenU(list, "r");
+	if (fd == NULL) {
+		lprintf(stderr, "Could not open batch list '%s'\n", list);
+		return NULL;
 	}
 
-	if (argc % 2) {
-		fprintf(stderr, "Values must be provided in [ORIGINAL PATCHED] pairs\n");
-		return -1;
+	while (fgets(line, sizeof(line), fd) != NULL) {
+		line_nr++;
+		p = line;
+		// Skip the UTF-8 BOM, if any
+		if (line_nr == 1 && memcmp(p, "\xef\xbb\xbf", 3) == 0)
+			p += 3;
+		for (nb_tokens = 0; nb_tokens < MAX_BATCH_TOKENS; nb_tokens++) {
+			while (isspaceU(*p))
+				p++;
+			if (*p == 0 || (nb_tokens == 0 && *p == '#'))
+				break;
+			if (*p == '"') {
+				token[nb_tokens] = ++p;
+				while (*p != 0 && *p != '"')
+					p++;
+			} else {
+				token[nb_tokens] = p;
+				while (*p != 0 && !isspaceU(*p))
+					p++;
+			}
+			if (*p != 0)
+				*p++ = 0;
+		}
+		if (nb_tokens == 0)
+			continue;
+		if (nb_tokens >= MAX_BATCH_TOKENS) {
+			lprintf(stderr, "%s:%d: Too many values\n", list, line_nr);
+			goto error;
+		}
+		if (nb_tokens == 1 && default_set == NULL && pinned_manifest == NULL && !restore) {
+			lprintf(stderr, "%s:%d: No patch data provided for '%s'\n", list, line_nr, token[0]);
+			goto error;
+		}
+		if (nb_tokens % 2 == 0) {
+			lprintf(stderr, "%s:%d: Values must be provided in [ORIGINAL PATCHED] pairs\n", list, line_nr);
+			goto error;
+		}
+
+		new_jobs = realloc(jobs, (*nb_jobs + 1) * sizeof(PATCH_JOB));
+		if (new_jobs == NULL) {
+			lprintf(stderr, "realloc error\n");
+			goto error;
+		}
+		jobs = new_jobs;
+		i = (*nb_jobs)++;
+		jobs[i].path = _strdup(token[0]);
+		jobs[i].output = NULL;
+		jobs[i].set = (nb_tokens == 1) ? default_set : CreatePatternSet(&token[1], nb_tokens - 1);
+		if (jobs[i].path == NULL || jobs[i].set == NULL) {
+			lprintf(stderr, "%s:%d: Could not create job for '%s'\n", list, line_nr, token[0]);
+			goto error;
+		}
 	}
+	fclose(fd);
+	if (*nb_jobs == 0)
+		lprintf(stderr, "No files to patch in '%s'\n", list);
+	return jobs;
+
+error:
+	fclose(fd);
+	FreeJobs(jobs, *nb_jobs, default_set);
+	*nb_jobs = 0;
+	return NULL;
+}
 
-	// We're not going to win prizes for speed, but who cares...
-	file = fopenU(argv[1], "rb+");
-	if (file == NULL) {
-		fprintf(stderr, "Could not open '%s'\n", argv[1]);
-		return -1;
+/*
+ * Create a job for every file under root, including its subdirectories, whose name
+ * matches glob. We only need the names, so the enumeration uses FindExInfoBasic, which
+ * doesn't look up the short names, along with large directory fetches. Reparse points
+ * are not followed, so that junctions can't send us looping through the same tree.
+ */
+static PATCH_JOB* EnumerateTree(const char* root, const char* glob, PATTERN_SET* set, int* nb_jobs)
+{
+	WIN32_FIND_DATAW fd;
+	HANDLE hFind;
+	char **dirs = NULL, **new_dirs, *name, *path = NULL;
+	wchar_t *wpattern, *wglob = NULL;
+	int i, nb_dirs = 0, max_dirs = 0, max_jobs = 0;
+	size_t len;
+	PATCH_JOB *jobs = NULL, *new_jobs;
+	BOOL r = FALSE, alloc_error = FALSE;
+
+	*nb_jobs = 0;
+	wglob = utf8_to_wchar(glob);
+	dirs = malloc(sizeof(char*));
+	path = _strdup(root);
+	if (wglob == NULL || dirs == NULL || path == NULL)
+		goto out;
+	// We add our own separators
+	for (len = strlen(path); len > 1 && (path[len - 1] == '\\' || path[len - 1] == '/'); len--)
+		path[len - 1] = 0;
+	dirs[nb_dirs++] = path;
+	max_dirs = 1;
+	path = NULL;
+
+	// Directories are enumerated in the order they are found
+	for (i = 0; i < nb_dirs; i++) {
+		len = strlen(dirs[i]) + 3;
+		path = malloc(len);
+		if (path == NULL)
+			goto out;
+		sprintf_s(path, len, "%s\\*", dirs[i]);
+		wpattern = utf8_to_wchar(path);
+		safe_free(path);
+		if (wpattern == NULL)
+			goto out;
+		hFind = FindFirstFileExW(wpattern, FindExInfoBasic, &fd, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+		free(wpattern);
+		if (hFind == INVALID_HANDLE_VALUE) {
+			// Inaccessible directories are reported, but don't abort the scan
+			lprintf(stderr, "Could not enumerate '%s': Error %u\n", dirs[i], GetLastError());
+			continue;
+		}
+		do {
+			if (wcscmp(fd.cFileName, L".") == 0 || wcscmp(fd.cFileName, L"..") == 0)
+				continue;
+			if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+				if (fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
+					continue;
+			} else if (!PathMatchSpecW(fd.cFileName, wglob)) {
+				continue;
+			}
+			name = wchar_to_utf8(fd.cFileName);
+			if (name == NULL) {
+				alloc_error = TRUE;
+				break;
+			}
+			len = strlen(dirs[i]) + strlen(name) + 2;
+			path = malloc(len);
+			if (path != NULL)
+				sprintf_s(path, len, "%s\\%s", dirs[i], name);
+			free(name);
+			if (path == NULL) {
+				alloc_error = TRUE;
+				break;
+			}
+			if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+				if (nb_dirs >= max_dirs) {
+					new_dirs = realloc(dirs, 2 * max_dirs * sizeof(char*));
+					if (new_dirs == NULL) {
+						alloc_error = TRUE;
+						break;
+					}
+					dirs = new_dirs;
+					max_dirs *= 2;
+				}
+				dirs[nb_dirs++] = path;
+			} else {
+				if (*nb_jobs >= max_jobs) {
+					max_jobs = (max_jobs == 0) ? 64 : 2 * max_jobs;
+					new_jobs = realloc(jobs, max_jobs * sizeof(PATCH_JOB));
+					if (new_jobs == NULL) {
+						alloc_error = TRUE;
+						break;
+					}
+					jobs = new_jobs;
+				}
+				memset(&jobs[*nb_jobs], 0, sizeof(PATCH_JOB));
+				jobs[*nb_jobs].path = path;
+				jobs[*nb_jobs].set = set;
+				(*nb_jobs)++;
+			}
+			path = NULL;
+		} while (FindNextFileW(hFind, &fd));
+		FindClose(hFind);
+		if (alloc_error)
+			goto out;
 	}
+	r = TRUE;
 
-	patch = calloc((size_t)argc - 2, sizeof(uint64_t));
-	if (patch == NULL) {
-		fprintf(stderr, "calloc error\n");
-		return -1;
+out:
+	free(path);
+	for (i = 0; i < nb_dirs; i++)
+		free(dirs[i]);
+	free(dirs);
+	free(wglob);
+	if (!r) {
+		lprintf(stderr, "Could not enumerate the files under '%s'\n", root);
+		FreeJobs(jobs, *nb_jobs, set);
+		*nb_jobs = 0;
+		return NULL;
 	}
+	if (*nb_jobs == 0) {
+		lprintf(stderr, "No files matching '%s' were found under '%s'\n", glob, root);
+		free(jobs);
+		return NULL;
+	}
+	return jobs;
+}
 
-	for (i = 0; i < argc - 2; i++)
-		patch[i] = strtoull(argv[i + 2], NULL, 16);
+static int PatchJob(void* ctx, int index)
+{
+	PATCH_JOB* jobs = (PATCH_JOB*)ctx;
+	uint64_t start = GetTicks();
+	int r;
+
+	AdvanceReadAhead(read_ahead, index);
+	if (jobs[index].nb_jobs > 1 && !tree_scan)
+		lprintf(stdout, "\n[%d/%d] %s\n", index + 1, jobs[index].nb_jobs, jobs[index].path);
+	if (restore)
+		r = RestorePatchedFile(jobs[index].path);
+	else if (scan_only)
+		r = ScanOnlyFile(jobs[index].path, jobs[index].set, jobs[index].stats, jobs[index].report);
+	else if (stdio_mode)
+		r = PatchStdio(jobs[index].set, jobs[index].stats, jobs[index].report);
+	else if (verify_mode)
+		r = VerifyFile(jobs[index].path, jobs[index].record, jobs[index].stats);
+	else if (jobs[index].output != NULL)
+		r = PatchToOutput(jobs[index].path, jobs[index].output, jobs[index].set, jobs[index].stats,
+			jobs[index].hash, jobs[index].record, jobs[index].report);
+	else
+		r = PatchFile(jobs[index].path, jobs[index].set, jobs[index].stats, jobs[index].hash,
+			jobs[index].record, jobs[index].report);
+	jobs[index].stats->total_ticks = GetTicks() - start;
+	return r;
+}
 
-	for (pos = 0; fread(&val, sizeof(uint64_t), 1, file) == 1; pos += sizeof(uint64_t)) {
-		for (i = 0; i < argc - 2; i += 2) {
-			if (val == patch[i]) {
-				fprintf(stdout, "%08llX: %016llX -> %016llX... ", pos, val, patch[i + 1]);
-				fseek(file, -1 * (long)sizeof(uint64_t), SEEK_CUR);
-				if (fwrite(&patch[i + 1], sizeof(uint64_t), 1, file) != 1) {
-					fprintf(stdout, "ERROR!\n");
-				} else {
-					fprintf(stdout, "SUCCESS\n");
-					patched++;
+static void PrintUsage(const char* app)
+{
+	lprintf(stderr, "Usage: %s filename [ORIGINAL PATCHED [ORIGINAL PATCHED]...].\n", app);
+	lprintf(stderr, "       %s --batch list [ORIGINAL PATCHED [ORIGINAL PATCHED]...].\n", app);
+	lprintf(stderr, "       %s --scan-tree directory glob ORIGINAL PATCHED [ORIGINAL PATCHED]...\n", app);
+	lprintf(stderr, "       %s --stdio [ORIGINAL PATCHED [ORIGINAL PATCHED]...] < input > output\n", app);
+	lprintf(stderr, "       %s --verify list\n", app);
+	lprintf(stderr, "ORIGINAL and PATCHED are either QWORDs, which *must* be aligned to 64-bit, or byte\n");
+	lprintf(stderr, "patterns, such as 48:8B:??:05, which can be at any offset and where ?? is a wildcard.\n");
+	lprintf(stderr, "Add @1, @2, @4 or @8 to ORIGINAL to require a different alignment, e.g. 48:8B:??:05@4.\n");
+	lprintf(stderr, "Add =N, <=N or >=N to ORIGINAL to set the number of matches a file must have, e.g. \"48:8B:??:05<=4\".\n");
+	lprintf(stderr, "Use --stop-early to stop scanning once all the pairs have their maximum number of matches.\n");
+	lprintf(stderr, "With --batch, each line of 'list' is a file path, optionally followed by\n");
+	lprintf(stderr, "the pairs to use for that file instead of the ones from the command line.\n");
+	lprintf(stderr, "Use --jobs N to set the number of files that are processed in parallel.\n");
+	lprintf(stderr, "Use --read-ahead to read the next files of a batch while the current ones are processed\n");
+	lprintf(stderr, "(this can't be used with --restore, which needs exclusive access to the files).\n");
+	lprintf(stderr, "Use --key rsa4096|rsa2048|ecdsa to select the signing key (default: rsa4096).\n");
+	lprintf(stderr, "Use --section name[,name...] to only patch data from specific PE sections.\n");
+	lprintf(stderr, "Use --cache-matches to cache match offsets in %%LOCALAPPDATA%%\\winpatch\\cache (or --cache DIR).\n");
+	lprintf(stderr, "Use --timings FILE to write per stage timings as CSV (*.csv) or JSON, or '-' for stdout.\n");
+	lprintf(stderr, "Use --report FILE to write the matches of each file as JSON, or '-' for stdout.\n");
+	lprintf(stderr, "Use --pinned manifest to patch known files at fixed offsets, without scanning them.\n");
+	lprintf(stderr, "Use --scan to only report the matches, without altering the files (no elevation required).\n");
+	lprintf(stderr, "With --scan-tree, all the files under 'directory' whose name matches 'glob' (e.g. *.sys)\n");
+	lprintf(stderr, "are scanned, and the ones that contain matches are reported.\n");
+	lprintf(stderr, "Use --backup full|clone|delta to select how the original files are backed up (default: full).\n");
+	lprintf(stderr, "Use --restore to put the original files back from their backups.\n");
+	lprintf(stderr, "Use --output PATH to write the patched file to PATH, instead of patching it in place.\n");
+	lprintf(stderr, "With --batch, PATH is the directory where the patched files are written.\n");
+	lprintf(stderr, "Use --catalog FILE to also create a signed catalog for all the patched files, and --no-embed\n");
+	lprintf(stderr, "to only have them covered by the catalog, without embedding a signature in each of them.\n");
+	lprintf(stderr, "With --stdio, the file is read from stdin, and the patched (unsigned) image written to stdout.\n");
+	lprintf(stderr, "Images of up to %d MB are patched in memory, and larger ones spooled to a temporary file.\n",
+		STDIO_MEMORY_LIMIT / (1024 * 1024));
+	lprintf(stderr, "Use --record FILE to write the SHA-256 of each patched file to FILE, once it has been signed.\n");
+	lprintf(stderr, "With --verify, the files from 'list' (as written by --record) are checked against their SHA-256,\n");
+	lprintf(stderr, "PE checksum and signature (no elevation required).\n");
+	lprintf(stderr, "Use --raw to patch files that aren't PE images, such as disk images, without signing them.\n");
+	lprintf(stderr, "Use --verify-checksum to always recompute the PE checksum over the whole file.\n");
+}
+
+static int main_utf8(int argc, char** argv)
+{
+	int i, patched = 0, nb_jobs = 0, nb_failed = 0, nb_threads = 0;
+	int* results = NULL;
+	FILE_STATS* stats = NULL;
+	CATALOG_HASH* hashes = NULL;
+	HASH_RECORD* records = NULL;
+	MATCH_REPORT* reports = NULL;
+	uint64_t start, wall_ticks, keygen_ticks;
+	const char *batch_list = NULL, *pinned_list = NULL, *cache_dir = NULL, *timings_path = NULL;
+	const char *tree_root = NULL, *tree_glob = NULL, *output_path = NULL, *catalog_path = NULL;
+	const char *record_path = NULL, *verify_path = NULL, *report_path = NULL;
+	size_t len;
+	char *token, *next = NULL, **catalog_names = NULL, **paths = NULL;
+	BOOL catalog_failed = FALSE, record_failed = FALSE, report_failed = FALSE, timings_failed = FALSE;
+	BOOL use_read_ahead = FALSE, patch_files;
+	SIGNING_KEY_TYPE key_type = KEY_RSA4096;
+	PATTERN_SET* set = NULL;
+	PATCH_JOB* jobs = NULL;
+
+	for (i = 1; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+		if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+			batch_list = argv[++i];
+		} else if (strcmp(argv[i], "--key") == 0 && i + 1 < argc) {
+			i++;
+			if (_stricmp(argv[i], "rsa4096") == 0) {
+				key_type = KEY_RSA4096;
+			} else if (_stricmp(argv[i], "rsa2048") == 0) {
+				key_type = KEY_RSA2048;
+			} else if (_stricmp(argv[i], "ecdsa") == 0) {
+				key_type = KEY_ECDSA_P256;
+			} else {
+				lprintf(stderr, "Invalid key type '%s'\n", argv[i]);
+				return -2;
+			}
+		} else if (strcmp(argv[i], "--section") == 0 && i + 1 < argc) {
+			// Sections can be provided as a comma separated list, or with multiple --section
+			for (token = strtok_s(argv[++i], ",", &next); token != NULL; token = strtok_s(NULL, ",", &next)) {
+				if (nb_section_filters >= MAX_SECTION_FILTERS) {
+					lprintf(stderr, "Too many sections specified\n");
+					return -2;
 				}
-				fflush(file);
+				section_filter[nb_section_filters++] = token;
+			}
+		} else if (strcmp(argv[i], "--pinned") == 0 && i + 1 < argc) {
+			pinned_list = argv[++i];
+		} else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+			cache_dir = argv[++i];
+			use_cache = TRUE;
+		} else if (strcmp(argv[i], "--timings") == 0 && i + 1 < argc) {
+			timings_path = argv[++i];
+		} else if (strcmp(argv[i], "--report") == 0 && i + 1 < argc) {
+			report_path = argv[++i];
+		} else if (strcmp(argv[i], "--cache-matches") == 0) {
+			use_cache = TRUE;
+		} else if (strcmp(argv[i], "--scan") == 0) {
+			scan_only = TRUE;
+		} else if (strcmp(argv[i], "--scan-tree") == 0 && i + 2 < argc) {
+			tree_root = argv[++i];
+			tree_glob = argv[++i];
+			scan_only = TRUE;
+			tree_scan = TRUE;
+		} else if (strcmp(argv[i], "--backup") == 0 && i + 1 < argc) {
+			i++;
+			if (_stricmp(argv[i], "full") == 0) {
+				backup_mode = BACKUP_FULL;
+			} else if (_stricmp(argv[i], "clone") == 0) {
+				backup_mode = BACKUP_CLONE;
+			} else if (_stricmp(argv[i], "delta") == 0) {
+				backup_mode = BACKUP_DELTA;
+			} else {
+				lprintf(stderr, "Invalid backup mode '%s'\n", argv[i]);
+				return -2;
 			}
+		} else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+			output_path = argv[++i];
+		} else if (strcmp(argv[i], "--restore") == 0) {
+			restore = TRUE;
+		} else if (strcmp(argv[i], "--catalog") == 0 && i + 1 < argc) {
+			catalog_path = argv[++i];
+		} else if (strcmp(argv[i], "--no-embed") == 0) {
+			embed_signature = FALSE;
+		} else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+			record_path = argv[++i];
+		} else if (strcmp(argv[i], "--verify") == 0 && i + 1 < argc) {
+			verify_path = argv[++i];
+			verify_mode = TRUE;
+		} else if (strcmp(argv[i], "--stdio") == 0) {
+			stdio_mode = TRUE;
+		} else if (strcmp(argv[i], "--stop-early") == 0) {
+			stop_early = TRUE;
+		} else if (strcmp(argv[i], "--raw") == 0) {
+			raw_mode = TRUE;
+		} else if (strcmp(argv[i], "--verify-checksum") == 0) {
+			verify_checksum = TRUE;
+		} else if (strcmp(argv[i], "--read-ahead") == 0) {
+			use_read_ahead = TRUE;
+		} else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+			nb_threads = atoi(argv[++i]);
+			if (nb_threads <= 0) {
+				lprintf(stderr, "Invalid number of jobs '%s'\n", argv[i]);
+				return -2;
+			}
+		} else {
+			PrintUsage(appname(argv[0]));
+			return -2;
 		}
 	}
-	free(patch);
-	fclose(file);
-	if (patched == 0) {
-		fprintf(stdout, "No elements were patched - aborting\n");
-		return 0;
+
+	if ((batch_list == NULL && tree_root == NULL && !stdio_mode && !verify_mode && i >= argc) || (batch_list != NULL && tree_root != NULL) ||
+		(restore && scan_only) || (output_path != NULL && (restore || scan_only)) ||
+		(raw_mode && nb_section_filters > 0) || (use_read_ahead && restore) || (!embed_signature && catalog_path == NULL && !verify_mode) ||
+		(catalog_path != NULL && (restore || scan_only || raw_mode)) ||
+		(stdio_mode && (batch_list != NULL || tree_root != NULL || restore || scan_only || output_path != NULL ||
+		catalog_path != NULL || (timings_path != NULL && strcmp(timings_path, "-") == 0) ||
+		(report_path != NULL && strcmp(report_path, "-") == 0))) ||
+		(report_path != NULL && (restore || verify_mode)) ||
+		(record_path != NULL && (restore || scan_only || stdio_mode)) ||
+		(verify_mode && (batch_list != NULL || tree_root != NULL || restore || scan_only || output_path != NULL ||
+		catalog_path != NULL || stdio_mode || record_path != NULL || i < argc))) {
+		PrintUsage(appname(argv[0]));
+		return -2;
 	}
 
-	// Since the whole point is to alter the file, remove the digital signature
-	r = RemoveDigitalSignature(argv[1]);
-	switch (r) {
-	case 0:
-		fprintf(stdout, "No digital signature to remove\n");
-		break;
-	case 1:
-		fprintf(stdout, "Removed digital signature\n");
-		break;
-	default:
-		fprintf(stderr, "Could not remove digital signature\n");
+	// Reporting matches, verifying, or patching a stream, does not alter any file, so it doesn't need elevation
+	if (!scan_only && !stdio_mode && !verify_mode && !IsCurrentProcessElevated()) {
+		lprintf(stderr, "This command must be run from an elevated prompt.\n");
 		return -1;
 	}
+	if (stdio_mode)
+		ReserveStdout();
+
+	lprintf(stderr, "%s %s © 2020 Pete Batard <pete@akeo.ie>\n\n",
+		appname(argv[0]), APP_VERSION_STR);
 
-	r = MapFileAndCheckSumU(argv[1], &dwCheckSum[0], &dwCheckSum[1]);
-	if (r != CHECKSUM_SUCCESS) {
-		fprintf(stderr, "Could not compute checksum: %u\n", r);
+	if (GetSystemDirectoryU(system_dir, sizeof(system_dir)) == 0)
+		static_strcpy(system_dir, "C:\\Windows\\System32");
+	if (catalog_path != NULL && _strnicmp(catalog_path, system_dir, strlen(system_dir)) == 0) {
+		lprintf(stderr, "Writing to the active system directory is prohibited!\n");
 		return -1;
 	}
 
-	fprintf(stdout, "PE Checksum: %08X\n", dwCheckSum[1]);
-	if (dwCheckSum[0] != dwCheckSum[1] && !UpdateChecksum(argv[1], dwCheckSum)) {
-		fprintf(stderr, "Could not update checksum\n");
-		return -1;
+	// The cache is an optimization, so we carry on without it if it can't be set up
+	if (use_cache && !InitMatchCache(cache_dir))
+		use_cache = FALSE;
+
+	if (pinned_list != NULL) {
+		pinned_manifest = ReadPinnedManifest(pinned_list);
+		if (pinned_manifest == NULL)
+			return -1;
 	}
 
-	fprintf(stdout, "Applying digital signature...\n");
-	if (!SelfSignFile(argv[1], "CN = Test Signing Certificate")) {
-		fprintf(stderr, "Could not sign file\n");
+	// Everything that follows the file name (or the batch list or tree) is patch data,
+	// which is optional when a pinned manifest is provided, and unused when restoring or verifying
+	if (batch_list == NULL && tree_root == NULL && !stdio_mode && !verify_mode)
+		i++;
+	if (batch_list == NULL && i >= argc && pinned_manifest == NULL && !restore && !verify_mode) {
+		lprintf(stderr, "No patch data provided!\n");
 		return -1;
 	}
-	fprintf(stdout, "Successfully patched '%s'\n", argv[1]);
+	if ((argc - i) % 2) {
+		lprintf(stderr, "Values must be provided in [ORIGINAL PATCHED] pairs\n");
+		goto error;
+	}
+	if (i < argc) {
+		set = CreatePatternSet(&argv[i], argc - i);
+		if (set == NULL) {
+			lprintf(stderr, "Could not create pattern set\n");
+			goto error;
+		}
+	}
 
-	return patched;
+	if (batch_list != NULL) {
+		jobs = ReadBatchList(batch_list, set, &nb_jobs);
+		if (jobs == NULL)
+			goto error;
+	} else if (tree_root != NULL) {
+		jobs = EnumerateTree(tree_root, tree_glob, set, &nb_jobs);
+		if (jobs == NULL)
+			goto error;
+	} else if (verify_mode) {
+		records = ReadHashRecords(verify_path, &nb_jobs);
+		if (records == NULL)
+			goto error;
+		jobs = calloc(nb_jobs, sizeof(PATCH_JOB));
+		if (jobs == NULL) {
+			FreeHashRecords(records, nb_jobs);
+			goto error;
+		}
+		// The jobs take ownership of the paths
+		for (i = 0; i < nb_jobs; i++) {
+			jobs[i].path = records[i].path;
+			jobs[i].record = &records[i];
+			records[i].path = NULL;
+		}
+	} else {
+		jobs = calloc(1, sizeof(PATCH_JOB));
+		if (jobs == NULL)
+			goto error;
+		jobs[0].path = _strdup(stdio_mode ? "<stdin>" : argv[i - 1]);
+		if (jobs[0].path == NULL) {
+			free(jobs);
+			goto error;
+		}
+		jobs[0].set = set;
+		nb_jobs = 1;
+	}
+
+	results = calloc(nb_jobs, sizeof(int));
+	stats = calloc(nb_jobs, sizeof(FILE_STATS));
+	if (catalog_path != NULL) {
+		hashes = calloc(nb_jobs, sizeof(CATALOG_HASH));
+		catalog_names = calloc(nb_jobs, sizeof(char*));
+	}
+	if (record_path != NULL)
+		records = calloc(nb_jobs, sizeof(HASH_RECORD));
+	if (report_path != NULL)
+		reports = calloc(nb_jobs, sizeof(MATCH_REPORT));
+	if (results == NULL || stats == NULL || (catalog_path != NULL && (hashes == NULL || catalog_names == NULL)) ||
+		((record_path != NULL || verify_mode) && records == NULL) || (report_path != NULL && reports == NULL)) {
+		free(results);
+		free(stats);
+		free(hashes);
+		free(catalog_names);
+		free(records);
+		free(reports);
+		FreeJobs(jobs, nb_jobs, set);
+		goto error;
+	}
+	for (i = 0; i < nb_jobs; i++) {
+		jobs[i].nb_jobs = nb_jobs;
+		jobs[i].stats = &stats[i];
+		// With a batch, the output is a directory, where the files keep their names
+		if (output_path != NULL) {
+			len = strlen(output_path) + strlen(jobs[i].path) + 2;
+			jobs[i].output = malloc(len);
+			if (jobs[i].output == NULL) {
+				free(results);
+				free(stats);
+				free(hashes);
+				free(catalog_names);
+				free(records);
+				free(reports);
+				FreeJobs(jobs, nb_jobs, set);
+				goto error;
+			}
+			if (batch_list == NULL)
+				strcpy_s(jobs[i].output, len, output_path);
+			else
+				sprintf_s(jobs[i].output, len, "%s\\%s", output_path, PathFindFileNameU(jobs[i].path));
+		}
+		if (catalog_path != NULL) {
+			jobs[i].hash = &hashes[i];
+			catalog_names[i] = (jobs[i].output != NULL) ? jobs[i].output : jobs[i].path;
+		}
+		if (report_path != NULL)
+			jobs[i].report = &reports[i];
+		if (record_path != NULL) {
+			jobs[i].record = &records[i];
+			records[i].path = (jobs[i].output != NULL) ? jobs[i].output : jobs[i].path;
+		}
+		stats[i].path = jobs[i].path;
+		results[i] = -1;
+	}
+	// Scanning and verifying don't write to the files
+	if (!scan_only && !verify_mode && !CheckUniqueTargets(jobs, nb_jobs)) {
+		free(results);
+		free(stats);
+		free(hashes);
+		free(catalog_names);
+		free(records);
+		free(reports);
+		FreeJobs(jobs, nb_jobs, set);
+		goto error;
+	}
+	if (nb_threads == 0)
+		nb_threads = GetDefaultNumberOfThreads();
+	if (nb_threads > nb_jobs)
+		nb_threads = nb_jobs;
+	// Each worker picks up a file straight away, so only larger batches can be read ahead.
+	// This is an optimization, so we carry on without it if it can't be set up.
+	if (use_read_ahead && nb_jobs > nb_threads) {
+		paths = calloc(nb_jobs, sizeof(char*));
+		if (paths != NULL) {
+			for (i = 0; i < nb_jobs; i++)
+				paths[i] = jobs[i].path;
+			read_ahead = StartReadAhead(paths, nb_jobs, nb_threads);
+		}
+	}
+
+	start = GetTicks();
+	InitMatcher();
+	InitializeCriticalSection(&ownership_lock);
+	// Only the files that get patched need to be owned, and signed
+	patch_files = !scan_only && !restore && !stdio_mode && !verify_mode;
+	if (patch_files && !raw_mode)
+		signing_session = OpenSigningSession("CN = Test Signing Certificate", key_type);
+	if (patch_files && !raw_mode && signing_session == NULL) {
+		lprintf(stderr, "Could not open signing session\n");
+	} else if (patch_files && !InitOwnership()) {
+		lprintf(stderr, "Could not set up the ownership DACL\n");
+	} else if (!RunJobs(nb_jobs, nb_threads, PatchJob, jobs, results)) {
+		lprintf(stderr, "Could not start worker threads\n");
+	}
+	StopReadAhead(read_ahead);
+	read_ahead = NULL;
+	free(paths);
+	for (i = 0; i < nb_jobs; i++) {
+		stats[i].result = results[i];
+		if (results[i] < 0)
+			nb_failed++;
+		else
+			patched += results[i];
+	}
+	// All the files that were patched are then covered by a single signing operation
+	if (catalog_path != NULL && signing_session != NULL) {
+		for (i = 0, len = 0; i < nb_jobs; i++) {
+			if (results[i] > 0 && hashes[i].len != 0)
+				len++;
+		}
+		if (len == 0) {
+			lprintf(stdout, "\nNo patched files to add to catalog '%s'\n", catalog_path);
+		} else if (CreateSignedCatalog(signing_session, catalog_path, catalog_names, hashes, nb_jobs)) {
+			lprintf(stdout, "\nCreated signed catalog '%s' for %d file(s)\n", catalog_path, (int)len);
+		} else {
+			lprintf(stderr, "\nCould not create signed catalog '%s'\n", catalog_path);
+			catalog_failed = TRUE;
+		}
+	}
+	// Only the files that were patched, and hashed, get a record
+	if (record_path != NULL) {
+		if (WriteHashRecords(record_path, records, nb_jobs))
+			lprintf(stdout, "\nRecorded the SHA-256 of the patched files in '%s'\n", record_path);
+		else
+			record_failed = TRUE;
+	}
+	keygen_ticks = GetKeyGenerationTicks(signing_session);
+	CloseSigningSession(signing_session);
+	FreeOwnership();
+	DeleteCriticalSection(&ownership_lock);
+	wall_ticks = GetTicks() - start;
+
+	if (nb_jobs > 1 || tree_scan) {
+		lprintf(stdout, "\nProcessed %d file(s): %d succeeded, %d failed\n", nb_jobs, nb_jobs - nb_failed, nb_failed);
+		if (scan_only)
+			lprintf(stdout, "Found %d match(es) in total\n", patched);
+		for (i = 0; i < nb_jobs; i++) {
+			if (results[i] < 0)
+				lprintf(stdout, "  FAILED: %s\n", jobs[i].path);
+			else if (scan_only && results[i] > 0)
+				lprintf(stdout, "  %d match(es): %s\n", results[i], jobs[i].path);
+		}
+	}
+
+	if (timings_path != NULL && !WriteTimings(timings_path, stats, nb_jobs, wall_ticks, keygen_ticks))
+		timings_failed = TRUE;
+	if (report_path != NULL && !WriteMatchReport(report_path, stats, reports, nb_jobs))
+		report_failed = TRUE;
+
+	free(results);
+	free(stats);
+	free(hashes);
+	free(catalog_names);
+	// The record paths, if any, are owned by the jobs
+	free(records);
+	FreeMatchReports(reports, nb_jobs);
+	FreeJobs(jobs, nb_jobs, set);
+	FreePatternSet(set);
+	FreePinnedManifest(pinned_manifest);
+	return (nb_failed != 0 || catalog_failed || record_failed || report_failed || timings_failed) ? -1 : patched;
+
+error:
+	FreePatternSet(set);
+	FreePinnedManifest(pinned_manifest);
+	return -1;
 }
 
 int wmain(int argc, wchar_t** argv16)
@@ -0,0 +1,346 @@
+/*
+ * winpatch - Windows system file patcher
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <windows.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#pragma once
+
+#include "libwinpatch.h"
+
+// Maximum length of a byte pattern
+#define MAX_PATTERN_LENGTH 256
+
+/*
+ * A byte pattern, provided as colon separated hex bytes, in file order, where "??"
+ * denotes a wildcard. A wildcard in ORIGINAL matches any byte, and a wildcard in
+ * PATCHED keeps the original byte.
+ */
+typedef struct {
+	uint32_t len;
+	uint32_t align;			// Required alignment of the match offset (1, 2, 4 or 8)
+	uint32_t anchor;		// Offset of the longest run of non wildcard bytes
+	uint32_t anchor_len;
+	BOOL qword;				// Whether this is one of the QWORD patterns from the set
+	uint32_t min_count;		// Number of matches a file must have
+	uint32_t max_count;		// Maximum number of matches, or UINT32_MAX for no limit
+	uint8_t* original;		// Wildcard bytes are set to 0
+	uint8_t* original_mask;	// 0xFF for bytes that must match, 0x00 for wildcards
+	uint8_t* patched;
+	uint8_t* patched_mask;	// 0xFF for bytes that must be written, 0x00 for wildcards
+} BYTE_PATTERN;
+
+typedef struct _BYTE_MATCHER BYTE_MATCHER;
+
+/*
+ * A compiled set of [ORIGINAL PATCHED] QWORD pairs. The ORIGINAL values are kept
+ * in their own contiguous array, so that they can be fed to vector compares, and
+ * are also indexed in an open addressing hash table, with a bitmap prefilter, so
+ * that lookup cost does not depend on the number of patterns.
+ * QWORDs that use a different alignment than 8 are searched for at each of the
+ * shifts that their alignment allows, from the same table.
+ * If the set also contains byte patterns, then the QWORD pairs are duplicated as
+ * byte patterns, and the whole set is searched by the byte matcher.
+ */
+struct _PATTERN_SET {
+	size_t nb_patterns;
+	uint64_t* original;
+	uint64_t* patched;
+	uint32_t* min_count;	// Number of matches a file must have, for each QWORD
+	uint32_t* max_count;	// Maximum number of matches, or UINT32_MAX for no limit
+	uint32_t* align;		// Required alignment of the match offset, for each QWORD
+	uint32_t min_align;		// Smallest alignment of the QWORDs
+	BOOL counted;			// Whether any pattern has a minimum or maximum number of matches
+	BOOL bounded;			// Whether all the patterns have a nonzero maximum number of matches
+	uint32_t table_bits;
+	uint32_t* table;		// Index + 1 of the pattern in original[], or 0 if empty
+	uint64_t* filter;		// 64K bit prefilter of the ORIGINAL values
+	size_t nb_byte_patterns;
+	BYTE_PATTERN* byte_patterns;
+	BYTE_MATCHER* matcher;
+};
+
+/* match.c */
+extern BOOL ParsePatternPair(const char* original, const char* patched, BYTE_PATTERN* pattern);
+extern void FreeBytePattern(BYTE_PATTERN* pattern);
+extern int LookupPattern(const PATTERN_SET* set, uint64_t val);
+extern size_t GetNumberOfPatterns(const PATTERN_SET* set);
+extern void GetPatternCounts(const PATTERN_SET* set, int pattern, uint32_t* min_count, uint32_t* max_count);
+extern size_t FindMatch(const PATTERN_SET* set, const uint64_t* data, size_t start, size_t count);
+extern size_t GetMatcherCutoff(void);
+extern void SetMatcherCutoff(size_t max_patterns);
+
+/* search.c */
+typedef BOOL (*MATCH_CALLBACK)(void* ctx, int pattern, uint64_t offset);
+
+extern BYTE_MATCHER* CreateByteMatcher(const BYTE_PATTERN* patterns, size_t nb_patterns);
+extern void FreeByteMatcher(BYTE_MATCHER* matcher);
+extern BOOL SearchBytePatterns(const PATTERN_SET* set, const uint8_t* base, uint64_t start, uint64_t end,
+	MATCH_CALLBACK callback, void* ctx);
+
+/* window.c */
+// Size of the windows that large files are processed through
+#define WINDOW_SIZE (64 * 1024 * 1024)
+// Overlap between successive windows, so that the patterns that straddle two windows
+// can be found in the first one. This matches the allocation granularity of Windows.
+#define WINDOW_OVERLAP (64 * 1024)
+
+typedef struct {
+	HANDLE hFile;
+	HANDLE hMapping;		// NULL for a buffer that is already fully mapped
+	uint64_t size;
+	uint8_t* head;			// View of the beginning of the file, that remains mapped
+	size_t head_len;
+	uint8_t* data;			// View that slides along the rest of the file
+	uint64_t offset;
+	size_t len;
+	DWORD granularity;
+	DWORD access;
+	uint32_t nb_maps;
+} FILE_WINDOW;
+
+extern BOOL OpenFileWindow(FILE_WINDOW* w, HANDLE hFile, uint64_t size, BOOL writable);
+extern void InitMemoryWindow(FILE_WINDOW* w, uint8_t* base, uint64_t size);
+extern uint8_t* MapFileWindow(FILE_WINDOW* w, uint64_t offset, size_t len);
+extern BOOL FlushFileWindow(FILE_WINDOW* w);
+extern void CloseFileWindow(FILE_WINDOW* w);
+
+/* pe.c */
+// Checksum delta value indicating that the checksum must be fully recomputed
+#define CHECKSUM_DELTA_INVALID 0xFFFFFFFF
+
+// A [start, end) range of file offsets
+typedef struct {
+	uint64_t start;
+	uint64_t end;
+} SCAN_RANGE;
+
+extern PIMAGE_NT_HEADERS32 GetNtHeaders(uint8_t* base, uint64_t size);
+extern DWORD* GetCheckSumField(PIMAGE_NT_HEADERS32 pImageNTHeader32);
+extern PIMAGE_DATA_DIRECTORY GetSecurityDirectory(PIMAGE_NT_HEADERS32 pImageNTHeader32);
+extern int GetSectionRanges(FILE_WINDOW* w, char* const* names, int nb_names, SCAN_RANGE** ranges);
+extern BOOL GetSectionName(PIMAGE_NT_HEADERS32 pImageNTHeader32, uint64_t offset, char* name);
+extern uint32_t ChecksumBytes(const uint8_t* data, uint64_t offset, size_t len);
+extern DWORD ChecksumFinalize(uint32_t sum, DWORD dwField, uint64_t length);
+extern uint32_t ChecksumDelta(uint32_t delta, const uint8_t* old_data, const uint8_t* new_data, uint64_t offset, size_t len);
+extern BOOL UpdatePEImage(FILE_WINDOW* w, uint32_t delta, BOOL verify, PE_UPDATE* update);
+extern int GetPEUpdateRanges(FILE_WINDOW* w, SCAN_RANGE* ranges);
+
+/* cache.c */
+typedef struct {
+	uint64_t offset;
+	int pattern;			// Index in byte_patterns[] if the set has a byte matcher, or in original[]
+} CACHED_MATCH;
+
+extern BOOL InitMatchCache(const char* dir);
+extern BOOL GetCacheKey(FILE_WINDOW* w, const PATTERN_SET* set, char* const* sections, int nb_sections, uint64_t* key);
+extern int ReadMatchCache(uint64_t key, CACHED_MATCH** matches);
+extern void WriteMatchCache(uint64_t key, const CACHED_MATCH* matches, int nb_matches);
+extern BOOL CheckCachedMatches(const PATTERN_SET* set, FILE_WINDOW* w, const CACHED_MATCH* matches, int nb_matches);
+
+/* manifest.c */
+#define SHA256_DIGEST_SIZE 32
+
+enum {
+	FINGERPRINT_PE = 1,		// PE TimeDateStamp + SizeOfImage
+	FINGERPRINT_SHA256,		// SHA-256 of the whole file
+};
+
+typedef struct {
+	uint64_t offset;
+	BYTE_PATTERN pattern;
+} PINNED_PATCH;
+
+typedef struct {
+	int type;
+	DWORD timestamp;
+	DWORD size_of_image;
+	uint8_t sha256[SHA256_DIGEST_SIZE];
+	int nb_patches;
+	PINNED_PATCH* patches;
+} PINNED_BLOCK;
+
+typedef struct {
+	int nb_blocks;
+	PINNED_BLOCK* blocks;
+	BOOL need_sha256;
+} PINNED_MANIFEST;
+
+extern BOOL Sha256(FILE_WINDOW* w, uint8_t* digest);
+extern BOOL ParseHexDigest(const char* str, uint8_t* digest, size_t size);
+extern PINNED_MANIFEST* ReadPinnedManifest(const char* path);
+extern void FreePinnedManifest(PINNED_MANIFEST* manifest);
+extern const PINNED_BLOCK* FindPinnedBlock(const PINNED_MANIFEST* manifest, FILE_WINDOW* w);
+extern BOOL CheckPinnedBlock(const PINNED_BLOCK* block, FILE_WINDOW* w);
+
+/* patch.c */
+// A single modification to apply to a file
+typedef struct {
+	uint64_t offset;
+	uint32_t len;
+	BOOL qword;				// Whether to display the edit as a QWORD
+	int pattern;			// Index of the pattern in the set, or -1 for pinned edits
+	const uint8_t* patched;
+	const uint8_t* mask;	// Bytes of patched[] to write, or NULL for all of them
+} PATCH_EDIT;
+
+typedef struct {
+	const PATTERN_SET* set;
+	PATCH_EDIT* edits;
+	int nb_edits;
+	int max_edits;
+} EDIT_LIST;
+
+extern int ScanFile(FILE_WINDOW* w, const SCAN_RANGE* ranges, int nb_ranges, const PATTERN_SET* set, BOOL stop_early,
+	EDIT_LIST* list);
+extern int ScanAndCopyFile(FILE_WINDOW* w, FILE_WINDOW* out, const SCAN_RANGE* ranges, int nb_ranges,
+	const PATTERN_SET* set, BOOL stop_early, EDIT_LIST* list);
+extern BOOL ApplyEdits(FILE_WINDOW* w, const EDIT_LIST* list, uint64_t checksum_offset, uint32_t* delta);
+extern void GetPatchedData(const uint8_t* old_data, const PATCH_EDIT* edit, uint8_t* data);
+extern void FormatEditData(char* str, const uint8_t* data, uint32_t len, BOOL qword);
+extern void PrintEdit(const uint8_t* old_data, const PATCH_EDIT* edit, const uint8_t* data);
+extern int AddPinnedEdits(const PINNED_BLOCK* block, EDIT_LIST* list);
+extern int AddCachedEdits(const PATTERN_SET* set, const CACHED_MATCH* matches, int nb_matches, EDIT_LIST* list);
+
+/* verify.c */
+// The SHA-256 of a patched file
+typedef struct {
+	char* path;
+	BOOL valid;
+	uint8_t sha256[SHA256_DIGEST_SIZE];
+} HASH_RECORD;
+
+typedef struct {
+	BOOL pe;				// Whether the file is a PE image, for which the following are set
+	BOOL has_signature;
+	DWORD checksum;			// Value of the CheckSum field
+	DWORD computed_checksum;
+	uint8_t sha256[SHA256_DIGEST_SIZE];
+} IMAGE_CHECK;
+
+extern BOOL CheckImage(FILE_WINDOW* w, IMAGE_CHECK* check);
+extern HASH_RECORD* ReadHashRecords(const char* path, int* nb_records);
+extern BOOL WriteHashRecords(const char* path, const HASH_RECORD* records, int nb_records);
+extern void FreeHashRecords(HASH_RECORD* records, int nb_records);
+
+/* backup.c */
+typedef enum {
+	BACKUP_FULL = 0,
+	BACKUP_CLONE,
+	BACKUP_DELTA,
+} BACKUP_MODE;
+
+extern BOOL CreateBackup(const char* path, BACKUP_MODE mode);
+extern BOOL WriteDeltaBackup(const char* path, FILE_WINDOW* w, const SCAN_RANGE* ranges, int nb_ranges);
+extern BOOL RestoreFile(const char* path);
+
+/* log.c */
+typedef struct {
+	char* data;
+	size_t len;
+	size_t size;
+} LOG_BUFFER;
+
+extern void lprintf(FILE* stream, const char* format, ...);
+extern void ReserveStdout(void);
+extern void SetThreadLog(LOG_BUFFER* log);
+extern void FlushLog(LOG_BUFFER* log);
+extern BOOL StartLogBuffering(LOG_BUFFER* log);
+extern void EndLogBuffering(LOG_BUFFER* log, BOOL started);
+
+/* pool.c */
+typedef int (*JOB_FUNC)(void* ctx, int index);
+
+extern int GetDefaultNumberOfThreads(void);
+extern BOOL RunJobs(int nb_jobs, int nb_threads, JOB_FUNC func, void* ctx, int* results);
+
+/* readahead.c */
+typedef struct _READ_AHEAD READ_AHEAD;
+
+extern READ_AHEAD* StartReadAhead(char* const* paths, int nb_files, int depth);
+extern void AdvanceReadAhead(READ_AHEAD* ra, int index);
+extern void StopReadAhead(READ_AHEAD* ra);
+
+/* timing.c */
+enum {
+	STAGE_OWNERSHIP,
+	STAGE_BACKUP,
+	STAGE_OPEN,
+	STAGE_MAP,
+	STAGE_SCAN,
+	STAGE_PATCH,
+	STAGE_CHECKSUM,			// Includes the removal of the digital signature
+	STAGE_FLUSH,
+	STAGE_SIGN,
+	NB_STAGES
+};
+
+typedef struct {
+	const char* path;
+	int result;
+	uint64_t ticks[NB_STAGES];
+	uint64_t total_ticks;
+	uint64_t bytes_scanned;
+	uint32_t nb_matches;
+	uint32_t nb_opens;
+	uint32_t nb_maps;
+} FILE_STATS;
+
+extern uint64_t GetTicks(void);
+extern double TicksToMs(uint64_t ticks);
+extern BOOL WriteTimings(const char* path, const FILE_STATS* stats, int nb_files, uint64_t wall_ticks, uint64_t keygen_ticks);
+extern void WriteJsonString(FILE* fd, const char* str);
+
+/* report.c */
+// A match, as recorded for the report, before it was patched
+typedef struct {
+	uint64_t offset;
+	uint32_t len;
+	BOOL qword;
+	char section[IMAGE_SIZEOF_SHORT_NAME + 1];	// Empty if the data is not part of a section
+	uint8_t* data;			// The original data, followed by the patched data
+} MATCH_ENTRY;
+
+typedef struct {
+	MATCH_ENTRY* entries;
+	uint8_t* data;
+	int nb_entries;
+} MATCH_REPORT;
+
+extern BOOL AddReportEntries(MATCH_REPORT* report, FILE_WINDOW* w, PIMAGE_NT_HEADERS32 pImageNTHeader32,
+	const EDIT_LIST* list);
+extern void FreeMatchReports(MATCH_REPORT* reports, int nb_reports);
+extern BOOL WriteMatchReport(const char* path, const FILE_STATS* stats, const MATCH_REPORT* reports, int nb_files);
+
+/* winpki.c */
+// Large enough for the SHA-1 hashes that catalogs use
+#define CATALOG_HASH_MAX_SIZE 32
+
+typedef struct {
+	DWORD len;				// 0 if the file is not part of the catalog
+	BYTE data[CATALOG_HASH_MAX_SIZE];
+	GUID subject;			// Subject Interface Package the file was hashed with
+} CATALOG_HASH;
+
+extern uint64_t GetKeyGenerationTicks(const SIGNING_SESSION* session);
+extern BOOL HashCatalogMember(LPCSTR szFileName, HANDLE hFile, CATALOG_HASH* hash);
+extern BOOL CreateSignedCatalog(SIGNING_SESSION* session, LPCSTR szCatPath, char* const* szFileNames,
+	const CATALOG_HASH* hashes, int nb_files);
+extern BOOL SelfSignFile(LPCSTR szFileName, LPCSTR szCertSubject);
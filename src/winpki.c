@@ -27,13 +27,19 @@
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #include <wincrypt.h>
+#include <wintrust.h>
+#include <mscat.h>
+#include <ncrypt.h>
 #include <stdio.h>
 #include <stdint.h>
 
 #include "mssign32.h"
 #include "msapi_utf8.h"
+#include "winpatch.h"
 
 #pragma comment(lib, "crypt32.lib")
+#pragma comment(lib, "ncrypt.lib")
+#pragma comment(lib, "wintrust.lib")
 
 #define safe_sprintf(dst, count, ...) do {_snprintf_s(dst, count, _TRUNCATE, __VA_ARGS__); (dst)[(count)-1] = 0; } while(0)
 #define static_sprintf(dst, ...) safe_sprintf(dst, sizeof(dst), __VA_ARGS__)
@@ -57,10 +63,36 @@ static __inline HMODULE GetLibraryHandle(char* szDLLName)
 #define PF_INIT(proc, name) if (h##name == NULL) h##name = GetLibraryHandle(#name); \
 	pf##proc = (proc##_t) GetProcAddress(h##name, #proc)
 #define PF_INIT_OR_OUT(proc, name) PF_INIT(proc, name); if (pf##proc == NULL) { \
-	fprintf(stderr, "Unable to locate %s() in %s\n", #proc, #name); goto out; }
+	lprintf(stderr, "Unable to locate %s() in %s\n", #proc, #name); goto out; }
 
 #define KEY_CONTAINER L"winpatch key container"
 
+/*
+ * Delete the key container used for the self signed certificate
+ */
+static BOOL DeleteKeyContainer(SIGNING_KEY_TYPE key_type)
+{
+	HCRYPTPROV hCSP = 0;
+	NCRYPT_PROV_HANDLE hProv = 0;
+	NCRYPT_KEY_HANDLE hKey = 0;
+	SECURITY_STATUS status;
+
+	if (key_type == KEY_RSA4096)
+		return CryptAcquireContextW(&hCSP, KEY_CONTAINER, NULL, PROV_RSA_FULL, CRYPT_MACHINE_KEYSET|CRYPT_SILENT|CRYPT_DELETEKEYSET);
+
+	status = NCryptOpenStorageProvider(&hProv, MS_KEY_STORAGE_PROVIDER, 0);
+	if (status == ERROR_SUCCESS)
+		status = NCryptOpenKey(hProv, &hKey, KEY_CONTAINER, 0, NCRYPT_MACHINE_KEY_FLAG|NCRYPT_SILENT_FLAG);
+	// NCryptDeleteKey() also frees the key handle
+	if (status == ERROR_SUCCESS)
+		status = NCryptDeleteKey(hKey, NCRYPT_SILENT_FLAG);
+	if (hProv != 0)
+		NCryptFreeObject(hProv);
+	if (status != ERROR_SUCCESS)
+		SetLastError((DWORD)status);
+	return (status == ERROR_SUCCESS);
+}
+
 static char* winpki_error_str(void)
 {
 	static char error_string[64];
@@ -166,13 +198,18 @@ static char* winpki_error_str(void)
  */
 
 /*
- * Create a self signed certificate for code signing
+ * Create a self signed certificate for code signing. RSA-4096 keys are generated through
+ * the legacy CryptoAPI provider, whereas the faster RSA-2048 and ECDSA P-256 keys are
+ * generated through the CNG Key Storage Provider.
  */
-PCCERT_CONTEXT CreateSelfSignedCert(LPCSTR szCertSubject)
+PCCERT_CONTEXT CreateSelfSignedCert(LPCSTR szCertSubject, SIGNING_KEY_TYPE key_type)
 {
-	DWORD dwSize = 0;
+	DWORD dwSize = 0, dwLength = 2048, dwUsage = NCRYPT_ALLOW_SIGNING_FLAG;
 	HCRYPTPROV hCSP = 0;
 	HCRYPTKEY hKey = 0;
+	NCRYPT_PROV_HANDLE hProv = 0;
+	NCRYPT_KEY_HANDLE hNKey = 0;
+	SECURITY_STATUS status;
 	PCCERT_CONTEXT pCertContext = NULL;
 	CERT_NAME_BLOB SubjectIssuerBlob = {0, NULL};
 	CRYPT_KEY_PROV_INFO KeyProvInfo;
@@ -200,7 +237,7 @@ PCCERT_CONTEXT CreateSelfSignedCert(LPCSTR szCertSubject)
 	if ( (!CryptEncodeObject(X509_ASN_ENCODING, X509_ENHANCED_KEY_USAGE, (LPVOID)&certEnhKeyUsage, NULL, &dwSize))
 	  || ((pbEnhKeyUsage = (BYTE*)malloc(dwSize)) == NULL)
 	  || (!CryptEncodeObject(X509_ASN_ENCODING, X509_ENHANCED_KEY_USAGE, (LPVOID)&certEnhKeyUsage, pbEnhKeyUsage, &dwSize)) ) {
-		fprintf(stderr, "Could not setup EKU for code signing: %s\n", winpki_error_str());
+		lprintf(stderr, "Could not setup EKU for code signing: %s\n", winpki_error_str());
 		goto out;
 	}
 	certExtension[0].pszObjId = szOID_ENHANCED_KEY_USAGE;
@@ -212,7 +249,7 @@ PCCERT_CONTEXT CreateSelfSignedCert(LPCSTR szCertSubject)
 	if ( (!CryptEncodeObject(X509_ASN_ENCODING, X509_ALTERNATE_NAME, (LPVOID)&certAltNameInfo, NULL, &dwSize))
 	  || ((pbAltNameInfo = (BYTE*)malloc(dwSize)) == NULL)
 	  || (!CryptEncodeObject(X509_ASN_ENCODING, X509_ALTERNATE_NAME, (LPVOID)&certAltNameInfo, pbAltNameInfo, &dwSize)) ) {
-		fprintf(stderr, "Could not set Alt Name: %s\n", winpki_error_str());
+		lprintf(stderr, "Could not set Alt Name: %s\n", winpki_error_str());
 		goto out;
 	}
 	certExtension[1].pszObjId = szOID_SUBJECT_ALT_NAME;
@@ -227,7 +264,7 @@ PCCERT_CONTEXT CreateSelfSignedCert(LPCSTR szCertSubject)
 	if ( (!CryptEncodeObject(X509_ASN_ENCODING, X509_NAME_VALUE, (LPVOID)&certCPSValue, NULL, &dwSize))
 		|| ((pbCPSNotice = (BYTE*)malloc(dwSize)) == NULL)
 		|| (!CryptEncodeObject(X509_ASN_ENCODING, X509_NAME_VALUE, (LPVOID)&certCPSValue, pbCPSNotice, &dwSize)) ) {
-		fprintf(stderr, "Could not setup CPS: %s\n", winpki_error_str());
+		lprintf(stderr, "Could not setup CPS: %s\n", winpki_error_str());
 		goto out;
 	}
 
@@ -237,7 +274,7 @@ PCCERT_CONTEXT CreateSelfSignedCert(LPCSTR szCertSubject)
 	if ( (!CryptEncodeObject(X509_ASN_ENCODING, X509_CERT_POLICIES, (LPVOID)&certPolicyInfoArray, NULL, &dwSize))
 		|| ((pbPolicyInfo = (BYTE*)malloc(dwSize)) == NULL)
 		|| (!CryptEncodeObject(X509_ASN_ENCODING, X509_CERT_POLICIES, (LPVOID)&certPolicyInfoArray, pbPolicyInfo, &dwSize)) ) {
-		fprintf(stderr, "Could not setup Certificate Policies: %s\n", winpki_error_str());
+		lprintf(stderr, "Could not setup Certificate Policies: %s\n", winpki_error_str());
 		goto out;
 	}
 	certExtension[2].pszObjId = szOID_CERT_POLICIES;
@@ -248,48 +285,76 @@ PCCERT_CONTEXT CreateSelfSignedCert(LPCSTR szCertSubject)
 	certExtensionsArray.cExtension = ARRAYSIZE(certExtension);
 	certExtensionsArray.rgExtension = certExtension;
 
-	if (CryptAcquireContextW(&hCSP, wszKeyContainer, NULL, PROV_RSA_FULL, CRYPT_MACHINE_KEYSET|CRYPT_SILENT)) {
-		fprintf(stderr, "Acquired existing key container\n");
-	} else if ( (GetLastError() != NTE_BAD_KEYSET)
-			 || (!CryptAcquireContextW(&hCSP, wszKeyContainer, NULL, PROV_RSA_FULL, CRYPT_NEWKEYSET|CRYPT_MACHINE_KEYSET|CRYPT_SILENT)) ) {
-		fprintf(stderr, "Could not obtain a key container: %s\n", winpki_error_str());
-		goto out;
-	}
+	if (key_type == KEY_RSA4096) {
+		if (CryptAcquireContextW(&hCSP, wszKeyContainer, NULL, PROV_RSA_FULL, CRYPT_MACHINE_KEYSET|CRYPT_SILENT)) {
+			lprintf(stderr, "Acquired existing key container\n");
+		} else if ( (GetLastError() != NTE_BAD_KEYSET)
+				 || (!CryptAcquireContextW(&hCSP, wszKeyContainer, NULL, PROV_RSA_FULL, CRYPT_NEWKEYSET|CRYPT_MACHINE_KEYSET|CRYPT_SILENT)) ) {
+			lprintf(stderr, "Could not obtain a key container: %s\n", winpki_error_str());
+			goto out;
+		}
 
-	// Generate key pair using RSA 4096
-	// (Key_size <<16) because key size is in upper 16 bits
-	if (!CryptGenKey(hCSP, AT_SIGNATURE, (4096U<<16) | CRYPT_EXPORTABLE, &hKey)) {
-		fprintf(stderr, "Could not generate keypair: %s\n", winpki_error_str());
-		goto out;
+		// Generate key pair using RSA 4096
+		// (Key_size <<16) because key size is in upper 16 bits
+		if (!CryptGenKey(hCSP, AT_SIGNATURE, (4096U<<16) | CRYPT_EXPORTABLE, &hKey)) {
+			lprintf(stderr, "Could not generate keypair: %s\n", winpki_error_str());
+			goto out;
+		}
+	} else {
+		// Any key left over from an interrupted run gets overwritten
+		status = NCryptOpenStorageProvider(&hProv, MS_KEY_STORAGE_PROVIDER, 0);
+		if (status == ERROR_SUCCESS)
+			status = NCryptCreatePersistedKey(hProv, &hNKey, (key_type == KEY_ECDSA_P256) ?
+				NCRYPT_ECDSA_P256_ALGORITHM : NCRYPT_RSA_ALGORITHM, wszKeyContainer, 0,
+				NCRYPT_MACHINE_KEY_FLAG|NCRYPT_OVERWRITE_KEY_FLAG);
+		if ((status == ERROR_SUCCESS) && (key_type == KEY_RSA2048))
+			status = NCryptSetProperty(hNKey, NCRYPT_LENGTH_PROPERTY, (PBYTE)&dwLength, sizeof(dwLength), 0);
+		if (status == ERROR_SUCCESS)
+			status = NCryptSetProperty(hNKey, NCRYPT_KEY_USAGE_PROPERTY, (PBYTE)&dwUsage, sizeof(dwUsage), 0);
+		if (status == ERROR_SUCCESS)
+			status = NCryptFinalizeKey(hNKey, NCRYPT_SILENT_FLAG);
+		if (status != ERROR_SUCCESS) {
+			SetLastError((DWORD)status);
+			lprintf(stderr, "Could not generate keypair: %s\n", winpki_error_str());
+			goto out;
+		}
 	}
 
 	// Set the subject
 	if ( (!CertStrToNameA(X509_ASN_ENCODING, szCertSubject, CERT_X500_NAME_STR, NULL, NULL, &SubjectIssuerBlob.cbData, NULL))
 	  || ((SubjectIssuerBlob.pbData = (BYTE*)malloc(SubjectIssuerBlob.cbData)) == NULL)
 	  || (!CertStrToNameA(X509_ASN_ENCODING, szCertSubject, CERT_X500_NAME_STR, NULL, SubjectIssuerBlob.pbData, &SubjectIssuerBlob.cbData, NULL)) ) {
-		fprintf(stderr, "Could not encode subject name for self signed cert: %s\n", winpki_error_str());
+		lprintf(stderr, "Could not encode subject name for self signed cert: %s\n", winpki_error_str());
 		goto out;
 	}
 
 	// Prepare key provider structure for self-signed certificate
 	memset(&KeyProvInfo, 0, sizeof(KeyProvInfo));
 	KeyProvInfo.pwszContainerName = wszKeyContainer;
-	KeyProvInfo.pwszProvName = NULL;
-	KeyProvInfo.dwProvType = PROV_RSA_FULL;
-	KeyProvInfo.dwFlags = CRYPT_MACHINE_KEYSET;
+	if (key_type == KEY_RSA4096) {
+		KeyProvInfo.pwszProvName = NULL;
+		KeyProvInfo.dwProvType = PROV_RSA_FULL;
+		KeyProvInfo.dwFlags = CRYPT_MACHINE_KEYSET;
+		KeyProvInfo.dwKeySpec = AT_SIGNATURE;
+	} else {
+		// A provider type of 0 indicates a CNG key
+		KeyProvInfo.pwszProvName = MS_KEY_STORAGE_PROVIDER;
+		KeyProvInfo.dwProvType = 0;
+		KeyProvInfo.dwFlags = NCRYPT_MACHINE_KEY_FLAG;
+		KeyProvInfo.dwKeySpec = 0;
+	}
 	KeyProvInfo.cProvParam = 0;
 	KeyProvInfo.rgProvParam = NULL;
-	KeyProvInfo.dwKeySpec = AT_SIGNATURE;
 
 	// Prepare algorithm structure for self-signed certificate
 	memset(&SignatureAlgorithm, 0, sizeof(SignatureAlgorithm));
-	SignatureAlgorithm.pszObjId = szOID_RSA_SHA256RSA;
+	SignatureAlgorithm.pszObjId = (key_type == KEY_ECDSA_P256) ? szOID_ECDSA_SHA256 : szOID_RSA_SHA256RSA;
 
 	// Create self-signed certificate
-	pCertContext = CertCreateSelfSignCertificate((ULONG_PTR)NULL,
+	pCertContext = CertCreateSelfSignCertificate((HCRYPTPROV_OR_NCRYPT_KEY_HANDLE)hNKey,
 		&SubjectIssuerBlob, 0, &KeyProvInfo, &SignatureAlgorithm, NULL, &sExpirationDate, &certExtensionsArray);
 	if (pCertContext == NULL) {
-		fprintf(stderr, "Could not create self signed certificate: %s\n", winpki_error_str());
+		lprintf(stderr, "Could not create self signed certificate: %s\n", winpki_error_str());
 		goto out;
 	}
 
@@ -303,80 +368,171 @@ out:
 		CryptDestroyKey(hKey);
 	if (hCSP)
 		CryptReleaseContext(hCSP, 0);
+	if (hNKey)
+		NCryptFreeObject(hNKey);
+	if (hProv)
+		NCryptFreeObject(hProv);
 	return pCertContext;
 }
 
 /*
- * Delete the private key associated with a specific cert
+ * Delete the private key of the self signed certificate
  */
-BOOL DeletePrivateKey(PCCERT_CONTEXT pCertContext)
+static BOOL DeletePrivateKey(SIGNING_KEY_TYPE key_type)
 {
-	LPWSTR wszKeyContainer = KEY_CONTAINER;
-	HCRYPTPROV hCSP = 0;
-	DWORD dwKeySpec;
-	BOOL bFreeCSP = FALSE, r = FALSE;
-	HCERTSTORE hSystemStore;
-	LPCSTR szStoresToUpdate[2] = { "Root", "TrustedPublisher" };
-	CRYPT_DATA_BLOB libwdiNameBlob = {14, (BYTE*)L"libwdi"};
-	PCCERT_CONTEXT pCertContextUpdate = NULL;
-	int i;
-
-	if (!CryptAcquireCertificatePrivateKey(pCertContext, CRYPT_ACQUIRE_SILENT_FLAG, NULL, &hCSP, &dwKeySpec, &bFreeCSP)) {
-		fprintf(stderr, "Error getting CSP: %s\n", winpki_error_str());
-		goto out;
+	if (!DeleteKeyContainer(key_type)) {
+		lprintf(stderr, "Failed to delete private key: %s\n", winpki_error_str());
+		return FALSE;
 	}
+	return TRUE;
+}
 
-	if (!CryptAcquireContextW(&hCSP, wszKeyContainer, NULL, PROV_RSA_FULL, CRYPT_MACHINE_KEYSET|CRYPT_SILENT|CRYPT_DELETEKEYSET)) {
-		fprintf(stderr, "Failed to delete private key: %s\n", winpki_error_str());
-	}
+// System stores the self signed certificate must be added to, for the signatures to be trusted
+static LPCSTR szTrustStores[] = { "Root", "TrustedPublisher" };
+
+struct _SIGNING_SESSION {
+	HMODULE hMSSign32;
+	SignerSignEx_t pfSignerSignEx;
+	SignerFreeSignerContext_t pfSignerFreeSignerContext;
+	LPSTR szCertSubject;
+	SIGNING_KEY_TYPE key_type;
+	PCCERT_CONTEXT pCertContext;
+	BOOL bCertFailed;
+	uint64_t keygen_ticks;
+	HCERTSTORE hTrustStores[ARRAYSIZE(szTrustStores)];
+	CRITICAL_SECTION lock;
+};
+
+/*
+ * Add the session certificate to the trust stores. This is only done once per session,
+ * right after the certificate is created, through store handles that remain open until
+ * the session is closed, as accessing the system stores can be slow.
+ * Only the encoded certificate is added, so that the stores never reference the private
+ * key, which is deleted at the end of the session.
+ */
+static void AddCertToTrustStores(SIGNING_SESSION* session)
+{
+	CRYPT_DATA_BLOB libwdiNameBlob = {14, (BYTE*)L"libwdi"};
+	PCCERT_CONTEXT pCertContextStore = NULL;
+	int i;
 
-	// This is optional, but unless we reimport the cert data after having deleted the key
-	// end users will still see a "You have a private key that corresponds to this certificate" message.
-	for (i=0; i<ARRAYSIZE(szStoresToUpdate); i++) {
-		hSystemStore = CertOpenStore(CERT_STORE_PROV_SYSTEM_A, X509_ASN_ENCODING,
-			0, CERT_SYSTEM_STORE_LOCAL_MACHINE, szStoresToUpdate[i]);
-		if (hSystemStore == NULL) continue;
-
-		if ( (CertAddEncodedCertificateToStore(hSystemStore, X509_ASN_ENCODING, pCertContext->pbCertEncoded,
-			pCertContext->cbCertEncoded, CERT_STORE_ADD_REPLACE_EXISTING, &pCertContextUpdate)) && (pCertContextUpdate != NULL) ) {
-			// The friendly name is lost in this operation - restore it
-			if (!CertSetCertificateContextProperty(pCertContextUpdate, CERT_FRIENDLY_NAME_PROP_ID, 0, &libwdiNameBlob)) {
-				fprintf(stderr, "Could not set friendly name: %s\n", winpki_error_str());
+	for (i = 0; i < ARRAYSIZE(szTrustStores); i++) {
+		if (session->hTrustStores[i] == NULL)
+			session->hTrustStores[i] = CertOpenStore(CERT_STORE_PROV_SYSTEM_A, X509_ASN_ENCODING,
+				0, CERT_SYSTEM_STORE_LOCAL_MACHINE, szTrustStores[i]);
+		if (session->hTrustStores[i] == NULL) {
+			lprintf(stderr, "Failed to open '%s': %s\n", szTrustStores[i], winpki_error_str());
+			continue;
+		}
+		if ( (CertAddEncodedCertificateToStore(session->hTrustStores[i], X509_ASN_ENCODING,
+			session->pCertContext->pbCertEncoded, session->pCertContext->cbCertEncoded,
+			CERT_STORE_ADD_REPLACE_EXISTING, &pCertContextStore)) && (pCertContextStore != NULL) ) {
+			if (!CertSetCertificateContextProperty(pCertContextStore, CERT_FRIENDLY_NAME_PROP_ID, 0, &libwdiNameBlob)) {
+				lprintf(stderr, "Could not set friendly name: %s\n", winpki_error_str());
 			}
-			CertFreeCertificateContext(pCertContextUpdate);
+			CertFreeCertificateContext(pCertContextStore);
+			pCertContextStore = NULL;
 		} else {
-			fprintf(stderr, "Failed to update '%s': %s\n", szStoresToUpdate[i], winpki_error_str());
+			lprintf(stderr, "Failed to update '%s': %s\n", szTrustStores[i], winpki_error_str());
 		}
-		CertCloseStore(hSystemStore, 0);
 	}
+}
 
-	r= TRUE;
+// Session whose private key must be deleted if the user aborts the process
+static SIGNING_SESSION* volatile active_session = NULL;
 
-out:
-	if ((bFreeCSP) && (hCSP)) {
-		CryptReleaseContext(hCSP, 0);
+/*
+ * Make sure that we don't leave a private key behind on Ctrl-C/Ctrl-Break
+ */
+static BOOL WINAPI SigningCtrlHandler(DWORD dwCtrlType)
+{
+	if (active_session != NULL && active_session->pCertContext != NULL)
+		DeleteKeyContainer(active_session->key_type);
+	// Let the default handler terminate the process
+	return FALSE;
+}
+
+/*
+ * Open a signing session. The self signed certificate and its private key are
+ * only created when the first file is signed, and are then reused for all the
+ * files signed during the session, until CloseSigningSession() is called.
+ */
+SIGNING_SESSION* OpenSigningSession(LPCSTR szCertSubject, SIGNING_KEY_TYPE key_type)
+{
+	SIGNING_SESSION* session = calloc(1, sizeof(SIGNING_SESSION));
+
+	if (session == NULL)
+		return NULL;
+	session->hMSSign32 = LoadLibraryA("MSSign32");
+	if (session->hMSSign32 == NULL) {
+		lprintf(stderr, "Unable to load MSSign32: %s\n", winpki_error_str());
+		goto out;
 	}
-	return r;
+	session->pfSignerSignEx = (SignerSignEx_t)GetProcAddress(session->hMSSign32, "SignerSignEx");
+	session->pfSignerFreeSignerContext = (SignerFreeSignerContext_t)
+		GetProcAddress(session->hMSSign32, "SignerFreeSignerContext");
+	if (session->pfSignerSignEx == NULL || session->pfSignerFreeSignerContext == NULL) {
+		lprintf(stderr, "Unable to locate signing functions in MSSign32\n");
+		goto out;
+	}
+	session->key_type = key_type;
+	session->szCertSubject = _strdup(szCertSubject);
+	if (session->szCertSubject == NULL)
+		goto out;
+	InitializeCriticalSection(&session->lock);
+	active_session = session;
+	SetConsoleCtrlHandler(SigningCtrlHandler, TRUE);
+	return session;
+
+out:
+	if (session->hMSSign32 != NULL)
+		FreeLibrary(session->hMSSign32);
+	free(session);
+	return NULL;
 }
 
 /*
- * Digitally sign a file by:
- * - creating a self signed certificate for code signing
- * - signing the file provided
- * - deleting the self signed certificate private key
+ * Close a signing session, delete the private key that was created for it, and
+ * close the trust stores.
  */
-BOOL SelfSignFile(LPCSTR szFileName, LPCSTR szCertSubject)
+void CloseSigningSession(SIGNING_SESSION* session)
 {
-	PF_DECL_LOAD_LIBRARY(MSSign32);
-	PF_DECL(SignerSignEx);
-	PF_DECL(SignerFreeSignerContext);
+	int i;
 
+	if (session == NULL)
+		return;
+	if (session->pCertContext != NULL) {
+		DeletePrivateKey(session->key_type);
+		CertFreeCertificateContext(session->pCertContext);
+	}
+	for (i = 0; i < ARRAYSIZE(szTrustStores); i++) {
+		if (session->hTrustStores[i] != NULL)
+			CertCloseStore(session->hTrustStores[i], 0);
+	}
+	if (active_session == session) {
+		SetConsoleCtrlHandler(SigningCtrlHandler, FALSE);
+		active_session = NULL;
+	}
+	DeleteCriticalSection(&session->lock);
+	FreeLibrary(session->hMSSign32);
+	free(session->szCertSubject);
+	free(session);
+}
+
+/*
+ * Digitally sign a file with the session certificate, which gets created on first use.
+ * If hFile is not NULL, it must be a read/write handle to the file, which is then used
+ * instead of having the file reopened. This call can be issued concurrently from
+ * multiple threads.
+ */
+BOOL SignFile(SIGNING_SESSION* session, LPCSTR szFileName, HANDLE hFile)
+{
 	BOOL r = FALSE;
-	LPWSTR wszFileName = NULL;
 	HRESULT hResult = S_OK;
-	PCCERT_CONTEXT pCertContext = NULL;
+	PCCERT_CONTEXT pCertContext;
+	uint64_t start;
 	DWORD dwIndex;
-	SIGNER_FILE_INFO signerFileInfo;
+	SIGNER_FILE_INFO signerFileInfo = { 0 };
 	SIGNER_SUBJECT_INFO signerSubjectInfo;
 	SIGNER_CERT_STORE_INFO signerCertStoreInfo;
 	SIGNER_CERT signerCert;
@@ -388,22 +544,32 @@ BOOL SelfSignFile(LPCSTR szFileName, LPCSTR szCertSubject)
 	BYTE pbOidSpOpusInfo[] = SP_OPUS_INFO_DATA;
 	BYTE pbOidStatementType[] = STATEMENT_TYPE_DATA;
 
-	PF_INIT_OR_OUT(SignerSignEx, MSSign32);
-	PF_INIT_OR_OUT(SignerFreeSignerContext, MSSign32);
-
-	pCertContext = CreateSelfSignedCert(szCertSubject);
-	if (pCertContext == NULL) {
-		goto out;
+	if (session == NULL)
+		return FALSE;
+
+	// Generating the key is slow, so we only want to do it once for the session
+	EnterCriticalSection(&session->lock);
+	if (session->pCertContext == NULL && !session->bCertFailed) {
+		start = GetTicks();
+		session->pCertContext = CreateSelfSignedCert(session->szCertSubject, session->key_type);
+		session->bCertFailed = (session->pCertContext == NULL);
+		session->keygen_ticks = GetTicks() - start;
+		if (session->pCertContext != NULL)
+			AddCertToTrustStores(session);
 	}
+	pCertContext = session->pCertContext;
+	LeaveCriticalSection(&session->lock);
+	if (pCertContext == NULL)
+		goto out;
 
 	// Setup SIGNER_FILE_INFO struct
 	signerFileInfo.cbSize = sizeof(SIGNER_FILE_INFO);
 	signerFileInfo.pwszFileName = utf8_to_wchar(szFileName);
 	if (signerFileInfo.pwszFileName == NULL) {
-		fprintf(stderr, "Unable to convert '%s' to UTF16\n", szFileName);
+		lprintf(stderr, "Unable to convert '%s' to UTF16\n", szFileName);
 		goto out;
 	}
-	signerFileInfo.hFile = NULL;
+	signerFileInfo.hFile = hFile;
 
 	// Prepare SIGNER_SUBJECT_INFO struct
 	signerSubjectInfo.cbSize = sizeof(SIGNER_SUBJECT_INFO);
@@ -447,22 +613,177 @@ BOOL SelfSignFile(LPCSTR szFileName, LPCSTR szCertSubject)
 	signerSignatureInfo.psUnauthenticated = NULL;
 
 	// Sign file with cert
-	hResult = pfSignerSignEx(0, &signerSubjectInfo, &signerCert, &signerSignatureInfo, NULL, NULL, NULL, NULL, &pSignerContext);
+	hResult = session->pfSignerSignEx(0, &signerSubjectInfo, &signerCert, &signerSignatureInfo, NULL, NULL, NULL, NULL, &pSignerContext);
 	if (hResult != S_OK) {
 		SetLastError(hResult);
-		fprintf(stderr, "SignerSignEx failed: %s\n", winpki_error_str());
+		lprintf(stderr, "SignerSignEx failed: %s\n", winpki_error_str());
 		goto out;
 	}
 	r = TRUE;
 
 out:
-	if (pCertContext != NULL)
-		DeletePrivateKey(pCertContext);
-	free((void*)wszFileName);
+	free((void*)signerFileInfo.pwszFileName);
 	if (pSignerContext != NULL)
-		pfSignerFreeSignerContext(pSignerContext);
-	if (pCertContext != NULL)
-		CertFreeCertificateContext(pCertContext);
-	PF_FREE_LIBRARY(MSSign32);
+		session->pfSignerFreeSignerContext(pSignerContext);
+	return r;
+}
+
+/*
+ * Return the time that was spent creating the session certificate and its key.
+ */
+uint64_t GetKeyGenerationTicks(const SIGNING_SESSION* session)
+{
+	return (session == NULL) ? 0 : session->keygen_ticks;
+}
+
+/*
+ * Compute the hash by which a file is referenced in a catalog, using a read handle
+ * to it. For a PE image, this is the Authenticode hash, which leaves out the CheckSum
+ * field and any embedded signature. This call can be issued concurrently from multiple
+ * threads.
+ */
+BOOL HashCatalogMember(LPCSTR szFileName, HANDLE hFile, CATALOG_HASH* hash)
+{
+	BOOL r = FALSE;
+	LPWSTR wszFileName = NULL;
+
+	memset(hash, 0, sizeof(CATALOG_HASH));
+	wszFileName = utf8_to_wchar(szFileName);
+	if (wszFileName == NULL) {
+		lprintf(stderr, "Unable to convert '%s' to UTF16\n", szFileName);
+		goto out;
+	}
+	if (!CryptSIPRetrieveSubjectGuidForCatalogFile(wszFileName, hFile, &hash->subject)) {
+		lprintf(stderr, "Could not get the subject type of '%s': %s\n", szFileName, winpki_error_str());
+		goto out;
+	}
+	hash->len = sizeof(hash->data);
+	if (!CryptCATAdminCalcHashFromFileHandle(hFile, &hash->len, hash->data, 0)) {
+		lprintf(stderr, "Could not hash '%s': %s\n", szFileName, winpki_error_str());
+		hash->len = 0;
+		goto out;
+	}
+	r = TRUE;
+
+out:
+	free(wszFileName);
+	return r;
+}
+
+/*
+ * Create a catalog that covers all the files from szFileNames[] whose hash is set,
+ * and sign it with the session certificate. This allows a whole batch of files to
+ * be validated through a single signing operation.
+ */
+BOOL CreateSignedCatalog(SIGNING_SESSION* session, LPCSTR szCatPath, char* const* szFileNames,
+	const CATALOG_HASH* hashes, int nb_files)
+{
+	BOOL r = FALSE;
+	HANDLE hCat = INVALID_HANDLE_VALUE;
+	LPWSTR wszCatPath = NULL, wszFileName = NULL, wszName;
+	WCHAR wszHash[2 * CATALOG_HASH_MAX_SIZE + 1];
+	// MakeCat uses the same placeholder for the file link of the PE image data
+	WCHAR wszObsolete[] = L"<<<Obsolete>>>";
+	BYTE pbEncoded[128];
+	DWORD cbEncoded, j;
+	SPC_LINK sSPCLink;
+	SPC_PE_IMAGE_DATA sSPCImageData;
+	SIP_INDIRECT_DATA sSIPData;
+	CRYPTCATMEMBER* pCatMember;
+	int i;
+
+	if (session == NULL)
+		return FALSE;
+	wszCatPath = utf8_to_wchar(szCatPath);
+	if (wszCatPath == NULL) {
+		lprintf(stderr, "Unable to convert '%s' to UTF16\n", szCatPath);
+		goto out;
+	}
+	DeleteFileU(szCatPath);
+	hCat = CryptCATOpen(wszCatPath, CRYPTCAT_OPEN_CREATENEW, 0, CRYPTCAT_VERSION_1, 0);
+	if (hCat == INVALID_HANDLE_VALUE) {
+		lprintf(stderr, "Could not create catalog '%s': %s\n", szCatPath, winpki_error_str());
+		goto out;
+	}
+
+	// All the members are PE images, which share the same encoded image data
+	memset(&sSPCLink, 0, sizeof(sSPCLink));
+	sSPCLink.dwLinkChoice = SPC_FILE_LINK_CHOICE;
+	sSPCLink.pwszFile = wszObsolete;
+	memset(&sSPCImageData, 0, sizeof(sSPCImageData));
+	sSPCImageData.pFile = &sSPCLink;
+	cbEncoded = sizeof(pbEncoded);
+	if (!CryptEncodeObject(X509_ASN_ENCODING, SPC_PE_IMAGE_DATA_OBJID, &sSPCImageData, pbEncoded, &cbEncoded)) {
+		lprintf(stderr, "Could not encode PE image data: %s\n", winpki_error_str());
+		goto out;
+	}
+
+	for (i = 0; i < nb_files; i++) {
+		if (hashes[i].len == 0)
+			continue;
+		// The member tag is the hex representation of the hash
+		for (j = 0; j < hashes[i].len; j++)
+			swprintf_s(&wszHash[2 * j], 3, L"%02X", hashes[i].data[j]);
+		memset(&sSIPData, 0, sizeof(sSIPData));
+		sSIPData.Data.pszObjId = SPC_PE_IMAGE_DATA_OBJID;
+		sSIPData.Data.Value.cbData = cbEncoded;
+		sSIPData.Data.Value.pbData = pbEncoded;
+		sSIPData.DigestAlgorithm.pszObjId = szOID_OIWSEC_sha1;
+		sSIPData.Digest.cbData = hashes[i].len;
+		sSIPData.Digest.pbData = (BYTE*)hashes[i].data;
+		pCatMember = CryptCATPutMemberInfo(hCat, NULL, wszHash, (GUID*)&hashes[i].subject, 0x200,
+			sizeof(sSIPData), (BYTE*)&sSIPData);
+		if (pCatMember == NULL) {
+			lprintf(stderr, "Could not add '%s' to catalog: %s\n", szFileNames[i], winpki_error_str());
+			goto out;
+		}
+		wszFileName = utf8_to_wchar(szFileNames[i]);
+		if (wszFileName == NULL) {
+			lprintf(stderr, "Unable to convert '%s' to UTF16\n", szFileNames[i]);
+			goto out;
+		}
+		wszName = wcsrchr(wszFileName, L'\\');
+		wszName = (wszName == NULL) ? wszFileName : wszName + 1;
+		if (CryptCATPutAttrInfo(hCat, pCatMember, L"File", CRYPTCAT_ATTR_AUTHENTICATED | CRYPTCAT_ATTR_NAMEASCII |
+			CRYPTCAT_ATTR_DATAASCII, (DWORD)((wcslen(wszName) + 1) * sizeof(WCHAR)), (BYTE*)wszName) == NULL) {
+			lprintf(stderr, "Could not set catalog attribute of '%s': %s\n", szFileNames[i], winpki_error_str());
+			goto out;
+		}
+		free(wszFileName);
+		wszFileName = NULL;
+	}
+	if (!CryptCATPersistStore(hCat)) {
+		lprintf(stderr, "Could not write catalog '%s': %s\n", szCatPath, winpki_error_str());
+		goto out;
+	}
+	CryptCATClose(hCat);
+	hCat = INVALID_HANDLE_VALUE;
+	r = SignFile(session, szCatPath, NULL);
+
+out:
+	if (hCat != INVALID_HANDLE_VALUE)
+		CryptCATClose(hCat);
+	if (!r)
+		DeleteFileU(szCatPath);
+	free(wszFileName);
+	free(wszCatPath);
+	return r;
+}
+
+/*
+ * Digitally sign a single file by:
+ * - creating a self signed certificate for code signing
+ * - signing the file provided
+ * - deleting the self signed certificate private key
+ */
+BOOL SelfSignFile(LPCSTR szFileName, LPCSTR szCertSubject)
+{
+	BOOL r;
+	SIGNING_SESSION* session = OpenSigningSession(szCertSubject, KEY_RSA4096);
+
+	if (session == NULL)
+		return FALSE;
+	r = SignFile(session, szFileName, NULL);
+	CloseSigningSession(session);
 	return r;
 }